@@ -0,0 +1,529 @@
+/* Load test for the CI server: many idle clients and a fake call monitor.
+ *
+ * usage: ci_load [-c clients] [-n rings] [-i interval-ms] [-s host] [-p port]
+ *                [-f fritz-port] [-t target-ms] [-r db-requests-per-s]
+ *
+ * ci_load listens on fritz-port like the call monitor of a box; configure
+ * fritz2ci with Host = 127.0.0.1 and Port = fritz-port. It connects the
+ * clients to the CI server, waits for all of them to finish the version
+ * handshake and then sends the rings. The fan-out latency of a ring is the
+ * time from writing the RING line until the last client has received the
+ * first stage of the event. Every stage is timestamped per client; the
+ * report gives p50, p99 and max of the delivery latency of each stage, the
+ * fan-out latency and the receive throughput.
+ *
+ * With -r every client also asks for the number of calls and the latest
+ * calls, alternately, at the given rate while the rings are sent. A client
+ * has at most one request outstanding.
+ *
+ * Exit status: 0 ok, 1 setup failed, 2 a ring was lost or the worst fan-out
+ * latency exceeded the target.
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cinet.h>
+
+#define LOAD_DEFAULT_CLIENTS        1000
+#define LOAD_DEFAULT_RINGS          100
+#define LOAD_DEFAULT_INTERVAL       200
+#define LOAD_DEFAULT_PORT           63690
+#define LOAD_DEFAULT_FRITZ_PORT     10120
+#define LOAD_DEFAULT_TARGET         10
+#define LOAD_RING_TIMEOUT           (2 * G_TIME_SPAN_SECOND)
+#define LOAD_SETUP_TIMEOUT          (60 * G_TIME_SPAN_SECOND)
+#define LOAD_EVENTS                 256
+#define LOAD_STAGES                 3
+#define LOAD_DB_TICK                (10 * 1000)
+#define LOAD_DB_LIST_COUNT          20
+
+typedef struct {
+    int fd;
+    gboolean ready;             /* version reply received */
+    guint rings;                /* first stages received so far */
+    gint64 db_next;             /* next db request is due */
+    gint64 db_sent;             /* outstanding request, 0 if none */
+    guint db_count;
+    gchar *buf;
+    gsize len;
+    gsize size;
+} LoadClient;
+
+typedef struct {
+    gint64 sent;
+    gint64 first;
+    gint64 last;
+    guint received;
+} LoadRing;
+
+typedef struct {
+    LoadClient *clients;
+    guint nclients;
+    guint ready;
+    guint dropped;
+    LoadRing *rings;
+    guint nrings;
+    int epfd;
+    GArray *latency[LOAD_STAGES];   /* delivery latency per client and stage */
+    GArray *db_latency;
+    gint64 db_interval;             /* per client, 0 to send no requests */
+    gint64 db_tick;
+    guint64 db_skipped;             /* due while the previous one was outstanding */
+    guint64 messages;
+    guint64 bytes;
+} LoadState;
+
+static const gchar *_load_stage_names[LOAD_STAGES] = { "init", "update", "complete" };
+
+static int _load_compare_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static gint64 _load_percentile(GArray *values, guint pct)
+{
+    if (values->len == 0)
+        return 0;
+    return g_array_index(values, gint64, (guint)(((guint64)values->len - 1) * pct / 100));
+}
+
+static void _load_print_latency(const gchar *name, GArray *values)
+{
+    qsort(values->data, values->len, sizeof(gint64), _load_compare_gint64);
+    printf("%-12s%8u  p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n", name, values->len,
+            _load_percentile(values, 50) / 1e3, _load_percentile(values, 99) / 1e3,
+            _load_percentile(values, 100) / 1e3);
+}
+
+static void _load_raise_fd_limit(guint wanted)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < (rlim_t)wanted + 16)
+        fprintf(stderr, "File limit %lu is too low for %u clients\n", (gulong)rl.rlim_cur, wanted);
+}
+
+static int _load_connect(const gchar *host, gushort port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        return -1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Wait for fritz2ci to connect to the fake call monitor. */
+static int _load_accept_fritz(gushort port)
+{
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    int lfd, fd = -1, one = 1;
+
+    if ((lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0) {
+        fprintf(stderr, "Could not listen on %u: %s\n", port, strerror(errno));
+        close(lfd);
+        return -1;
+    }
+
+    printf("waiting for fritz2ci on port %u\n", port);
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, LOAD_SETUP_TIMEOUT / 1000) == 1)
+        fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    close(lfd);
+
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static gint _load_send_version(LoadClient *client, guint32 guid)
+{
+    gchar *data = NULL;
+    gsize len = 0;
+    gint rc = 0;
+
+    cinet_message_new_for_data(&data, &len, CI_NET_MSG_VERSION,
+            "major", 3, "minor", 0, "patch", 0, "guid", guid, NULL, NULL);
+    if (data == NULL || send(client->fd, data, len, MSG_NOSIGNAL) != (ssize_t)len)
+        rc = 1;
+    g_free(data);
+    return rc;
+}
+
+static gint _load_send_db_request(LoadClient *client, guint32 guid)
+{
+    gchar *data = NULL;
+    gsize len = 0;
+    gint rc = 0;
+
+    if (client->db_count++ & 1)
+        cinet_message_new_for_data(&data, &len, CI_NET_MSG_DB_CALL_LIST,
+                "user", 0, "offset", 0, "count", LOAD_DB_LIST_COUNT, "guid", guid, NULL, NULL);
+    else
+        cinet_message_new_for_data(&data, &len, CI_NET_MSG_DB_NUM_CALLS, "guid", guid, NULL, NULL);
+    if (data == NULL || send(client->fd, data, len, MSG_NOSIGNAL) != (ssize_t)len)
+        rc = 1;
+    g_free(data);
+    return rc;
+}
+
+static void _load_send_db_requests(LoadState *state, gint64 now)
+{
+    LoadClient *client;
+    guint i;
+
+    for (i = 0; i < state->nclients; ++i) {
+        client = &state->clients[i];
+        if (client->fd == -1 || client->db_next > now)
+            continue;
+        while (client->db_next <= now)
+            client->db_next += state->db_interval;
+        if (client->db_sent != 0) {
+            ++state->db_skipped;
+            continue;
+        }
+        if (_load_send_db_request(client, i + 1) == 0)
+            client->db_sent = now;
+    }
+    state->db_tick = now + LOAD_DB_TICK;
+}
+
+static gint _load_stage_index(gint stage)
+{
+    switch (stage) {
+        case MultipartStageInit:
+            return 0;
+        case MultipartStageUpdate:
+            return 1;
+        case MultipartStageComplete:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+static void _load_handle_frame(LoadState *state, LoadClient *client, CINetMsgHeader *header,
+                               gchar *data, gsize len, gint64 now)
+{
+    CINetMsg *msg = NULL;
+    LoadRing *ring;
+    gint64 latency;
+    gint stage;
+
+    ++state->messages;
+    state->bytes += len;
+
+    switch (header->msgtype) {
+        case CI_NET_MSG_VERSION:
+            if (!client->ready) {
+                client->ready = TRUE;
+                ++state->ready;
+            }
+            break;
+        case CI_NET_MSG_EVENT_RING:
+            if (cinet_msg_read_msg(&msg, data, len) != 0)
+                break;
+            stage = _load_stage_index(((CINetMsgMultipart *)msg)->stage);
+            /* later stages belong to the ring of the last init */
+            if (stage == 0 && client->rings < state->nrings) {
+                ring = &state->rings[client->rings++];
+                if (ring->received++ == 0)
+                    ring->first = now;
+                ring->last = now;
+            }
+            else if (stage > 0 && client->rings > 0)
+                ring = &state->rings[client->rings - 1];
+            else
+                ring = NULL;
+            if (ring != NULL) {
+                latency = now - ring->sent;
+                g_array_append_val(state->latency[stage], latency);
+            }
+            cinet_msg_free(msg);
+            break;
+        case CI_NET_MSG_DB_NUM_CALLS:
+        case CI_NET_MSG_DB_CALL_LIST:
+            if (client->db_sent != 0) {
+                latency = now - client->db_sent;
+                g_array_append_val(state->db_latency, latency);
+                client->db_sent = 0;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void _load_read_client(LoadState *state, LoadClient *client, gint64 now)
+{
+    CINetMsgHeader header;
+    gsize pos = 0, frame;
+    ssize_t rc;
+
+    for (;;) {
+        if (client->len == client->size) {
+            client->size = client->size ? client->size * 2 : 4096;
+            client->buf = g_realloc(client->buf, client->size);
+        }
+        rc = recv(client->fd, &client->buf[client->len], client->size - client->len, MSG_DONTWAIT);
+        if (rc > 0) {
+            client->len += rc;
+            continue;
+        }
+        if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (rc == -1 && errno == EINTR)
+            continue;
+        /* closed by the server */
+        epoll_ctl(state->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+        client->fd = -1;
+        ++state->dropped;
+        return;
+    }
+
+    while (client->len - pos >= CINET_HEADER_LENGTH) {
+        if (cinet_msg_read_header(&header, &client->buf[pos], CINET_HEADER_LENGTH) < CINET_HEADER_LENGTH)
+            break;
+        frame = CINET_HEADER_LENGTH + header.msglen;
+        if (client->len - pos < frame)
+            break;
+        _load_handle_frame(state, client, &header, &client->buf[pos], frame, now);
+        pos += frame;
+    }
+    client->len -= pos;
+    memmove(client->buf, &client->buf[pos], client->len);
+}
+
+/* Handle client input until the deadline or until done() is true. */
+static void _load_poll(LoadState *state, gint64 deadline, gboolean (*done)(LoadState *, gpointer), gpointer data)
+{
+    struct epoll_event events[LOAD_EVENTS];
+    gint64 now;
+    int n, i, timeout;
+
+    while ((now = g_get_monotonic_time()) < deadline && (done == NULL || !done(state, data))) {
+        if (state->db_interval && now >= state->db_tick)
+            _load_send_db_requests(state, now);
+        timeout = (int)((MIN(deadline, state->db_interval ? state->db_tick : deadline) - now + 999) / 1000);
+        n = epoll_wait(state->epfd, events, LOAD_EVENTS, timeout);
+        now = g_get_monotonic_time();
+        for (i = 0; i < n; ++i)
+            _load_read_client(state, (LoadClient *)events[i].data.ptr, now);
+    }
+}
+
+static gboolean _load_all_ready(LoadState *state, gpointer data)
+{
+    return state->ready + state->dropped >= state->nclients;
+}
+
+static gboolean _load_ring_done(LoadState *state, gpointer data)
+{
+    LoadRing *ring = (LoadRing *)data;
+    return ring->received + state->dropped >= state->nclients;
+}
+
+static gint _load_send_ring(int fritz, guint id)
+{
+    gchar date[32];
+    gchar *line;
+    time_t now = time(NULL);
+    gint rc = 0;
+
+    strftime(date, sizeof(date), "%d.%m.%y %H:%M:%S", localtime(&now));
+    line = g_strdup_printf("%s;RING;%u;0301%06u;80504;SIP0;\n", date, id % 10, id);
+    if (send(fritz, line, strlen(line), MSG_NOSIGNAL) != (ssize_t)strlen(line))
+        rc = 1;
+    g_free(line);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    LoadState state;
+    struct epoll_event ev;
+    const gchar *host = "127.0.0.1";
+    gushort port = LOAD_DEFAULT_PORT, fritz_port = LOAD_DEFAULT_FRITZ_PORT;
+    guint interval = LOAD_DEFAULT_INTERVAL, target = LOAD_DEFAULT_TARGET;
+    GArray *fanout;
+    gint64 start, elapsed, value;
+    guint i, lost = 0, db_rate = 0;
+    int fritz, arg, rc = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.nclients = LOAD_DEFAULT_CLIENTS;
+    state.nrings = LOAD_DEFAULT_RINGS;
+
+    for (arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+            state.nclients = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+            state.nrings = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
+            interval = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+            host = argv[++arg];
+        else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc)
+            port = (gushort)strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc)
+            fritz_port = (gushort)strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+            target = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+            db_rate = strtoul(argv[++arg], NULL, 10);
+        else {
+            fprintf(stderr, "usage: %s [-c clients] [-n rings] [-i interval-ms] [-s host] [-p port] "
+                    "[-f fritz-port] [-t target-ms] [-r db-requests-per-s]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (state.nclients == 0 || state.nrings == 0)
+        return 1;
+
+    _load_raise_fd_limit(state.nclients);
+
+    if ((fritz = _load_accept_fritz(fritz_port)) == -1) {
+        fprintf(stderr, "fritz2ci did not connect\n");
+        return 1;
+    }
+
+    if ((state.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return 1;
+    state.clients = g_new0(LoadClient, state.nclients);
+    state.rings = g_new0(LoadRing, state.nrings);
+    for (i = 0; i < LOAD_STAGES; ++i)
+        state.latency[i] = g_array_sized_new(FALSE, FALSE, sizeof(gint64), state.nclients);
+    state.db_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    printf("connecting %u clients to %s:%u\n", state.nclients, host, port);
+    start = g_get_monotonic_time();
+    for (i = 0; i < state.nclients; ++i) {
+        LoadClient *client = &state.clients[i];
+        if ((client->fd = _load_connect(host, port)) == -1 || _load_send_version(client, i + 1) != 0) {
+            fprintf(stderr, "client %u: could not connect: %s\n", i, strerror(errno));
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        epoll_ctl(state.epfd, EPOLL_CTL_ADD, client->fd, &ev);
+        /* keep the handshake replies from piling up */
+        if ((i & 255) == 255)
+            _load_poll(&state, g_get_monotonic_time(), NULL, NULL);
+    }
+    _load_poll(&state, g_get_monotonic_time() + LOAD_SETUP_TIMEOUT, _load_all_ready, NULL);
+    printf("%u clients ready after %.2f s, %u dropped\n", state.ready,
+            (g_get_monotonic_time() - start) / 1e6, state.dropped);
+    if (state.ready < state.nclients) {
+        fprintf(stderr, "not all clients finished the handshake\n");
+        return 1;
+    }
+
+    start = g_get_monotonic_time();
+    if (db_rate) {
+        /* spread the requests of the clients over one interval */
+        state.db_interval = G_TIME_SPAN_SECOND / db_rate;
+        for (i = 0; i < state.nclients; ++i)
+            state.clients[i].db_next = start + state.db_interval * i / state.nclients;
+    }
+    state.messages = state.bytes = 0;
+
+    for (i = 0; i < state.nrings; ++i) {
+        start = g_get_monotonic_time();
+        state.rings[i].sent = start;
+        if (_load_send_ring(fritz, i) != 0) {
+            fprintf(stderr, "lost connection to fritz2ci\n");
+            return 1;
+        }
+        _load_poll(&state, start + LOAD_RING_TIMEOUT, _load_ring_done, &state.rings[i]);
+        /* drain the remaining stages until the next ring is due */
+        _load_poll(&state, start + (gint64)interval * 1000, NULL, NULL);
+    }
+
+    elapsed = g_get_monotonic_time() - state.rings[0].sent;
+
+    fanout = g_array_sized_new(FALSE, FALSE, sizeof(gint64), state.nrings);
+    for (i = 0; i < state.nrings; ++i) {
+        if (state.rings[i].received < state.nclients - state.dropped) {
+            ++lost;
+            continue;
+        }
+        value = state.rings[i].last - state.rings[i].sent;
+        g_array_append_val(fanout, value);
+    }
+
+    printf("clients:    %u (%u dropped)\n", state.nclients, state.dropped);
+    printf("rings:      %u (%u incomplete)\n", state.nrings, lost);
+    printf("throughput: %.0f msg/s, %.2f MB/s\n", state.messages * 1e6 / elapsed,
+            state.bytes / (gdouble)elapsed);
+    printf("latency     samples\n");
+    for (i = 0; i < LOAD_STAGES; ++i)
+        _load_print_latency(_load_stage_names[i], state.latency[i]);
+    if (db_rate) {
+        _load_print_latency("db", state.db_latency);
+        printf("db:         %.0f replies/s, %" G_GUINT64_FORMAT " requests skipped\n",
+                state.db_latency->len * 1e6 / elapsed, state.db_skipped);
+    }
+    _load_print_latency("fan-out", fanout);
+    printf("target:     %u ms\n", target);
+
+    if (lost || state.dropped || fanout->len == 0 || _load_percentile(fanout, 100) > (gint64)target * 1000)
+        rc = 2;
+
+    g_array_free(fanout, TRUE);
+    for (i = 0; i < LOAD_STAGES; ++i)
+        g_array_free(state.latency[i], TRUE);
+    g_array_free(state.db_latency, TRUE);
+    for (i = 0; i < state.nclients; ++i) {
+        if (state.clients[i].fd != -1)
+            close(state.clients[i].fd);
+        g_free(state.clients[i].buf);
+    }
+    g_free(state.clients);
+    g_free(state.rings);
+    close(state.epfd);
+    close(fritz);
+    return rc;
+}
@@ -0,0 +1,111 @@
+/* Throughput benchmark for the call monitor parser.
+ *
+ * usage: fritz_parser_bench [-n lines] [recorded-callmonitor.log]
+ *
+ * Parses the given recording (or a built-in sample) round-robin on a single
+ * core until the requested number of lines has been processed.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fritz_parser.h"
+
+#define BENCH_DEFAULT_LINES     4000000UL
+
+static const gchar *_bench_sample[] = {
+    "17.10.26 09:14:02;RING;0;0301234567;80504;SIP0;",
+    "17.10.26 09:14:02;CALL;1;4;80282;0897654321;SIP1;",
+    "17.10.26 09:14:05;CONNECT;0;4;0301234567;",
+    "17.10.26 09:14:05;RING;2;017612345678;80504;SIP0;",
+    "17.10.26 09:14:31;DISCONNECT;0;26;",
+    "17.10.26 09:14:31;DISCONNECT;2;0;",
+    "17.10.26 09:15:10;CALL;0;4;80504;004420795550123;SIP0;",
+    "17.10.26 09:15:42;DISCONNECT;1;97;",
+};
+
+static GPtrArray *_bench_load(const gchar *filename)
+{
+    GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+    gchar buffer[1024];
+    gsize len;
+    guint i;
+    FILE *f;
+
+    if (filename == NULL) {
+        for (i = 0; i < G_N_ELEMENTS(_bench_sample); ++i)
+            g_ptr_array_add(lines, g_strdup(_bench_sample[i]));
+        return lines;
+    }
+
+    if ((f = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        g_ptr_array_free(lines, TRUE);
+        return NULL;
+    }
+    while (fgets(buffer, sizeof(buffer), f)) {
+        len = strlen(buffer);
+        while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r'))
+            buffer[--len] = '\0';
+        if (len)
+            g_ptr_array_add(lines, g_strdup(buffer));
+    }
+    fclose(f);
+
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    gulong nlines = BENCH_DEFAULT_LINES;
+    const gchar *filename = NULL;
+    GPtrArray *lines;
+    gsize *lengths;
+    CIFritzParseCache cache;
+    CIFritzCallMsg cmsg;
+    gulong i, failed = 0, checksum = 0;
+    guint64 bytes = 0;
+    gint64 start, elapsed;
+    int arg;
+
+    for (arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+            nlines = strtoul(argv[++arg], NULL, 10);
+        else
+            filename = argv[arg];
+    }
+
+    if ((lines = _bench_load(filename)) == NULL || lines->len == 0) {
+        fprintf(stderr, "No lines to parse\n");
+        return 1;
+    }
+
+    lengths = g_new(gsize, lines->len);
+    for (i = 0; i < lines->len; ++i)
+        lengths[i] = strlen(g_ptr_array_index(lines, i));
+
+    fritz_parse_cache_init(&cache);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < nlines; ++i) {
+        guint idx = i % lines->len;
+        if (fritz_parse_notification(g_ptr_array_index(lines, idx), lengths[idx], &cmsg, &cache) != 0)
+            ++failed;
+        checksum += cmsg.msgtype + cmsg.connectionid + cmsg.datetime.tm_sec;
+        bytes += lengths[idx];
+    }
+    elapsed = g_get_monotonic_time() - start;
+    if (elapsed <= 0)
+        elapsed = 1;
+
+    printf("lines:      %lu (%u distinct, %lu rejected)\n", nlines, lines->len, failed);
+    printf("elapsed:    %.3f s\n", elapsed / 1e6);
+    printf("throughput: %.0f lines/s, %.1f MB/s\n",
+            nlines * 1e6 / elapsed, bytes / (double)elapsed);
+    printf("per line:   %.1f ns\n", elapsed * 1e3 / nlines);
+    printf("checksum:   %lu\n", checksum);
+
+    g_free(lengths);
+    g_ptr_array_free(lines, TRUE);
+    return 0;
+}
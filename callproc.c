@@ -0,0 +1,402 @@
+#include "callproc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <sys/time.h>
+#include "CIData.h"
+#include "config.h"
+#include "ci-server.h"
+#include "dbspool.h"
+#include "journal.h"
+#include "lookup.h"
+#include "ci_areacodes.h"
+#include "msn_lookup.h"
+#include "logging.h"
+
+#define CALLPROC_DEFAULT_ENRICH_WORKERS   1
+#define CALLPROC_DEFAULT_LOOKUP_WORKERS   2
+#define CALLPROC_DEFAULT_FANOUT_WORKERS   1
+#define CALLPROC_DEFAULT_STAGE_QUEUE      64
+#define CALLPROC_DEFAULT_LOOKUP_DEADLINE  3000
+/* msec between attempts of the main loop to hand a notice to a full fanout stage */
+#define CALLPROC_NOTICE_RETRY_INTERVAL    10
+
+/* A RING job races its lookup against the deadline timer. Whoever moves the
+ * state away from Pending first decides what the clients get. A late lookup
+ * result is only broadcast after the Complete of the deadline went out. */
+typedef enum {
+    CallJobPending = 0,
+    CallJobLookupDone,      /* lookup finished in time */
+    CallJobTimedOut,        /* deadline passed, Complete queued without lookup */
+    CallJobLate,            /* lookup finished after the deadline, before that Complete went out */
+    CallJobClosed           /* Complete of a timed out job went out */
+} CICallJobState;
+
+typedef struct _CICallJob {
+    gint refcount;
+    volatile gint state;
+    guint id;
+    guint deadline_source;
+    CIFritzCallMsg cmsg;
+    gchar msgid[16];
+    gint lookup_rc;
+    CIDataSet set;          /* enriched data, not changed after enrich */
+    CIDataSet result;       /* set with the lookup result, written by the lookup stage */
+} CICallJob;
+
+#define CALLPROC_NOTIFY_UPDATE     (1 << 0)
+#define CALLPROC_NOTIFY_COMPLETE   (1 << 1)
+#define CALLPROC_NOTIFY_CALL       (1 << 2)
+
+/* what the fanout stage should broadcast for a job */
+typedef struct _CICallNotice {
+    CICallJob *job;
+    const CIDataSet *set;
+    guint messages;
+} CICallNotice;
+
+static const gchar *_callproc_stage_names[CallProcStageCount] = {
+    "enrich", "lookup", "persist", "fanout"
+};
+
+static CIPipelineStage *_callproc_stages[CallProcStageCount];
+
+/* jobs with a running deadline timer, by job id */
+static GHashTable *_callproc_deadlines = NULL;
+static GMutex _callproc_deadline_lock;
+static guint _callproc_next_id = 0;
+
+
+static
+CICallJob *_callproc_job_ref(CICallJob *job)
+{
+    g_atomic_int_inc(&job->refcount);
+    return job;
+}
+
+static
+void _callproc_job_unref(CICallJob *job)
+{
+    if (job && g_atomic_int_dec_and_test(&job->refcount))
+        g_free(job);
+}
+
+static
+void _callproc_dispatch(CICallProcStage stage, CICallJob *job)
+{
+    if (pipeline_stage_push(_callproc_stages[stage], job) != 0) {
+        log_log("callproc: could not queue job for stage %s\n", _callproc_stage_names[stage]);
+        _callproc_job_unref(job);
+    }
+}
+
+static
+void _callproc_drop_notice(CICallNotice *notice)
+{
+    log_log("callproc: could not queue job for stage %s\n", _callproc_stage_names[CallProcStageFanout]);
+    _callproc_job_unref(notice->job);
+    g_free(notice);
+}
+
+static
+CICallNotice *_callproc_notice_new(CICallJob *job, const CIDataSet *set, guint messages)
+{
+    CICallNotice *notice = g_malloc(sizeof(CICallNotice));
+
+    notice->job = job;
+    notice->set = set;
+    notice->messages = messages;
+    return notice;
+}
+
+static
+void _callproc_notify(CICallJob *job, const CIDataSet *set, guint messages)
+{
+    CICallNotice *notice = _callproc_notice_new(job, set, messages);
+
+    if (pipeline_stage_push(_callproc_stages[CallProcStageFanout], notice) != 0)
+        _callproc_drop_notice(notice);
+}
+
+/* Runs in the main loop, which must not wait for the fanout stage. */
+static
+gboolean _callproc_retry_notice(gpointer data)
+{
+    CICallNotice *notice = (CICallNotice *)data;
+    gint rc;
+
+    rc = pipeline_stage_try_push(_callproc_stages[CallProcStageFanout], notice);
+    if (rc == 3)
+        return TRUE;
+    if (rc != 0)
+        _callproc_drop_notice(notice);
+    return FALSE;
+}
+
+/* Runs in the main loop. Takes over the reference held by the deadline table. */
+static
+gboolean _callproc_deadline_cb(gpointer id)
+{
+    CICallJob *job;
+    CICallNotice *notice;
+
+    g_mutex_lock(&_callproc_deadline_lock);
+    job = g_hash_table_lookup(_callproc_deadlines, id);
+    if (job != NULL)
+        g_hash_table_remove(_callproc_deadlines, id);
+    g_mutex_unlock(&_callproc_deadline_lock);
+
+    if (job == NULL)
+        return FALSE;
+
+    if (g_atomic_int_compare_and_exchange(&job->state, CallJobPending, CallJobTimedOut)) {
+        log_log("lookup for %s timed out\n", job->msgid);
+        notice = _callproc_notice_new(job, &job->set, CALLPROC_NOTIFY_COMPLETE);
+        if (_callproc_retry_notice(notice))
+            g_timeout_add(CALLPROC_NOTICE_RETRY_INTERVAL, _callproc_retry_notice, notice);
+    }
+    else {
+        _callproc_job_unref(job);
+    }
+
+    return FALSE;
+}
+
+static
+void _callproc_arm_deadline(CICallJob *job)
+{
+    const Fritz2CIConfig *cfg = config_get_config();
+    guint deadline = cfg->lookup_deadline ? cfg->lookup_deadline : CALLPROC_DEFAULT_LOOKUP_DEADLINE;
+
+    g_mutex_lock(&_callproc_deadline_lock);
+    job->id = ++_callproc_next_id;
+    job->deadline_source = g_timeout_add(deadline, _callproc_deadline_cb, GUINT_TO_POINTER(job->id));
+    g_hash_table_insert(_callproc_deadlines, GUINT_TO_POINTER(job->id), _callproc_job_ref(job));
+    g_mutex_unlock(&_callproc_deadline_lock);
+}
+
+static
+void _callproc_disarm_deadline(CICallJob *job)
+{
+    gboolean armed;
+
+    g_mutex_lock(&_callproc_deadline_lock);
+    armed = g_hash_table_remove(_callproc_deadlines, GUINT_TO_POINTER(job->id));
+    if (armed)
+        g_source_remove(job->deadline_source);
+    g_mutex_unlock(&_callproc_deadline_lock);
+
+    if (armed)
+        _callproc_job_unref(job);
+}
+
+static
+void _callproc_generate_msg_id(gchar *id)
+{
+    struct timeval tv;
+    struct tm tm;
+
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+
+    strftime(id, 16, "%y%m%d%H%M%S", &tm);
+    snprintf(&id[12], 4, "%03d", (unsigned int)(((unsigned long)tv.tv_usec)/1000)%1000);
+}
+
+static
+void _callproc_enrich(CICallJob *job, gpointer userdata)
+{
+    CIFritzCallMsg *cmsg = &job->cmsg;
+    CIDataSet *set = &job->set;
+
+    if (cmsg->msgtype == CALLMSGTYPE_RING) {
+        _callproc_generate_msg_id(job->msgid);
+        log_log("generate msg id: %s\n", job->msgid);
+
+        strftime(set->cidsTime, 16, "%H:%M:%S", &cmsg->datetime);
+        strcpy(set->cidsNumberComplete, cmsg->calling_number);
+        strcpy(set->cidsMSN, cmsg->called_number);
+        strcpy(set->cidsService, "Telefonie");
+        strcpy(set->cidsFix, "Fix");
+        ci_get_area_code(set->cidsNumberComplete, set->cidsAreaCode, set->cidsNumber, set->cidsArea);
+        strcpy(set->cidsName, set->cidsArea);
+        msnl_lookup(set->cidsMSN, set->cidsAlias);
+        strftime(set->cidsDate, 16, "%d.%m.%Y", &cmsg->datetime);
+        if (journal_append(set) != 0)
+            log_log("callproc: %s is not in the journal\n", job->msgid);
+        strftime(set->cidsDate, 16, "%Y-%m-%d", &cmsg->datetime);
+        memcpy(&job->result, set, sizeof(CIDataSet));
+        _callproc_arm_deadline(job);
+        cisrv_broadcast_message(CIServerMsgMessage, set, job->msgid);
+
+        _callproc_dispatch(CallProcStageLookup, job);
+    }
+    else {
+        strftime(set->cidsTime, 16, "%H:%M:%S", &cmsg->datetime);
+        strftime(set->cidsDate, 16, "%Y-%m-%d", &cmsg->datetime);
+        strcpy(set->cidsNumberComplete, cmsg->called_number);
+        strcpy(set->cidsMSN, cmsg->calling_number);
+        msnl_lookup(set->cidsMSN, set->cidsAlias);
+
+        log_log("CALL: %s %s \"%s\" \"%s\" \"%s\"\n", set->cidsTime, set->cidsDate,
+                set->cidsNumberComplete, set->cidsMSN, set->cidsAlias);
+
+        _callproc_notify(job, set, CALLPROC_NOTIFY_CALL);
+    }
+}
+
+static
+void _callproc_lookup(CICallJob *job, gpointer userdata)
+{
+    job->lookup_rc = lookup_get_caller_data(&job->result);
+
+    /* persist and fanout only read the job from here on */
+    _callproc_dispatch(CallProcStagePersist, _callproc_job_ref(job));
+
+    if (g_atomic_int_compare_and_exchange(&job->state, CallJobPending, CallJobLookupDone)) {
+        _callproc_disarm_deadline(job);
+        _callproc_notify(job, &job->result,
+                (job->lookup_rc == 0 ? CALLPROC_NOTIFY_UPDATE : 0) | CALLPROC_NOTIFY_COMPLETE);
+    }
+    else if (job->lookup_rc == 0) {
+        log_log("late lookup result for %s\n", job->msgid);
+        /* if the Complete is still queued, its fanout sends the Update after it */
+        if (g_atomic_int_compare_and_exchange(&job->state, CallJobTimedOut, CallJobLate))
+            _callproc_job_unref(job);
+        else
+            _callproc_notify(job, &job->result, CALLPROC_NOTIFY_UPDATE);
+    }
+    else {
+        _callproc_job_unref(job);
+    }
+}
+
+static
+void _callproc_persist(CICallJob *job, gpointer userdata)
+{
+    dbspool_store(&job->result);
+    _callproc_job_unref(job);
+}
+
+static
+void _callproc_fanout(CICallNotice *notice, gpointer userdata)
+{
+    CIDataSet *set = (CIDataSet *)notice->set;
+
+    if (notice->messages & CALLPROC_NOTIFY_UPDATE) {
+        cisrv_broadcast_message(CIServerMsgUpdate, set, notice->job->msgid);
+    }
+    if (notice->messages & CALLPROC_NOTIFY_COMPLETE) {
+        cisrv_broadcast_message(CIServerMsgComplete, set, notice->job->msgid);
+        if (!g_atomic_int_compare_and_exchange(&notice->job->state, CallJobTimedOut, CallJobClosed) &&
+                g_atomic_int_get(&notice->job->state) == CallJobLate) {
+            cisrv_broadcast_message(CIServerMsgUpdate, &notice->job->result, notice->job->msgid);
+        }
+    }
+    if (notice->messages & CALLPROC_NOTIFY_CALL) {
+        cisrv_broadcast_message(CIServerMsgCall, set, NULL);
+    }
+
+    _callproc_job_unref(notice->job);
+    g_free(notice);
+}
+
+static const CIPipelineFunc _callproc_stage_funcs[CallProcStageCount] = {
+    (CIPipelineFunc)_callproc_enrich,
+    (CIPipelineFunc)_callproc_lookup,
+    (CIPipelineFunc)_callproc_persist,
+    (CIPipelineFunc)_callproc_fanout
+};
+
+gint callproc_init(void)
+{
+    const Fritz2CIConfig *cfg = config_get_config();
+    guint workers[CallProcStageCount];
+    guint queue;
+    gint i;
+
+    workers[CallProcStageEnrich] = cfg->enrich_workers ? cfg->enrich_workers : CALLPROC_DEFAULT_ENRICH_WORKERS;
+    workers[CallProcStageLookup] = cfg->lookup_workers ? cfg->lookup_workers : CALLPROC_DEFAULT_LOOKUP_WORKERS;
+    /* sqlite has a single writer anyway */
+    workers[CallProcStagePersist] = 1;
+    workers[CallProcStageFanout] = cfg->fanout_workers ? cfg->fanout_workers : CALLPROC_DEFAULT_FANOUT_WORKERS;
+    queue = cfg->stage_queue_size ? cfg->stage_queue_size : CALLPROC_DEFAULT_STAGE_QUEUE;
+
+    _callproc_deadlines = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < CallProcStageCount; ++i) {
+        _callproc_stages[i] = pipeline_stage_new(_callproc_stage_names[i], _callproc_stage_funcs[i],
+                                                 NULL, workers[i], queue);
+        if (_callproc_stages[i] == NULL) {
+            callproc_shutdown();
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void callproc_handle_message(CIFritzCallMsg *cmsg)
+{
+    CICallJob *job;
+
+    if (!cmsg) {
+        return;
+    }
+    if (cmsg->msgtype != CALLMSGTYPE_CALL && cmsg->msgtype != CALLMSGTYPE_RING) {
+        return;
+    }
+    log_log("event from box %s\n", cmsg->box);
+
+    job = g_malloc0(sizeof(CICallJob));
+    job->refcount = 1;
+    memcpy(&job->cmsg, cmsg, sizeof(CIFritzCallMsg));
+
+    _callproc_dispatch(CallProcStageEnrich, job);
+}
+
+/* Stop the stages front to back so every job already accepted reaches the end. */
+void callproc_shutdown(void)
+{
+    gint i;
+
+    for (i = 0; i < CallProcStageCount; ++i) {
+        if (_callproc_stages[i] == NULL)
+            continue;
+        pipeline_stage_free(_callproc_stages[i]);
+        _callproc_stages[i] = NULL;
+    }
+}
+
+static
+void _callproc_drop_deadline(gpointer id, gpointer job, gpointer userdata)
+{
+    g_source_remove(((CICallJob *)job)->deadline_source);
+    _callproc_job_unref((CICallJob *)job);
+}
+
+void callproc_cleanup(void)
+{
+    callproc_shutdown();
+
+    if (_callproc_deadlines) {
+        g_hash_table_foreach(_callproc_deadlines, _callproc_drop_deadline, NULL);
+        g_hash_table_destroy(_callproc_deadlines);
+        _callproc_deadlines = NULL;
+    }
+}
+
+const gchar *callproc_get_stage_name(CICallProcStage stage)
+{
+    return stage < CallProcStageCount ? _callproc_stage_names[stage] : NULL;
+}
+
+gint callproc_get_stage_stats(CICallProcStage stage, CIPipelineStageStats *stats)
+{
+    if (stage >= CallProcStageCount || _callproc_stages[stage] == NULL)
+        return 1;
+
+    pipeline_stage_get_stats(_callproc_stages[stage], stats);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __CALLPROC_H__
+#define __CALLPROC_H__
+
+#include <glib.h>
+#include "fritz.h"
+#include "pipeline.h"
+
+/* Call processing runs as a pipeline of stages:
+ *   enrich  - area code, msn alias, journal, first broadcast
+ *   lookup  - caller cache and online lookup
+ *   persist - database insert (single writer)
+ *   fanout  - update/complete/call broadcasts
+ * RING events pass enrich -> lookup -> persist + fanout,
+ * CALL events pass enrich -> fanout. */
+
+typedef enum {
+    CallProcStageEnrich = 0,
+    CallProcStageLookup,
+    CallProcStagePersist,
+    CallProcStageFanout,
+    CallProcStageCount
+} CICallProcStage;
+
+gint callproc_init(void);
+void callproc_handle_message(CIFritzCallMsg *cmsg);
+void callproc_shutdown(void);
+void callproc_cleanup(void);
+const gchar *callproc_get_stage_name(CICallProcStage stage);
+gint callproc_get_stage_stats(CICallProcStage stage, CIPipelineStageStats *stats);
+
+#endif
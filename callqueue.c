@@ -0,0 +1,199 @@
+#include "callqueue.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "logging.h"
+
+typedef enum {
+    CallQStateUninitialized = 0,
+    CallQStateInitialized,
+    CallQStateRunning
+} CICallQueueState;
+
+typedef struct _CICallQueue {
+    CIFritzCallMsg *slots;
+    guint mask;
+    volatile gint head;         /* next slot to consume, written by the consumer only */
+    volatile gint tail;         /* next slot to fill, written by the producer only */
+    volatile gint sleeping;     /* consumer is about to block on wakefd */
+    volatile gint stop;
+    int wakefd;
+    CICallQueueHandler handler;
+    GThread *thread;
+    CICallQueueState state;
+
+    volatile gint high_watermark;
+    volatile gint enqueued;
+    volatile gint dequeued;
+    volatile gint dropped;
+} CICallQueue;
+
+static CICallQueue _callq;
+
+static
+guint _callq_round_size(guint size)
+{
+    guint n = 2;
+    if (size == 0)
+        size = CALLQ_DEFAULT_SIZE;
+    while (n < size && n < (1u << 20))
+        n <<= 1;
+    return n;
+}
+
+gint callq_init(guint size, CICallQueueHandler handler)
+{
+    if (_callq.state != CallQStateUninitialized || handler == NULL)
+        return 1;
+
+    memset(&_callq, 0, sizeof(CICallQueue));
+    size = _callq_round_size(size);
+    if ((_callq.wakefd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        log_log("callq: eventfd failed: %d (%s)\n", errno, strerror(errno));
+        return 2;
+    }
+    _callq.slots = g_malloc0(sizeof(CIFritzCallMsg) * size);
+    _callq.mask = size - 1;
+    _callq.handler = handler;
+    _callq.state = CallQStateInitialized;
+
+    return 0;
+}
+
+static
+void _callq_wake(void)
+{
+    guint64 one = 1;
+    if (write(_callq.wakefd, &one, sizeof(one)) != sizeof(one))
+        log_log("callq: wakeup failed: %d (%s)\n", errno, strerror(errno));
+}
+
+/* Copy the event into the next free slot. Must only be called from one thread. */
+gint callq_push(CIFritzCallMsg *cmsg)
+{
+    gint head, tail, depth;
+
+    if (_callq.state == CallQStateUninitialized || cmsg == NULL)
+        return 1;
+
+    tail = _callq.tail;
+    head = g_atomic_int_get(&_callq.head);
+    depth = (gint)((guint)tail - (guint)head);
+    if ((guint)depth > _callq.mask) {
+        g_atomic_int_inc(&_callq.dropped);
+        return 2;
+    }
+
+    memcpy(&_callq.slots[(guint)tail & _callq.mask], cmsg, sizeof(CIFritzCallMsg));
+    g_atomic_int_set(&_callq.tail, (gint)((guint)tail + 1));
+    g_atomic_int_inc(&_callq.enqueued);
+
+    if (depth + 1 > g_atomic_int_get(&_callq.high_watermark))
+        g_atomic_int_set(&_callq.high_watermark, depth + 1);
+
+    if (g_atomic_int_get(&_callq.sleeping))
+        _callq_wake();
+
+    return 0;
+}
+
+static
+void _callq_drain(void)
+{
+    gint head = _callq.head;
+
+    while (head != g_atomic_int_get(&_callq.tail)) {
+        _callq.handler(&_callq.slots[(guint)head & _callq.mask]);
+        head = (gint)((guint)head + 1);
+        /* release the slot only after the handler is done with it */
+        g_atomic_int_set(&_callq.head, head);
+        g_atomic_int_inc(&_callq.dequeued);
+    }
+}
+
+static
+gpointer _callq_thread_proc(gpointer data)
+{
+    guint64 value;
+
+    while (1) {
+        _callq_drain();
+        if (g_atomic_int_get(&_callq.stop))
+            break;
+
+        g_atomic_int_set(&_callq.sleeping, 1);
+        /* the producer may have filled a slot before it saw the flag */
+        if (g_atomic_int_get(&_callq.tail) == _callq.head && !g_atomic_int_get(&_callq.stop)) {
+            if (read(_callq.wakefd, &value, sizeof(value)) == -1 && errno != EINTR) {
+                log_log("callq: read failed: %d (%s)\n", errno, strerror(errno));
+                break;
+            }
+        }
+        g_atomic_int_set(&_callq.sleeping, 0);
+    }
+
+    return NULL;
+}
+
+gint callq_startup(void)
+{
+    if (_callq.state != CallQStateInitialized)
+        return 1;
+
+    g_atomic_int_set(&_callq.stop, 0);
+    _callq.thread = g_thread_new("CallQueue", _callq_thread_proc, NULL);
+    _callq.state = CallQStateRunning;
+
+    return 0;
+}
+
+/* Stop the consumer after it has handled everything already queued. */
+gint callq_shutdown(void)
+{
+    CICallQueueStats stats;
+
+    if (_callq.state != CallQStateRunning)
+        return 1;
+
+    g_atomic_int_set(&_callq.stop, 1);
+    _callq_wake();
+    g_thread_join(_callq.thread);
+    _callq.thread = NULL;
+    _callq.state = CallQStateInitialized;
+
+    callq_get_stats(&stats);
+    log_log("callq: %u events, %u dropped, high watermark %u/%u\n",
+            stats.enqueued, stats.dropped, stats.high_watermark, stats.size);
+
+    return 0;
+}
+
+gint callq_cleanup(void)
+{
+    if (_callq.state == CallQStateRunning)
+        callq_shutdown();
+    if (_callq.state == CallQStateUninitialized)
+        return 0;
+
+    close(_callq.wakefd);
+    g_free(_callq.slots);
+    memset(&_callq, 0, sizeof(CICallQueue));
+
+    return 0;
+}
+
+void callq_get_stats(CICallQueueStats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->size = _callq.slots ? _callq.mask + 1 : 0;
+    stats->depth = (guint)g_atomic_int_get(&_callq.tail) - (guint)g_atomic_int_get(&_callq.head);
+    stats->high_watermark = (guint)g_atomic_int_get(&_callq.high_watermark);
+    stats->enqueued = (guint)g_atomic_int_get(&_callq.enqueued);
+    stats->dequeued = (guint)g_atomic_int_get(&_callq.dequeued);
+    stats->dropped = (guint)g_atomic_int_get(&_callq.dropped);
+}
@@ -0,0 +1,31 @@
+#ifndef __CALLQUEUE_H__
+#define __CALLQUEUE_H__
+
+#include <glib.h>
+#include "fritz.h"
+
+#define CALLQ_DEFAULT_SIZE      256
+
+/* The queue has a single producer (the fritz listener thread) and a single
+ * consumer (the processing thread). When it is full, new events are dropped
+ * and counted; events already queued are never overwritten. */
+
+typedef void (*CICallQueueHandler)(CIFritzCallMsg *cmsg);
+
+typedef struct _CICallQueueStats {
+    guint size;             /* capacity */
+    guint depth;            /* events currently waiting */
+    guint high_watermark;   /* largest depth seen */
+    guint enqueued;         /* events accepted */
+    guint dequeued;         /* events handed to the handler */
+    guint dropped;          /* events rejected because the queue was full */
+} CICallQueueStats;
+
+gint callq_init(guint size, CICallQueueHandler handler);
+gint callq_startup(void);
+gint callq_push(CIFritzCallMsg *cmsg);
+gint callq_shutdown(void);
+gint callq_cleanup(void);
+void callq_get_stats(CICallQueueStats *stats);
+
+#endif
@@ -0,0 +1,88 @@
+#include "ci-extmsg.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "logging.h"
+
+gboolean ciext_is_frame(const gchar *data, gsize len)
+{
+    return len >= CIEXT_MAGIC_LENGTH && memcmp(data, CIEXT_MAGIC, CIEXT_MAGIC_LENGTH) == 0;
+}
+
+gsize ciext_frame_body_length(const gchar *data)
+{
+    guint32 len;
+
+    memcpy(&len, &data[8], sizeof(guint32));
+    return ntohl(len);
+}
+
+CIExtMsg *ciext_msg_new(const gchar *name, guint32 guid)
+{
+    CIExtMsg *msg = g_malloc0(sizeof(CIExtMsg));
+
+    msg->guid = guid;
+    msg->name = g_strdup(name);
+    msg->kf = g_key_file_new();
+    /* also puts the group naming the message first */
+    g_key_file_set_integer(msg->kf, name, "version", CIEXT_VERSION);
+    return msg;
+}
+
+CIExtMsg *ciext_msg_read(const gchar *data, gsize len)
+{
+    CIExtMsg *msg;
+    GError *error = NULL;
+    guint32 guid;
+
+    if (len < CIEXT_HEADER_LENGTH || !ciext_is_frame(data, len) ||
+            ciext_frame_body_length(data) != len - CIEXT_HEADER_LENGTH)
+        return NULL;
+
+    msg = g_malloc0(sizeof(CIExtMsg));
+    memcpy(&guid, &data[4], sizeof(guint32));
+    msg->guid = ntohl(guid);
+    msg->kf = g_key_file_new();
+    if (!g_key_file_load_from_data(msg->kf, &data[CIEXT_HEADER_LENGTH], len - CIEXT_HEADER_LENGTH,
+                G_KEY_FILE_NONE, &error)) {
+        log_log("ciext: invalid message: %s\n", error->message);
+        g_error_free(error);
+        ciext_msg_free(msg);
+        return NULL;
+    }
+    if ((msg->name = g_key_file_get_start_group(msg->kf)) == NULL) {
+        ciext_msg_free(msg);
+        return NULL;
+    }
+    return msg;
+}
+
+gchar *ciext_msg_write(CIExtMsg *msg, gsize *len)
+{
+    gchar *body, *frame;
+    gsize bodylen;
+    guint32 value;
+
+    body = g_key_file_to_data(msg->kf, &bodylen, NULL);
+    frame = g_malloc(CIEXT_HEADER_LENGTH + bodylen);
+    memcpy(frame, CIEXT_MAGIC, CIEXT_MAGIC_LENGTH);
+    value = htonl(msg->guid);
+    memcpy(&frame[4], &value, sizeof(guint32));
+    value = htonl((guint32)bodylen);
+    memcpy(&frame[8], &value, sizeof(guint32));
+    memcpy(&frame[CIEXT_HEADER_LENGTH], body, bodylen);
+    g_free(body);
+
+    if (len)
+        *len = CIEXT_HEADER_LENGTH + bodylen;
+    return frame;
+}
+
+void ciext_msg_free(CIExtMsg *msg)
+{
+    if (msg == NULL)
+        return;
+    if (msg->kf)
+        g_key_file_free(msg->kf);
+    g_free(msg->name);
+    g_free(msg);
+}
@@ -0,0 +1,37 @@
+#ifndef __CI_EXTMSG_H__
+#define __CI_EXTMSG_H__
+
+#include <glib.h>
+
+/* Messages of the server that libcinet does not know. They share the
+ * connection with libcinet frames and are told apart by their magic:
+ *
+ *   "CIX1" | guid (u32, network order) | body length (u32, network order) | body
+ *
+ * The body is a key file; its first group names the message, later groups
+ * hold list entries. Every message has the key version in its first group.
+ * Replies carry the guid of the request. */
+
+#define CIEXT_MAGIC             "CIX1"
+#define CIEXT_MAGIC_LENGTH      4
+#define CIEXT_HEADER_LENGTH     12
+#define CIEXT_VERSION           1
+
+typedef struct _CIExtMsg {
+    guint32 guid;
+    gchar *name;            /* first group */
+    GKeyFile *kf;
+} CIExtMsg;
+
+gboolean ciext_is_frame(const gchar *data, gsize len);
+/* body length of the frame at data, which holds at least CIEXT_HEADER_LENGTH bytes */
+gsize ciext_frame_body_length(const gchar *data);
+
+CIExtMsg *ciext_msg_new(const gchar *name, guint32 guid);
+/* NULL if the frame is not a valid message */
+CIExtMsg *ciext_msg_read(const gchar *data, gsize len);
+/* serialized frame, g_free() it */
+gchar *ciext_msg_write(CIExtMsg *msg, gsize *len);
+void ciext_msg_free(CIExtMsg *msg);
+
+#endif
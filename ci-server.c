@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include <glib.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -17,6 +19,7 @@
 #include <errno.h>
 #include <cinet.h>
 #include "dbhandler.h"
+#include "ci-extmsg.h"
 
 typedef enum {
     CISrvStateUninitialized = 0,
@@ -27,6 +30,36 @@ typedef enum {
 
 #define CISRV_CLIENT_REMOVE              1 << 0
 
+#define CISRV_DEFAULT_HIGH_WATERMARK     (256 * 1024)
+#define CISRV_DEFAULT_LOW_WATERMARK      (64 * 1024)
+#define CISRV_DEFAULT_GRACE_PERIOD       30
+/* a client is dropped when its queue grows beyond this multiple of the high watermark */
+#define CISRV_HARD_LIMIT_FACTOR          4
+#define CISRV_SLOW_CHECK_INTERVAL        1000
+#define CISRV_DEFAULT_DB_WORKERS         2
+/* database requests of one client in flight before its input is paused */
+#define CISRV_CLIENT_MAX_REQUESTS        4
+#define CISRV_DEFAULT_BACKLOG            1024
+/* connections taken per readiness of the listening socket */
+#define CISRV_ACCEPT_BATCH               256
+/* buffers handed to a single sendmsg */
+#define CISRV_FLUSH_IOV_MAX              64
+/* initial receive buffer; it only grows for larger frames */
+#define CISRV_RX_BUFFER_SIZE             4096
+#define CISRV_MAX_FRAME_SIZE             (1024 * 1024)
+/* broadcasts kept for clients catching up after a reconnect */
+#define CISRV_DEFAULT_REPLAY_EVENTS      256
+/* subscription filters: one bit per CIServerMsg, one bit per subscribed MSN;
+ * MSNs beyond the index share the last bit and are compared by name */
+#define CISRV_EVENT_BIT(msgtype)         (1u << (msgtype))
+#define CISRV_EVENTS_ALL                 0xffffffffu
+#define CISRV_MSN_BITS                   64
+#define CISRV_MSN_OTHER                  ((guint64)1 << (CISRV_MSN_BITS - 1))
+#define CISRV_MSNS_ALL                   G_MAXUINT64
+
+/* reactor signal: remove the clients marked with CISRV_CLIENT_REMOVE */
+#define CISRV_SIGNAL_REMOVE_CLIENTS      NETUTIL_REACTOR_SIGNAL_USER
+
 #define CI_MAKE_VERSION(maj, min, pat) (((maj) << 16 | (min) << 8 | (pat)) & 0x00ffffff)
 #define CI_VERSION_MAJ(ver) (((ver) >> 16) & 0x000000ff)
 #define CI_VERSION_MIN(ver) (((ver) >> 8) & 0x000000ff)
@@ -35,22 +68,105 @@ typedef enum {
             CI_VERSION_MIN(ver) >= CI_VERSION_MIN(min) &&\
             CI_VERSION_PAT(ver) >= CI_VERSION_PAT(min))
 
+/* Serialized message, shared read-only by the queues of all clients it is sent to. */
+typedef struct _CIWireBuffer {
+    gint refcount;
+    gint msgtype;           /* CIServerMsg of broadcasts, -1 for replies */
+    guint seq;              /* sequence number of broadcasts, 0 for replies */
+    guint event_bit;        /* what subscription filters look at */
+    guint64 msn_bit;
+    gchar *msn;
+    gchar *msgid;
+    gchar *data;
+    gsize len;
+} CIWireBuffer;
+
 typedef struct _CIClient {
+    gint refcount;
     int sock;
     gulong flags;
     guint32 version;
+    NetutilReactorSource *source;
+    /* outbound queues, written by the reactor when the socket is writable;
+     * live events go before replies to database requests */
+    GMutex lock;
+    GQueue *outq;
+    GQueue *bulkq;
+    GQueue *headq;          /* queue with a partly written first buffer */
+    gsize head_offset;      /* bytes of that buffer already written */
+    gsize queued_bytes;     /* in outq; replies are bounded by CISRV_CLIENT_MAX_REQUESTS */
+    gboolean want_write;
+    guint requests;         /* database requests waiting or being answered */
+    /* requests waiting for the one being answered, so replies keep their order */
+    GQueue *dbq;
+    gboolean db_busy;
+    gboolean read_paused;
+    /* partial frames, kept between reads */
+    gchar *rx_buf;
+    gsize rx_len;
+    gsize rx_size;
+    /* above the high watermark and not yet back below the low watermark */
+    gboolean congested;
+    gint64 congested_since;
+    guint64 evicted;
+    /* asked for replay, gets broadcasts with their sequence number */
+    gint sequenced;
+    /* subscription, changed under clist_lock and the client lock */
+    guint event_mask;
+    guint64 msn_mask;
+    gchar **msns;           /* subscribed MSNs if one of them has no bit of its own */
 } CIClient;
 
+/* Immutable snapshot of the connected clients. Readers iterate it without
+ * locking; changes publish a new snapshot and retire the old one, which is
+ * freed once no reader is left. */
+typedef struct _CIClientSet {
+    guint count;
+    CIClient *clients[];
+} CIClientSet;
+
 typedef struct _CIServer {
     int sock;
     gushort port;
     /*  pthread_t serverthread;*/
     GThread *serverthread;
     /*  pthread_mutex_t clist_lock;*/
+    /* serializes changes to the registry, readers do not take it */
     GMutex clist_lock;
-    int fdpipe[2];
+    NetutilReactor *reactor;
+    NetutilReactorSource *listen_source;
+    NetutilReactorSource *slow_timer;
+    GThreadPool *db_pool;
+    guint db_workers;
+    guint backlog;
+    guint max_clients;              /* 0: limited by the file limit only */
+    int spare_fd;                   /* given up to shed connections when out of descriptors */
+    guint64 shed;
     gushort state;
-    GList *clientlist;
+    CIClientSet *clients;           /* current snapshot */
+    gint readers;                   /* threads iterating a snapshot */
+    GPtrArray *members;             /* writer's copy, protected by clist_lock */
+    GSList *retired_sets;           /* protected by clist_lock */
+    GSList *retired_clients;
+    gsize high_watermark;
+    gsize low_watermark;
+    CIServerSlowPolicy slow_policy;
+    guint grace_period;
+    gint evicted;
+    gint disconnected;
+    /* the last broadcasts with their sequence frame, slot seq % replay_size */
+    GMutex replay_lock;
+    CIWireBuffer **replay;
+    guint replay_size;
+    guint replay_seq;               /* last sequence number handed out */
+    guint64 replayed;               /* protected by replay_lock */
+    /* MSN -> bit index of the subscription filters */
+    GMutex filter_lock;
+    GHashTable *msn_bits;
+    guint msn_count;
+    /* union of the filters of all clients, written under clist_lock */
+    guint event_union;
+    guint64 msn_union;
 } CIServer;
 
 typedef struct _CINetMessage {
@@ -58,14 +174,26 @@ typedef struct _CINetMessage {
     CIDataSet msgData;
 } CINetMessage;
 
-void _cisrv_add_client(int sock);
+typedef struct _CISrvDbRequest {
+    CIClient *client;
+    CINetMsg *msg;
+    CIExtMsg *ext;          /* server message instead of msg */
+} CISrvDbRequest;
+
+static CIClient *_cisrv_client_new(int sock);
 void _cisrv_remove_client(int sock);
 void _cisrv_remove_marked_clients(void);
 void _cisrv_close_all_clients(void);
 
 void _cisrv_handle_client_message(CIClient *client);
+void _cisrv_schedule_client_removal(void);
 
 void *_cisrv_listen_thread_proc(void *pdata);
+static void _cisrv_db_request_proc(gpointer data, gpointer userdata);
+static CIClientSet *_cisrv_registry_enter(void);
+static void _cisrv_registry_leave(void);
+static void _cisrv_registry_commit(void);
+static void _cisrv_registry_reclaim(void);
 
 CIServer _cisrv_server;
 
@@ -76,6 +204,16 @@ gint cisrv_init(void)
     _cisrv_server.sock = socket(AF_INET, SOCK_STREAM, 0);
     /*  pthread_mutex_init(&_cisrv_server.clist_lock, NULL);*/
     g_mutex_init(&_cisrv_server.clist_lock);
+    g_mutex_init(&_cisrv_server.replay_lock);
+    g_mutex_init(&_cisrv_server.filter_lock);
+    _cisrv_server.msn_bits = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    _cisrv_server.members = g_ptr_array_new();
+    _cisrv_registry_commit();
+    cisrv_set_client_limits(0, 0, CIServerSlowDropUpdates, 0);
+    cisrv_set_db_workers(0);
+    cisrv_set_connection_limits(0, 0);
+    cisrv_set_replay_size(0);
+    _cisrv_server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     if (_cisrv_server.sock == -1) {
         return 1;
     }
@@ -86,6 +224,7 @@ gint cisrv_init(void)
 gint cisrv_run(gushort port)
 {
     /*  int rc;*/
+    rlim_t limit;
     if (_cisrv_server.state == CISrvStateUninitialized) {
         return 1;
     }
@@ -93,12 +232,24 @@ gint cisrv_run(gushort port)
         return 2;
     }
 
-    if (pipe(_cisrv_server.fdpipe) != 0) {
+    if (_cisrv_server.reactor == NULL &&
+            (_cisrv_server.reactor = netutil_reactor_new()) == NULL) {
         return 3;
     }
 
     _cisrv_server.port = port;
 
+    limit = netutil_raise_fd_limit();
+    log_log("cisrv: file limit %lu\n", (gulong)limit);
+    if (_cisrv_server.max_clients && (rlim_t)_cisrv_server.max_clients + 64 > limit)
+        log_log("cisrv: file limit is too low for %u clients\n", _cisrv_server.max_clients);
+
+    if (_cisrv_server.db_pool == NULL &&
+            (_cisrv_server.db_pool = g_thread_pool_new(_cisrv_db_request_proc, NULL,
+                                                       _cisrv_server.db_workers, FALSE, NULL)) == NULL) {
+        return 3;
+    }
+
     /*  if ((rc = pthread_create(&_cisrv_server.serverthread, NULL, _cisrv_listen_thread_proc, NULL))) {
         return 4;
       }*/
@@ -109,86 +260,689 @@ gint cisrv_run(gushort port)
     return 0;
 }
 
+void cisrv_set_client_limits(gsize high_watermark, gsize low_watermark, CIServerSlowPolicy policy, guint grace_period)
+{
+    _cisrv_server.high_watermark = high_watermark ? high_watermark : CISRV_DEFAULT_HIGH_WATERMARK;
+    _cisrv_server.low_watermark = low_watermark ? low_watermark : CISRV_DEFAULT_LOW_WATERMARK;
+    if (_cisrv_server.low_watermark > _cisrv_server.high_watermark)
+        _cisrv_server.low_watermark = _cisrv_server.high_watermark / 2;
+    _cisrv_server.slow_policy = policy;
+    _cisrv_server.grace_period = grace_period ? grace_period : CISRV_DEFAULT_GRACE_PERIOD;
+}
+
+void cisrv_set_connection_limits(guint backlog, guint max_clients)
+{
+    _cisrv_server.backlog = backlog ? backlog : CISRV_DEFAULT_BACKLOG;
+    _cisrv_server.max_clients = max_clients;
+}
+
+void cisrv_set_db_workers(guint workers)
+{
+    _cisrv_server.db_workers = workers ? workers : CISRV_DEFAULT_DB_WORKERS;
+}
+
+static void _cisrv_wire_buffer_unref(CIWireBuffer *buf);
+
+/* Called with replay_lock held. */
+static
+void _cisrv_replay_clear(void)
+{
+    guint i;
+
+    for (i = 0; i < _cisrv_server.replay_size; ++i)
+        _cisrv_wire_buffer_unref(_cisrv_server.replay[i]);
+    g_free(_cisrv_server.replay);
+    _cisrv_server.replay = NULL;
+    _cisrv_server.replay_size = 0;
+}
+
+void cisrv_set_replay_size(guint events)
+{
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    _cisrv_replay_clear();
+    _cisrv_server.replay_size = events ? events : CISRV_DEFAULT_REPLAY_EVENTS;
+    _cisrv_server.replay = g_new0(CIWireBuffer *, _cisrv_server.replay_size);
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+}
+
+CIServerSlowPolicy cisrv_slow_policy_from_string(const gchar *str)
+{
+    if (str == NULL)
+        return CIServerSlowDropUpdates;
+    if (g_ascii_strcasecmp(str, "latest") == 0)
+        return CIServerSlowLatest;
+    if (g_ascii_strcasecmp(str, "disconnect") == 0)
+        return CIServerSlowDisconnect;
+    return CIServerSlowDropUpdates;
+}
+
+void cisrv_get_stats(CIServerStats *stats)
+{
+    CIClientSet *set;
+    guint i;
+
+    if (stats == NULL)
+        return;
+
+    memset(stats, 0, sizeof(CIServerStats));
+    set = _cisrv_registry_enter();
+    stats->clients = set->count;
+    for (i = 0; i < set->count; ++i) {
+        if (set->clients[i]->congested)
+            ++stats->congested;
+    }
+    _cisrv_registry_leave();
+    stats->evicted = (guint)g_atomic_int_get(&_cisrv_server.evicted);
+    stats->disconnected = (guint)g_atomic_int_get(&_cisrv_server.disconnected);
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    stats->replayed = _cisrv_server.replayed;
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+}
+
+/* Takes ownership of data. */
+static
+CIWireBuffer *_cisrv_wire_buffer_new(gchar *data, gsize len, gint msgtype, const gchar *msgid)
+{
+    CIWireBuffer *buf = g_malloc(sizeof(CIWireBuffer));
+
+    buf->refcount = 1;
+    buf->msgtype = msgtype;
+    buf->seq = 0;
+    buf->event_bit = CISRV_EVENT_BIT(msgtype >= 0 ? msgtype : CIServerMsgDisconnect);
+    buf->msn_bit = CISRV_MSNS_ALL;
+    buf->msn = NULL;
+    buf->msgid = g_strdup(msgid);
+    buf->data = data;
+    buf->len = len;
+    return buf;
+}
+
+static
+CIWireBuffer *_cisrv_wire_buffer_ref(CIWireBuffer *buf)
+{
+    g_atomic_int_inc(&buf->refcount);
+    return buf;
+}
+
+static
+void _cisrv_wire_buffer_unref(CIWireBuffer *buf)
+{
+    if (buf == NULL || !g_atomic_int_dec_and_test(&buf->refcount))
+        return;
+    g_free(buf->msgid);
+    g_free(buf->msn);
+    g_free(buf->data);
+    g_free(buf);
+}
+
+static
+void _cisrv_client_free(CIClient *client)
+{
+    g_queue_free_full(client->outq, (GDestroyNotify)_cisrv_wire_buffer_unref);
+    g_queue_free_full(client->bulkq, (GDestroyNotify)_cisrv_wire_buffer_unref);
+    /* every waiting request holds a reference, so this is empty */
+    g_queue_free(client->dbq);
+    g_free(client->rx_buf);
+    g_strfreev(client->msns);
+    g_mutex_clear(&client->lock);
+    g_free(client);
+}
+
+static
+CIClient *_cisrv_client_ref(CIClient *client)
+{
+    g_atomic_int_inc(&client->refcount);
+    return client;
+}
+
+/* The client list holds one reference, every pending database request another. */
+static
+void _cisrv_client_unref(CIClient *client)
+{
+    if (g_atomic_int_dec_and_test(&client->refcount))
+        _cisrv_client_free(client);
+}
+
+/* Called with the client lock held. */
+static
+void _cisrv_client_update_events(CIClient *client)
+{
+    guint32 events = 0;
+
+    if (client->source == NULL)
+        return;
+    if (!client->read_paused)
+        events |= EPOLLIN;
+    if (client->want_write)
+        events |= EPOLLOUT;
+    if (netutil_reactor_modify(_cisrv_server.reactor, client->source, events) != 0)
+        client->flags |= CISRV_CLIENT_REMOVE;
+}
+
+/* Take the client off the reactor. Requests still in the pool keep it
+ * alive, but will not queue anything for it anymore. */
+static
+void _cisrv_client_detach(CIClient *client)
+{
+    g_mutex_lock(&client->lock);
+    client->flags |= CISRV_CLIENT_REMOVE;
+    netutil_reactor_remove(_cisrv_server.reactor, client->source);
+    client->source = NULL;
+    g_mutex_unlock(&client->lock);
+}
+
+/* Bit of an MSN in the subscription filters, CISRV_MSN_OTHER if it has none.
+ * With add, MSNs get a bit while there are some left. */
+static
+guint64 _cisrv_filter_msn_bit(const gchar *msn, gboolean add)
+{
+    gpointer index;
+    guint64 bit = CISRV_MSN_OTHER;
+
+    if (msn == NULL || msn[0] == '\0')
+        return bit;
+
+    g_mutex_lock(&_cisrv_server.filter_lock);
+    if ((index = g_hash_table_lookup(_cisrv_server.msn_bits, msn)) != NULL)
+        bit = (guint64)1 << (GPOINTER_TO_UINT(index) - 1);
+    else if (add && _cisrv_server.msn_count < CISRV_MSN_BITS - 1) {
+        bit = (guint64)1 << _cisrv_server.msn_count++;
+        g_hash_table_insert(_cisrv_server.msn_bits, g_strdup(msn), GUINT_TO_POINTER(_cisrv_server.msn_count));
+    }
+    else if (add)
+        log_log("cisrv: no filter bit left for msn %s\n", msn);
+    g_mutex_unlock(&_cisrv_server.filter_lock);
+    return bit;
+}
+
+static
+gboolean _cisrv_client_wants(CIClient *client, guint event_bit, guint64 msn_bit, const gchar *msn)
+{
+    gboolean wants;
+    gchar **tmp;
+
+    g_mutex_lock(&client->lock);
+    wants = (client->event_mask & event_bit) && (client->msn_mask & msn_bit);
+    if (wants && msn_bit == CISRV_MSN_OTHER && client->msns != NULL) {
+        wants = FALSE;
+        for (tmp = client->msns; msn != NULL && *tmp != NULL && !wants; ++tmp)
+            wants = strcmp(*tmp, msn) == 0;
+    }
+    g_mutex_unlock(&client->lock);
+    return wants;
+}
+
+static
+CIClientSet *_cisrv_registry_enter(void)
+{
+    g_atomic_int_inc(&_cisrv_server.readers);
+    return (CIClientSet*)g_atomic_pointer_get(&_cisrv_server.clients);
+}
+
+static
+void _cisrv_registry_leave(void)
+{
+    g_atomic_int_add(&_cisrv_server.readers, -1);
+}
+
+/* Publish the members as new snapshot. Called with clist_lock held. */
+static
+void _cisrv_registry_commit(void)
+{
+    CIClientSet *set, *old;
+    CIClient *client;
+    guint event_union = 0, i;
+    guint64 msn_union = 0;
+
+    set = g_malloc(sizeof(CIClientSet) + _cisrv_server.members->len * sizeof(CIClient*));
+    set->count = _cisrv_server.members->len;
+    if (set->count)
+        memcpy(set->clients, _cisrv_server.members->pdata, set->count * sizeof(CIClient*));
+
+    for (i = 0; i < set->count; ++i) {
+        client = set->clients[i];
+        event_union |= client->event_mask;
+        msn_union |= client->msn_mask;
+    }
+    _cisrv_server.event_union = event_union;
+    _cisrv_server.msn_union = msn_union;
+
+    old = (CIClientSet*)g_atomic_pointer_get(&_cisrv_server.clients);
+    g_atomic_pointer_set(&_cisrv_server.clients, set);
+    if (old)
+        _cisrv_server.retired_sets = g_slist_prepend(_cisrv_server.retired_sets, old);
+}
+
+/* Readers take their snapshot after announcing themselves, so once no reader
+ * is left nobody can still see a retired snapshot or the clients removed with
+ * it. Called with clist_lock held. */
+static
+void _cisrv_registry_reclaim(void)
+{
+    if (_cisrv_server.retired_sets == NULL || g_atomic_int_get(&_cisrv_server.readers) != 0)
+        return;
+
+    g_slist_free_full(_cisrv_server.retired_sets, g_free);
+    _cisrv_server.retired_sets = NULL;
+    g_slist_free_full(_cisrv_server.retired_clients, (GDestroyNotify)_cisrv_client_unref);
+    _cisrv_server.retired_clients = NULL;
+}
+
+/* Called with clist_lock held, the registry's reference is dropped on reclaim. */
+static
+void _cisrv_registry_retire_client(CIClient *client)
+{
+    g_ptr_array_remove(_cisrv_server.members, client);
+    _cisrv_server.retired_clients = g_slist_prepend(_cisrv_server.retired_clients, client);
+}
+
+static
+void _cisrv_client_count_eviction(CIClient *client, gint msgtype, const gchar *msgid)
+{
+    ++client->evicted;
+    g_atomic_int_inc(&_cisrv_server.evicted);
+    log_log("cisrv: client %d is slow, evicted %s for %s (%" G_GUINT64_FORMAT " so far)\n",
+            client->sock, msgtype == CIServerMsgUpdate ? "update" : "complete",
+            msgid ? msgid : "-", client->evicted);
+}
+
+/* Apply the slow client policy to a new broadcast for a congested client.
+ * Returns TRUE if the new message is to be dropped. Called with the client
+ * lock held. */
+static
+gboolean _cisrv_client_apply_policy(CIClient *client, gint msgtype, const gchar *msgid)
+{
+    GList *link, *prev;
+    CIWireBuffer *buf;
+
+    switch (_cisrv_server.slow_policy) {
+        case CIServerSlowDropUpdates:
+            if (msgtype == CIServerMsgUpdate) {
+                _cisrv_client_count_eviction(client, msgtype, msgid);
+                return TRUE;
+            }
+            break;
+        case CIServerSlowLatest:
+            if (msgid == NULL || (msgtype != CIServerMsgUpdate && msgtype != CIServerMsgComplete))
+                break;
+            /* the head may be partly written already and has to stay */
+            for (link = client->outq->tail; link != NULL && link != client->outq->head; link = prev) {
+                prev = link->prev;
+                buf = (CIWireBuffer*)link->data;
+                if (buf->msgtype == CIServerMsgUpdate && buf->msgid != NULL && strcmp(buf->msgid, msgid) == 0) {
+                    client->queued_bytes -= buf->len;
+                    g_queue_delete_link(client->outq, link);
+                    _cisrv_client_count_eviction(client, buf->msgtype, buf->msgid);
+                    _cisrv_wire_buffer_unref(buf);
+                }
+            }
+            break;
+        case CIServerSlowDisconnect:
+            break;
+    }
+    return FALSE;
+}
+
+static
+void _cisrv_client_disconnect_slow(CIClient *client, const gchar *reason)
+{
+    client->flags |= CISRV_CLIENT_REMOVE;
+    g_atomic_int_inc(&_cisrv_server.disconnected);
+    log_log("cisrv: disconnecting slow client %d, %s (%" G_GSIZE_FORMAT " bytes queued)\n",
+            client->sock, reason, client->queued_bytes);
+}
+
+/* Queue a reference to the buffer for the client and let the reactor write it.
+ * bulk is set for replies to database requests. */
+static
+gint _cisrv_client_enqueue(CIClient *client, CIWireBuffer *buf, gboolean bulk)
+{
+    g_mutex_lock(&client->lock);
+    if (client->flags & CISRV_CLIENT_REMOVE) {
+        g_mutex_unlock(&client->lock);
+        return 1;
+    }
+    if (client->congested && buf->msgtype >= 0 && _cisrv_client_apply_policy(client, buf->msgtype, buf->msgid)) {
+        g_mutex_unlock(&client->lock);
+        return 0;
+    }
+
+    /* the watermarks only look at live events, a large reply does not make a client slow */
+    if (bulk)
+        g_queue_push_tail(client->bulkq, _cisrv_wire_buffer_ref(buf));
+    else {
+        g_queue_push_tail(client->outq, _cisrv_wire_buffer_ref(buf));
+        client->queued_bytes += buf->len;
+
+        if (!client->congested && client->queued_bytes > _cisrv_server.high_watermark) {
+            client->congested = TRUE;
+            client->congested_since = g_get_monotonic_time();
+            log_log("cisrv: client %d is not keeping up, %" G_GSIZE_FORMAT " bytes queued\n",
+                    client->sock, client->queued_bytes);
+        }
+        if (client->queued_bytes > _cisrv_server.high_watermark * CISRV_HARD_LIMIT_FACTOR) {
+            _cisrv_client_disconnect_slow(client, "queue limit reached");
+            g_mutex_unlock(&client->lock);
+            return 1;
+        }
+    }
+
+    if (!client->want_write) {
+        client->want_write = TRUE;
+        _cisrv_client_update_events(client);
+    }
+    g_mutex_unlock(&client->lock);
+
+    return 0;
+}
+
+/* A partly written buffer has to be finished first, then live events go
+ * before database replies. */
+static
+GQueue *_cisrv_client_next_queue(CIClient *client)
+{
+    if (client->head_offset != 0)
+        return client->headq;
+    if (!g_queue_is_empty(client->outq))
+        return client->outq;
+    if (!g_queue_is_empty(client->bulkq))
+        return client->bulkq;
+    return NULL;
+}
+
+/* Write as much of the queues as the socket takes without blocking, several
+ * buffers per syscall. */
+static
+void _cisrv_client_flush(CIClient *client)
+{
+    struct iovec iov[CISRV_FLUSH_IOV_MAX];
+    struct msghdr mh;
+    CIWireBuffer *buf;
+    GQueue *queue;
+    GList *link;
+    gsize offset;
+    ssize_t rc;
+    int n;
+
+    g_mutex_lock(&client->lock);
+    while ((queue = _cisrv_client_next_queue(client)) != NULL) {
+        offset = client->head_offset;
+        for (n = 0, link = queue->head; link != NULL && n < CISRV_FLUSH_IOV_MAX; link = link->next, ++n) {
+            buf = (CIWireBuffer*)link->data;
+            iov[n].iov_base = &buf->data[offset];
+            iov[n].iov_len = buf->len - offset;
+            offset = 0;
+        }
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n;
+
+        rc = sendmsg(client->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                client->flags |= CISRV_CLIENT_REMOVE;
+            break;
+        }
+
+        if (queue == client->outq)
+            client->queued_bytes -= rc;
+        while (rc > 0) {
+            buf = (CIWireBuffer*)g_queue_peek_head(queue);
+            if ((gsize)rc < buf->len - client->head_offset) {
+                client->head_offset += rc;
+                client->headq = queue;
+                break;
+            }
+            rc -= buf->len - client->head_offset;
+            client->head_offset = 0;
+            _cisrv_wire_buffer_unref(g_queue_pop_head(queue));
+        }
+        /* socket buffer is full */
+        if (client->head_offset != 0)
+            break;
+    }
+
+    if (client->congested && client->queued_bytes <= _cisrv_server.low_watermark) {
+        client->congested = FALSE;
+        log_log("cisrv: client %d caught up, %" G_GUINT64_FORMAT " messages evicted\n",
+                client->sock, client->evicted);
+    }
+
+    if (client->want_write && g_queue_is_empty(client->outq) && g_queue_is_empty(client->bulkq)) {
+        client->want_write = FALSE;
+        _cisrv_client_update_events(client);
+    }
+    g_mutex_unlock(&client->lock);
+}
+
+static
+void _cisrv_handle_client_input(int fd, guint32 events, CIClient *client)
+{
+    if (events & EPOLLOUT)
+        _cisrv_client_flush(client);
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        g_mutex_lock(&client->lock);
+        if (client->requests >= CISRV_CLIENT_MAX_REQUESTS) {
+            /* stop reading until the pool has caught up with this client */
+            if (events & (EPOLLERR | EPOLLHUP))
+                client->flags |= CISRV_CLIENT_REMOVE;
+            else if (!client->read_paused) {
+                client->read_paused = TRUE;
+                _cisrv_client_update_events(client);
+            }
+            events = 0;
+        }
+        g_mutex_unlock(&client->lock);
+        if (events)
+            _cisrv_handle_client_message(client);
+    }
+
+    if (client->flags & CISRV_CLIENT_REMOVE)
+        _cisrv_remove_marked_clients();
+}
+
+static
+void _cisrv_count_refused(const gchar *reason)
+{
+    ++_cisrv_server.shed;
+    /* log the 1st, 2nd, 4th, ... */
+    if ((_cisrv_server.shed & (_cisrv_server.shed - 1)) == 0)
+        log_log("ci2server: %s, %" G_GUINT64_FORMAT " connections refused\n", reason, _cisrv_server.shed);
+}
+
+/* Out of descriptors: accept the pending connection on the spare descriptor
+ * and close it, otherwise the listener stays readable and we spin. */
+static
+void _cisrv_shed_connection(int fd)
+{
+    int sock;
+
+    netutil_close_fd(&_cisrv_server.spare_fd);
+    if ((sock = accept(fd, NULL, NULL)) != -1) {
+        close(sock);
+        _cisrv_count_refused("out of file descriptors");
+    }
+    _cisrv_server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Take all pending connections, but publish the registry only once. */
+static
+void _cisrv_handle_accept(int fd, guint32 events, gpointer data)
+{
+    CIClient *clients[CISRV_ACCEPT_BATCH];
+    CIClientSet *set;
+    guint count = 0, current, i;
+    int newsock;
+
+    set = _cisrv_registry_enter();
+    current = set->count;
+    _cisrv_registry_leave();
+
+    while (count < CISRV_ACCEPT_BATCH) {
+        newsock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && _cisrv_server.spare_fd != -1) {
+                _cisrv_shed_connection(fd);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_log("ci2server: accept failed: %d (%s)\n", errno, strerror(errno));
+            break;
+        }
+        if (_cisrv_server.max_clients && current + count >= _cisrv_server.max_clients) {
+            _cisrv_count_refused("client limit reached");
+            close(newsock);
+            continue;
+        }
+        if ((clients[count] = _cisrv_client_new(newsock)) != NULL)
+            ++count;
+    }
+
+    if (count == 0)
+        return;
+
+    g_mutex_lock(&_cisrv_server.clist_lock);
+    for (i = 0; i < count; ++i)
+        g_ptr_array_add(_cisrv_server.members, clients[i]);
+    _cisrv_registry_commit();
+    _cisrv_registry_reclaim();
+    g_mutex_unlock(&_cisrv_server.clist_lock);
+}
+
+/* Runs on the reactor thread. */
+static
+void _cisrv_check_slow_clients(gpointer data)
+{
+    CIClientSet *set;
+    CIClient *client;
+    gint64 limit;
+    gboolean remove = FALSE;
+    guint i;
+
+    /* retired snapshots a busy broadcaster kept alive */
+    g_mutex_lock(&_cisrv_server.clist_lock);
+    _cisrv_registry_reclaim();
+    g_mutex_unlock(&_cisrv_server.clist_lock);
+
+    if (_cisrv_server.slow_policy != CIServerSlowDisconnect)
+        return;
+
+    limit = g_get_monotonic_time() - (gint64)_cisrv_server.grace_period * G_TIME_SPAN_SECOND;
+    set = _cisrv_registry_enter();
+    for (i = 0; i < set->count; ++i) {
+        client = set->clients[i];
+        g_mutex_lock(&client->lock);
+        if (client->congested && client->congested_since < limit && !(client->flags & CISRV_CLIENT_REMOVE)) {
+            _cisrv_client_disconnect_slow(client, "grace period expired");
+            remove = TRUE;
+        }
+        g_mutex_unlock(&client->lock);
+    }
+    _cisrv_registry_leave();
+
+    if (remove)
+        _cisrv_remove_marked_clients();
+}
+
+static
+void _cisrv_handle_signal(guint signals, gpointer data)
+{
+    if (signals & CISRV_SIGNAL_REMOVE_CLIENTS)
+        _cisrv_remove_marked_clients();
+}
+
 void *_cisrv_listen_thread_proc(void *pdata)
 {
-    fd_set fdSet;
     struct sockaddr_in addr;
     int rc;
-    int max;
-    int newsock;
-    GList *tmp;
 
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(_cisrv_server.port);
-    rc = wait_for_bind(_cisrv_server.sock, (const struct sockaddr *)&addr, sizeof(addr), _cisrv_server.fdpipe[0]);
+    rc = wait_for_bind(_cisrv_server.sock, (const struct sockaddr *)&addr, sizeof(addr),
+            netutil_reactor_get_signal_fd(_cisrv_server.reactor));
     if (rc == -1) {
         return NULL;
     }
     if (rc == 1) {
-        /* fdpipe has input, quit */
+        /* reactor has been signalled, quit */
         return NULL;
     }
-    rc = listen(_cisrv_server.sock, 10);
-    if (rc == -1) {
+    rc = listen(_cisrv_server.sock, _cisrv_server.backlog);
+    if (rc == -1 || netutil_set_nonblocking(_cisrv_server.sock) != 0) {
         log_log("ci2server: Could not listen: %d (%s)\n", errno, strerror(errno));
         return NULL;
     }
-    while (1) {
-        FD_ZERO(&fdSet);
-        FD_SET(_cisrv_server.sock, &fdSet);
-        FD_SET(_cisrv_server.fdpipe[0], &fdSet);
-        max = _cisrv_server.sock > _cisrv_server.fdpipe[0] ? _cisrv_server.sock : _cisrv_server.fdpipe[0];
-        /*    pthread_mutex_lock(&_cisrv_server.clist_lock);*/
-        g_mutex_lock(&_cisrv_server.clist_lock);
-        tmp = _cisrv_server.clientlist;
-        while (tmp) {
-            FD_SET(((CIClient *)(tmp->data))->sock, &fdSet);
-            if (((CIClient *)(tmp->data))->sock > max) {
-                max = ((CIClient *)(tmp->data))->sock;
-            }
-            tmp = g_list_next(tmp);
-        }
-        /*    pthread_mutex_unlock(&_cisrv_server.clist_lock);*/
-        g_mutex_unlock(&_cisrv_server.clist_lock);
-        rc = select(max+1, &fdSet, NULL, NULL, NULL);
-        if (rc == -1) {
-            return NULL;
-        }
-        if (FD_ISSET(_cisrv_server.sock, &fdSet)) {
-            newsock = accept(_cisrv_server.sock, NULL, NULL);
-            _cisrv_add_client(newsock);
-            if (newsock > max) {
-                max = newsock;
-            }
-        }
-        /*    pthread_mutex_lock(&_cisrv_server.clist_lock);*/
-        g_mutex_lock(&_cisrv_server.clist_lock);
-        tmp = _cisrv_server.clientlist;
-        while (tmp) {
-            if (FD_ISSET(((CIClient *)tmp->data)->sock, &fdSet)) {
-                _cisrv_handle_client_message((CIClient*)tmp->data);
-            }
-            tmp = g_list_next(tmp);
-        }
-        /*    pthread_mutex_unlock(&_cisrv_server.clist_lock);*/
-        g_mutex_unlock(&_cisrv_server.clist_lock);
-        _cisrv_remove_marked_clients();
 
-        if (FD_ISSET(_cisrv_server.fdpipe[0], &fdSet)) {
-            return NULL;
-        }
+    _cisrv_server.listen_source = netutil_reactor_add(_cisrv_server.reactor, _cisrv_server.sock, EPOLLIN,
+            (NetutilReactorHandler)_cisrv_handle_accept, NULL);
+    if (_cisrv_server.listen_source == NULL) {
+        return NULL;
     }
+    netutil_reactor_set_signal_handler(_cisrv_server.reactor, _cisrv_handle_signal, NULL);
+
+    _cisrv_server.slow_timer = netutil_reactor_add_timer(_cisrv_server.reactor, _cisrv_check_slow_clients, NULL);
+    if (_cisrv_server.slow_timer != NULL)
+        netutil_reactor_timer_arm(_cisrv_server.slow_timer, CISRV_SLOW_CHECK_INTERVAL, TRUE);
+
+    netutil_reactor_run(_cisrv_server.reactor);
+
+    netutil_reactor_remove(_cisrv_server.reactor, _cisrv_server.slow_timer);
+    _cisrv_server.slow_timer = NULL;
+
+    netutil_reactor_remove(_cisrv_server.reactor, _cisrv_server.listen_source);
+    _cisrv_server.listen_source = NULL;
+    return NULL;
 }
 
 gint cisrv_send_message(CIClient *client, gchar *buffer, gsize len)
 {
+    CIWireBuffer *buf;
+    gint rc;
+
     if (!client)
         return -1;
 
-    send(client->sock, buffer, len, 0);
-    return 0;
+    buf = _cisrv_wire_buffer_new(g_memdup(buffer, len), len, -1, NULL);
+    rc = _cisrv_client_enqueue(client, buf, FALSE);
+    _cisrv_wire_buffer_unref(buf);
+    return rc;
+}
+
+/* Replies to database requests queue behind live events. */
+static
+gint _cisrv_send_db_reply(CIClient *client, gchar *buffer, gsize len)
+{
+    CIWireBuffer *buf;
+    gint rc;
+
+    buf = _cisrv_wire_buffer_new(g_memdup(buffer, len), len, -1, NULL);
+    rc = _cisrv_client_enqueue(client, buf, TRUE);
+    _cisrv_wire_buffer_unref(buf);
+    return rc;
+}
+
+/* Serializes and frees the message. */
+static
+gint _cisrv_send_ext_reply(CIClient *client, CIExtMsg *msg, gboolean bulk)
+{
+    CIWireBuffer *buf;
+    gchar *data;
+    gsize len;
+    gint rc;
+
+    data = ciext_msg_write(msg, &len);
+    ciext_msg_free(msg);
+    buf = _cisrv_wire_buffer_new(data, len, -1, NULL);
+    rc = _cisrv_client_enqueue(client, buf, bulk);
+    _cisrv_wire_buffer_unref(buf);
+    return rc;
 }
 
 void _cisrv_handle_client_message_version(CIClient *client, CINetMsgVersion *msg)
@@ -217,7 +971,6 @@ void _cisrv_handle_client_message_version(CIClient *client, CINetMsgVersion *msg
 void _cisrv_handle_client_message_leave(CIClient *client, CINetMsgLeave *msg)
 {
     log_log("Client wants to leave\n");
-    client->flags |= CISRV_CLIENT_REMOVE;
     CINetMsg *reply = NULL;
     reply = cinet_message_new(CI_NET_MSG_LEAVE, "guid", ((CINetMsg*)msg)->guid, NULL, NULL);
     gchar *msgdata = NULL;
@@ -226,6 +979,8 @@ void _cisrv_handle_client_message_leave(CIClient *client, CINetMsgLeave *msg)
     cinet_msg_write_msg(&msgdata, &msglen, reply);
 
     cisrv_send_message(client, msgdata, msglen);
+    /* only after the reply is queued, removal flushes it once more */
+    client->flags |= CISRV_CLIENT_REMOVE;
 
     cinet_msg_free(reply);
     g_free(msgdata);
@@ -239,7 +994,7 @@ void _cisrv_handle_client_message_db_num_calls(CIClient *client, CINetMsgDbNumCa
     cinet_message_new_for_data(&msgdata, &msglen, CI_NET_MSG_DB_NUM_CALLS,
             "count", dbhandler_get_num_calls(), "guid", ((CINetMsg*)msg)->guid, NULL, NULL);
 
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_free(msgdata);
 }
@@ -282,7 +1037,7 @@ void _cisrv_handle_client_message_db_call_list(CIClient *client, CINetMsgDbCallL
 
     cinet_msg_write_msg(&msgdata, &msglen, (CINetMsg*)reply);
 
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_list_free_full(result, g_free);
     cinet_msg_free((CINetMsg*)reply);
@@ -306,7 +1061,7 @@ void _cisrv_handle_client_message_db_get_caller(CIClient *client, CINetMsgDbGetC
             "name", rc == 0 ? name : NULL,
             NULL, NULL);
 
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_free(msgdata);
 }
@@ -319,7 +1074,7 @@ void _cisrv_handle_client_message_db_add_caller(CIClient *client, CINetMsgDbAddC
     gsize msglen = 0;
 
     cinet_msg_write_msg(&msgdata, &msglen, (CINetMsg*)msg);
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_free(msgdata);
 }
@@ -332,7 +1087,7 @@ void _cisrv_handle_client_message_db_del_caller(CIClient *client, CINetMsgDbDelC
     gsize msglen = 0;
 
     cinet_msg_write_msg(&msgdata, &msglen, (CINetMsg*)msg);
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_free(msgdata);
 }
@@ -364,53 +1119,375 @@ void _cisrv_handle_client_message_db_get_caller_list(CIClient *client, CINetMsgD
 
     cinet_msg_write_msg(&msgdata, &msglen, (CINetMsg*)reply);
 
-    cisrv_send_message(client, msgdata, msglen);
+    _cisrv_send_db_reply(client, msgdata, msglen);
 
     g_list_free_full(result, g_free);
     cinet_msg_free((CINetMsg*)reply);
     g_free(msgdata);
 }
 
-void _cisrv_handle_client_message(CIClient *client)
+/* One page of the call list, continuing after the call the cursor points to.
+ * Unlike the offset of DB_CALL_LIST the page does not move when calls come in.
+ * Each call is a group of its own, the reply has the cursor of the next page. */
+static
+void _cisrv_handle_ext_calls(CIClient *client, CIExtMsg *msg)
 {
-    char buffer[32];
-    CINetMsgHeader header;
-    ssize_t rc = recv(client->sock, buffer, CINET_HEADER_LENGTH, 0);
-    if (rc == 0 || rc == -1) {
-        client->flags |= CISRV_CLIENT_REMOVE;
-        log_log("error: rc=%d\n", rc);
-        return;
+    CIExtMsg *reply;
+    GList *result, *tmp;
+    CIDbCall *call;
+    gchar *cursor, *next = NULL, group[32];
+    gint user, count;
+    guint i = 0;
+
+    user = g_key_file_get_integer(msg->kf, "calls", "user", NULL);
+    count = g_key_file_get_integer(msg->kf, "calls", "count", NULL);
+    cursor = g_key_file_get_string(msg->kf, "calls", "cursor", NULL);
+
+    result = dbhandler_get_calls_after(user, cursor, count, &next);
+
+    reply = ciext_msg_new("calls", msg->guid);
+    if (next != NULL)
+        g_key_file_set_string(reply->kf, "calls", "next", next);
+    for (tmp = result; tmp != NULL; tmp = g_list_next(tmp)) {
+        call = (CIDbCall*)tmp->data;
+        snprintf(group, sizeof(group), "call %u", i++);
+        g_key_file_set_integer(reply->kf, group, "id", call->id);
+        g_key_file_set_string(reply->kf, group, "completenumber", call->data.cidsNumberComplete);
+        g_key_file_set_string(reply->kf, group, "areacode", call->data.cidsAreaCode);
+        g_key_file_set_string(reply->kf, group, "number", call->data.cidsNumber);
+        g_key_file_set_string(reply->kf, group, "date", call->data.cidsDate);
+        g_key_file_set_string(reply->kf, group, "time", call->data.cidsTime);
+        g_key_file_set_string(reply->kf, group, "msn", call->data.cidsMSN);
+        g_key_file_set_string(reply->kf, group, "alias", call->data.cidsAlias);
+        g_key_file_set_string(reply->kf, group, "area", call->data.cidsArea);
+        g_key_file_set_string(reply->kf, group, "name", call->data.cidsName);
     }
+    _cisrv_send_ext_reply(client, reply, TRUE);
 
-    if (cinet_msg_read_header(&header, buffer, rc) < CINET_HEADER_LENGTH) {
-        /* read everything left */
-        log_log("header not complete\n");
-        while (recv(client->sock, buffer, 32, MSG_DONTWAIT) > 0);
-        return;
+    g_list_free_full(result, g_free);
+    g_free(cursor);
+    g_free(next);
+}
+
+/* Number of calls per msn or per day from the counters the database keeps,
+ * so a statistics view does not scan the call list. */
+static
+void _cisrv_handle_ext_counts(CIClient *client, CIExtMsg *msg)
+{
+    CIExtMsg *reply;
+    GList *result, *tmp;
+    CIDbCount *count;
+    gchar *kind, group[32];
+    guint i = 0;
+
+    kind = g_key_file_get_string(msg->kf, "counts", "kind", NULL);
+    result = dbhandler_get_call_counts(kind ? kind : DBHANDLER_COUNT_MSN);
+
+    reply = ciext_msg_new("counts", msg->guid);
+    g_key_file_set_string(reply->kf, "counts", "kind", kind ? kind : DBHANDLER_COUNT_MSN);
+    for (tmp = result; tmp != NULL; tmp = g_list_next(tmp)) {
+        count = (CIDbCount*)tmp->data;
+        snprintf(group, sizeof(group), "count %u", i++);
+        g_key_file_set_string(reply->kf, group, "key", count->key);
+        g_key_file_set_uint64(reply->kf, group, "count", count->count);
     }
+    _cisrv_send_ext_reply(client, reply, TRUE);
+
+    g_list_free_full(result, g_free);
+    g_free(kind);
+}
+
+static
+void _cisrv_db_request_answer_ext(CIClient *client, CIExtMsg *msg)
+{
+    if (strcmp(msg->name, "calls") == 0)
+        _cisrv_handle_ext_calls(client, msg);
+    else if (strcmp(msg->name, "counts") == 0)
+        _cisrv_handle_ext_counts(client, msg);
+}
 
-    char *msgdata = malloc(CINET_HEADER_LENGTH + header.msglen);
-    if (!msgdata) {
-        log_log("no msg data\n");
+static
+void _cisrv_db_request_answer(CIClient *client, CINetMsg *msg)
+{
+    if (client->flags & CISRV_CLIENT_REMOVE)
         return;
+
+    switch (msg->msgtype) {
+        case CI_NET_MSG_DB_NUM_CALLS:
+            _cisrv_handle_client_message_db_num_calls(client, (CINetMsgDbNumCalls*)msg);
+            break;
+        case CI_NET_MSG_DB_CALL_LIST:
+            _cisrv_handle_client_message_db_call_list(client, (CINetMsgDbCallList*)msg);
+            break;
+        case CI_NET_MSG_DB_GET_CALLER:
+            _cisrv_handle_client_message_db_get_caller(client, (CINetMsgDbGetCaller*)msg);
+            break;
+        case CI_NET_MSG_DB_ADD_CALLER:
+            _cisrv_handle_client_message_db_add_caller(client, (CINetMsgDbAddCaller*)msg);
+            break;
+        case CI_NET_MSG_DB_DEL_CALLER:
+            _cisrv_handle_client_message_db_del_caller(client, (CINetMsgDbDelCaller*)msg);
+            break;
+        case CI_NET_MSG_DB_GET_CALLER_LIST:
+            _cisrv_handle_client_message_db_get_caller_list(client, (CINetMsgDbGetCallerList*)msg);
+            break;
     }
+}
 
-    memcpy(msgdata, buffer, CINET_HEADER_LENGTH);
+/* Database requests are answered by the pool, away from the reactor thread.
+ * A worker answers the requests of one client one after the other, so an add
+ * is done before a later list is read and the replies keep their order. */
+static
+void _cisrv_db_request_proc(gpointer data, gpointer userdata)
+{
+    CISrvDbRequest *req = (CISrvDbRequest*)data;
+    CIClient *client = req->client;
+
+    while (req != NULL) {
+        if (req->ext != NULL) {
+            if (!(client->flags & CISRV_CLIENT_REMOVE))
+                _cisrv_db_request_answer_ext(client, req->ext);
+            ciext_msg_free(req->ext);
+        }
+        else {
+            _cisrv_db_request_answer(client, req->msg);
+            cinet_msg_free(req->msg);
+        }
+        g_free(req);
 
-    ssize_t bytes_read = 0;
-    while (bytes_read < header.msglen) {
-        rc = recv(client->sock, &msgdata[CINET_HEADER_LENGTH + bytes_read], header.msglen-bytes_read, MSG_DONTWAIT);
-        if (rc <= 0) {
-            client->flags |= CISRV_CLIENT_REMOVE;
-            log_log("could not read rest of message\n");
-            return;
+        g_mutex_lock(&client->lock);
+        --client->requests;
+        if (client->read_paused && client->requests < CISRV_CLIENT_MAX_REQUESTS) {
+            client->read_paused = FALSE;
+            _cisrv_client_update_events(client);
         }
+        if ((req = (CISrvDbRequest*)g_queue_pop_head(client->dbq)) == NULL)
+            client->db_busy = FALSE;
+        g_mutex_unlock(&client->lock);
+
+        /* the reference of the request just answered */
+        _cisrv_client_unref(client);
+    }
+}
+
+/* Takes ownership of msg or ext, the other one is NULL. */
+static
+void _cisrv_queue_db_request(CIClient *client, CINetMsg *msg, CIExtMsg *ext)
+{
+    CISrvDbRequest *req = g_malloc(sizeof(CISrvDbRequest));
+    gboolean busy;
+
+    req->client = _cisrv_client_ref(client);
+    req->msg = msg;
+    req->ext = ext;
+
+    g_mutex_lock(&client->lock);
+    ++client->requests;
+    busy = client->db_busy;
+    if (busy)
+        g_queue_push_tail(client->dbq, req);
+    else
+        client->db_busy = TRUE;
+    g_mutex_unlock(&client->lock);
+
+    if (!busy)
+        g_thread_pool_push(_cisrv_server.db_pool, req, NULL);
+}
+
+static
+guint _cisrv_replay_next_seq(void)
+{
+    guint seq;
+
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    /* 0 means none */
+    if (++_cisrv_server.replay_seq == 0)
+        ++_cisrv_server.replay_seq;
+    seq = _cisrv_server.replay_seq;
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+    return seq;
+}
 
-        bytes_read += rc;
+static
+void _cisrv_replay_store(CIWireBuffer *buf)
+{
+    CIWireBuffer **slot;
+
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    slot = &_cisrv_server.replay[buf->seq % _cisrv_server.replay_size];
+    /* a broadcaster that got an older number may come in late */
+    if (*slot == NULL || (*slot)->seq < buf->seq) {
+        _cisrv_wire_buffer_unref(*slot);
+        *slot = _cisrv_wire_buffer_ref(buf);
     }
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+}
+
+/* The broadcast as sent to sequenced clients: an event frame with the
+ * sequence number, followed by the libcinet frame of wire. */
+static
+CIWireBuffer *_cisrv_wire_buffer_new_sequenced(CIWireBuffer *wire, guint seq)
+{
+    CIWireBuffer *buf;
+    CIExtMsg *ext;
+    gchar *head, *data;
+    gsize len;
+
+    ext = ciext_msg_new("event", 0);
+    g_key_file_set_uint64(ext->kf, "event", "seq", seq);
+    head = ciext_msg_write(ext, &len);
+    ciext_msg_free(ext);
+
+    data = g_malloc(len + wire->len);
+    memcpy(data, head, len);
+    memcpy(&data[len], wire->data, wire->len);
+    g_free(head);
+
+    buf = _cisrv_wire_buffer_new(data, len + wire->len, wire->msgtype, wire->msgid);
+    buf->seq = seq;
+    buf->msn_bit = wire->msn_bit;
+    buf->msn = g_strdup(wire->msn);
+    return buf;
+}
 
+/* From now on the client gets broadcasts with their sequence number. If it
+ * tells the last one it has seen, the broadcasts after it are queued straight
+ * from the ring. The reply has the newest sequence number and how many events
+ * were no longer kept; only then does the client need the database.
+ * Events broadcast while this runs may reach the client twice. */
+static
+void _cisrv_handle_ext_replay(CIClient *client, CIExtMsg *msg)
+{
+    CIWireBuffer *buf;
+    CIExtMsg *reply;
+    guint seq, last, oldest, missed = 0, replayed = 0;
+    gboolean catch_up, reset = FALSE;
+
+    catch_up = g_key_file_has_key(msg->kf, "replay", "seq", NULL);
+    seq = (guint)g_key_file_get_uint64(msg->kf, "replay", "seq", NULL) + 1;
+
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    g_atomic_int_set(&client->sequenced, TRUE);
+    last = _cisrv_server.replay_seq;
+    if (catch_up) {
+        if (seq > last + 1) {
+            /* a number of an earlier run, all of this run is new to the client */
+            reset = TRUE;
+            seq = 1;
+        }
+        oldest = last >= _cisrv_server.replay_size ? last - _cisrv_server.replay_size + 1 : 1;
+        if (seq < oldest) {
+            missed = oldest - seq;
+            seq = oldest;
+        }
+        for (; seq <= last; ++seq) {
+            buf = _cisrv_server.replay[seq % _cisrv_server.replay_size];
+            if (buf == NULL || buf->seq != seq) {
+                /* handed out but not stored yet, the client gets it live */
+                continue;
+            }
+            if (!_cisrv_client_wants(client, buf->event_bit, buf->msn_bit, buf->msn))
+                continue;
+            _cisrv_client_enqueue(client, buf, FALSE);
+            ++replayed;
+        }
+        _cisrv_server.replayed += replayed;
+    }
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+
+    reply = ciext_msg_new("replay", msg->guid);
+    g_key_file_set_uint64(reply->kf, "replay", "seq", last);
+    g_key_file_set_uint64(reply->kf, "replay", "missed", missed);
+    g_key_file_set_boolean(reply->kf, "replay", "reset", reset);
+    _cisrv_send_ext_reply(client, reply, FALSE);
+}
+
+/* Replace the filter of the client. Without msns it gets all MSNs, without
+ * stages all stages of a ring. */
+static
+void _cisrv_handle_ext_subscribe(CIClient *client, CIExtMsg *msg)
+{
+    guint event_mask = CISRV_EVENT_BIT(CIServerMsgDisconnect);
+    guint64 msn_mask = 0;
+    gchar **msns, **stages, **tmp;
+    GError *error = NULL;
+    gboolean calls;
+
+    stages = g_key_file_get_string_list(msg->kf, "subscribe", "stages", NULL, NULL);
+    for (tmp = stages; tmp != NULL && *tmp != NULL; ++tmp) {
+        if (strcmp(*tmp, "init") == 0)
+            event_mask |= CISRV_EVENT_BIT(CIServerMsgMessage);
+        else if (strcmp(*tmp, "update") == 0)
+            event_mask |= CISRV_EVENT_BIT(CIServerMsgUpdate);
+        else if (strcmp(*tmp, "complete") == 0)
+            event_mask |= CISRV_EVENT_BIT(CIServerMsgComplete);
+    }
+    if (stages == NULL)
+        event_mask |= CISRV_EVENT_BIT(CIServerMsgMessage) | CISRV_EVENT_BIT(CIServerMsgUpdate) |
+            CISRV_EVENT_BIT(CIServerMsgComplete);
+    g_strfreev(stages);
+
+    calls = g_key_file_get_boolean(msg->kf, "subscribe", "calls", &error);
+    if (error != NULL) {
+        calls = TRUE;
+        g_error_free(error);
+    }
+    if (calls)
+        event_mask |= CISRV_EVENT_BIT(CIServerMsgCall);
+
+    msns = g_key_file_get_string_list(msg->kf, "subscribe", "msns", NULL, NULL);
+    if (msns == NULL)
+        msn_mask = CISRV_MSNS_ALL;
+    else {
+        for (tmp = msns; *tmp != NULL; ++tmp)
+            msn_mask |= _cisrv_filter_msn_bit(*tmp, TRUE);
+        /* the names are only needed to tell apart MSNs sharing the last bit */
+        if (!(msn_mask & CISRV_MSN_OTHER)) {
+            g_strfreev(msns);
+            msns = NULL;
+        }
+    }
+
+    g_mutex_lock(&_cisrv_server.clist_lock);
+    g_mutex_lock(&client->lock);
+    client->event_mask = event_mask;
+    client->msn_mask = msn_mask;
+    g_strfreev(client->msns);
+    client->msns = msns;
+    g_mutex_unlock(&client->lock);
+    _cisrv_registry_commit();
+    g_mutex_unlock(&_cisrv_server.clist_lock);
+
+    _cisrv_send_ext_reply(client, ciext_msg_new("subscribe", msg->guid), FALSE);
+}
+
+static
+void _cisrv_dispatch_ext_frame(CIClient *client, gchar *data, gsize len)
+{
+    CIExtMsg *msg;
+
+    if ((msg = ciext_msg_read(data, len)) == NULL) {
+        log_log("error converting message\n");
+        return;
+    }
+    if (strcmp(msg->name, "replay") == 0)
+        _cisrv_handle_ext_replay(client, msg);
+    else if (strcmp(msg->name, "subscribe") == 0)
+        _cisrv_handle_ext_subscribe(client, msg);
+    else if (strcmp(msg->name, "calls") == 0 || strcmp(msg->name, "counts") == 0) {
+        _cisrv_queue_db_request(client, NULL, msg);
+        return;
+    }
+    else
+        log_log("unhandled message from client: %s\n", msg->name);
+    ciext_msg_free(msg);
+}
+
+static
+void _cisrv_dispatch_client_frame(CIClient *client, gchar *data, gsize len)
+{
     CINetMsg *msg = NULL;
-    if (cinet_msg_read_msg(&msg, msgdata, bytes_read + CINET_HEADER_LENGTH) == 0) {
+    if (cinet_msg_read_msg(&msg, data, len) == 0) {
         switch (msg->msgtype) {
             case CI_NET_MSG_VERSION:
                 _cisrv_handle_client_message_version(client, (CINetMsgVersion*)msg);
@@ -419,23 +1496,13 @@ void _cisrv_handle_client_message(CIClient *client)
                 _cisrv_handle_client_message_leave(client, (CINetMsgLeave*)msg);
                 break;
             case CI_NET_MSG_DB_NUM_CALLS:
-                _cisrv_handle_client_message_db_num_calls(client, (CINetMsgDbNumCalls*)msg);
-                break;
             case CI_NET_MSG_DB_CALL_LIST:
-                _cisrv_handle_client_message_db_call_list(client, (CINetMsgDbCallList*)msg);
-                break;
             case CI_NET_MSG_DB_GET_CALLER:
-                _cisrv_handle_client_message_db_get_caller(client, (CINetMsgDbGetCaller*)msg);
-                break;
             case CI_NET_MSG_DB_ADD_CALLER:
-                _cisrv_handle_client_message_db_add_caller(client, (CINetMsgDbAddCaller*)msg);
-                break;
             case CI_NET_MSG_DB_DEL_CALLER:
-                _cisrv_handle_client_message_db_del_caller(client, (CINetMsgDbDelCaller*)msg);
-                break;
             case CI_NET_MSG_DB_GET_CALLER_LIST:
-                _cisrv_handle_client_message_db_get_caller_list(client, (CINetMsgDbGetCallerList*)msg);
-                break;
+                _cisrv_queue_db_request(client, msg, NULL);
+                return;
             default:
                 log_log("unhandled message from client: %d\n", msg->msgtype);
                 break;
@@ -447,10 +1514,91 @@ void _cisrv_handle_client_message(CIClient *client)
     cinet_msg_free(msg);
 }
 
+/* Read what the socket has and decode every complete frame in the buffer.
+ * The magic tells server messages from libcinet frames. We wait for the
+ * header, after that for the body; incomplete frames stay for the next read. */
+void _cisrv_handle_client_message(CIClient *client)
+{
+    CINetMsgHeader header;
+    gsize pos = 0, body, frame, need = 0;
+    gboolean ext;
+    ssize_t rc;
+
+    rc = recv(client->sock, &client->rx_buf[client->rx_len], client->rx_size - client->rx_len, MSG_DONTWAIT);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (rc == 0 || rc == -1) {
+        client->flags |= CISRV_CLIENT_REMOVE;
+        log_log("error: rc=%d\n", rc);
+        return;
+    }
+    client->rx_len += rc;
+
+    while (client->rx_len - pos >= CIEXT_MAGIC_LENGTH && !(client->flags & CISRV_CLIENT_REMOVE)) {
+        ext = ciext_is_frame(&client->rx_buf[pos], client->rx_len - pos);
+        if (ext) {
+            if (client->rx_len - pos < CIEXT_HEADER_LENGTH)
+                break;
+            body = ciext_frame_body_length(&client->rx_buf[pos]);
+            frame = CIEXT_HEADER_LENGTH;
+        }
+        else {
+            if (client->rx_len - pos < CINET_HEADER_LENGTH)
+                break;
+            if (cinet_msg_read_header(&header, &client->rx_buf[pos], CINET_HEADER_LENGTH) < CINET_HEADER_LENGTH)
+                body = CISRV_MAX_FRAME_SIZE + 1;
+            else
+                body = header.msglen;
+            frame = CINET_HEADER_LENGTH;
+        }
+        if (body > CISRV_MAX_FRAME_SIZE) {
+            /* no way to find the next frame */
+            log_log("invalid header from client %d\n", client->sock);
+            client->flags |= CISRV_CLIENT_REMOVE;
+            return;
+        }
+        frame += body;
+        if (client->rx_len - pos < frame) {
+            need = frame;
+            break;
+        }
+        if (ext)
+            _cisrv_dispatch_ext_frame(client, &client->rx_buf[pos], frame);
+        else
+            _cisrv_dispatch_client_frame(client, &client->rx_buf[pos], frame);
+        pos += frame;
+    }
+
+    if (pos > 0) {
+        client->rx_len -= pos;
+        memmove(client->rx_buf, &client->rx_buf[pos], client->rx_len);
+    }
+    if (need > client->rx_size) {
+        client->rx_size = need;
+        client->rx_buf = g_realloc(client->rx_buf, client->rx_size);
+    }
+    else if (need == 0 && client->rx_size > CISRV_RX_BUFFER_SIZE && client->rx_len <= CISRV_RX_BUFFER_SIZE) {
+        client->rx_size = CISRV_RX_BUFFER_SIZE;
+        client->rx_buf = g_realloc(client->rx_buf, client->rx_size);
+    }
+}
+
 gint cisrv_broadcast_message(CIServerMsg msgtype, CIDataSet *data, gchar *msgid)
 {
-    GList *tmp;
+    CIClientSet *set;
+    CIClient *client;
+    guint i, count, event_bit;
+    guint64 msn_bit = CISRV_MSNS_ALL;
+    const gchar *msn = NULL;
     CINetMessage cmsg;
+
+    if (msgtype > CIServerMsgCall)
+        return 1;
+    event_bit = CISRV_EVENT_BIT(msgtype);
+    if (data && msgtype != CIServerMsgDisconnect) {
+        msn = data->cidsMSN;
+        msn_bit = _cisrv_filter_msn_bit(msn, FALSE);
+    }
     memset(&cmsg, 0, sizeof(CINetMessage));
     if (data) {
         memcpy(&cmsg.msgData, data, sizeof(CIDataSet));
@@ -521,37 +1669,47 @@ gint cisrv_broadcast_message(CIServerMsg msgtype, CIDataSet *data, gchar *msgid)
 
     gchar *msgdata = NULL;
     gsize len = 0;
-    gssize bytes_written , rc;
+    CIWireBuffer *wire, *sequenced = NULL, *legacy = NULL;
 
     cinet_msg_write_msg(&msgdata, &len, msg);
     cinet_msg_free(msg);
+    wire = _cisrv_wire_buffer_new(msgdata, len, msgtype, msgid);
+    wire->msn_bit = msn_bit;
+    if (msn_bit == CISRV_MSN_OTHER)
+        wire->msn = g_strdup(msn);
+    if (msgtype != CIServerMsgDisconnect) {
+        sequenced = _cisrv_wire_buffer_new_sequenced(wire, _cisrv_replay_next_seq());
+        _cisrv_replay_store(sequenced);
+    }
 
-    g_mutex_lock(&_cisrv_server.clist_lock);
-    for (tmp = _cisrv_server.clientlist; tmp != NULL; tmp = g_list_next(tmp)) {
-        log_log("broadcast to %p\n", tmp);
-        bytes_written = 0;
-        if (CI_CHECK_VERSION(((CIClient*)(tmp->data))->version, CI_MAKE_VERSION(3,0,0))) {
-            while (bytes_written < len) {
-                rc = send(((CIClient*)(tmp->data))->sock, &msgdata[bytes_written],
-                        len - bytes_written, 0);
-                if (rc <= 0) {
-                    ((CIClient*)tmp->data)->flags |= CISRV_CLIENT_REMOVE;
-                    break;
-                }
-                bytes_written += rc;
-            }
+    /* only queue the message, the reactor thread does the writing; the ring
+     * keeps it even if no client subscribed to it now */
+    set = _cisrv_registry_enter();
+    count = (_cisrv_server.event_union & event_bit) && (_cisrv_server.msn_union & msn_bit) ? set->count : 0;
+    for (i = 0; i < count; ++i) {
+        client = set->clients[i];
+        if (!_cisrv_client_wants(client, event_bit, msn_bit, msn))
+            continue;
+        if (sequenced && g_atomic_int_get(&client->sequenced)) {
+            _cisrv_client_enqueue(client, sequenced, FALSE);
+        }
+        else if (CI_CHECK_VERSION(client->version, CI_MAKE_VERSION(3,0,0))) {
+            _cisrv_client_enqueue(client, wire, FALSE);
         }
         else if (msgtype != CIServerMsgCall) {
-            if (send(((CIClient *)(tmp->data))->sock, &cmsg, sizeof(CINetMessage), 0) < sizeof(CINetMessage)) {
-                ((CIClient *)(tmp->data))->flags |= CISRV_CLIENT_REMOVE;
-            }
+            if (legacy == NULL)
+                legacy = _cisrv_wire_buffer_new(g_memdup(&cmsg, sizeof(CINetMessage)),
+                        sizeof(CINetMessage), msgtype, msgid);
+            _cisrv_client_enqueue(client, legacy, FALSE);
         }
     }
-    g_mutex_unlock(&_cisrv_server.clist_lock);
+    _cisrv_registry_leave();
 
-    g_free(msgdata);
+    _cisrv_wire_buffer_unref(wire);
+    _cisrv_wire_buffer_unref(sequenced);
+    _cisrv_wire_buffer_unref(legacy);
 
-    _cisrv_remove_marked_clients();
+    _cisrv_schedule_client_removal();
     return 0;
 }
 
@@ -559,22 +1717,20 @@ gint cisrv_disconnect(void)
 {
     log_log("cisrv_disconnect\n");
     int bval;
-    size_t bytes;
     switch (_cisrv_server.state) {
         case CISrvStateRunning:
-            log_log("write to pipe\n");
-            bytes = write(_cisrv_server.fdpipe[1], "disconnect", 10);
-            if (bytes != 10) {
-                log_log("Error writing to pipe.\n");
-            }
+            netutil_reactor_stop(_cisrv_server.reactor);
             if (_cisrv_server.serverthread) {
                 log_log("cisrv: join: %p\n", _cisrv_server.serverthread);
                 g_thread_join(_cisrv_server.serverthread);
                 _cisrv_server.serverthread = NULL;
                 log_log("joined\n");
             }
-            close(_cisrv_server.fdpipe[0]);
-            close(_cisrv_server.fdpipe[1]);
+            /* answer what is still pending, the replies are flushed below */
+            if (_cisrv_server.db_pool) {
+                g_thread_pool_free(_cisrv_server.db_pool, FALSE, TRUE);
+                _cisrv_server.db_pool = NULL;
+            }
             _cisrv_server.state = CISrvStateConnected;
         case CISrvStateConnected:
             log_log("broadcast message\n");
@@ -610,60 +1766,105 @@ void _cisrv_shutdown_sock(int sock)
 
 void _cisrv_close_all_clients(void)
 {
+    CIClient *client;
+
     g_mutex_lock(&_cisrv_server.clist_lock);
-    while (_cisrv_server.clientlist) {
-       _cisrv_shutdown_sock(((CIClient *)_cisrv_server.clientlist->data)->sock);
-        g_free((CIClient *)_cisrv_server.clientlist->data);
-        _cisrv_server.clientlist = g_list_remove(_cisrv_server.clientlist, _cisrv_server.clientlist->data);
+    while (_cisrv_server.members->len) {
+        client = (CIClient *)g_ptr_array_index(_cisrv_server.members, 0);
+        /* best effort to get the shutdown message out */
+        _cisrv_client_flush(client);
+        _cisrv_client_detach(client);
+        _cisrv_shutdown_sock(client->sock);
+        _cisrv_registry_retire_client(client);
     }
+    _cisrv_registry_commit();
+    _cisrv_registry_reclaim();
     g_mutex_unlock(&_cisrv_server.clist_lock);
 }
 
 void _cisrv_remove_marked_clients(void)
 {
-    GList *tmp, *next;
+    CIClient *client;
+    gboolean changed = FALSE;
+    guint i = 0;
+
     g_mutex_lock(&_cisrv_server.clist_lock);
     /*  pthread_mutex_lock(&_cisrv_server.clist_lock);*/
-    tmp = _cisrv_server.clientlist;
-    while (tmp) {
-        next = g_list_next(tmp);
-        if (((CIClient *)tmp->data)->flags & CISRV_CLIENT_REMOVE) {
-            log_log("removing client %d\n", ((CIClient*)tmp->data)->sock);
-            _cisrv_shutdown_sock(((CIClient *)tmp->data)->sock);
-            g_free((CIClient *)tmp->data);
-            _cisrv_server.clientlist = g_list_remove(_cisrv_server.clientlist, tmp->data);
+    while (i < _cisrv_server.members->len) {
+        client = (CIClient *)g_ptr_array_index(_cisrv_server.members, i);
+        if (client->flags & CISRV_CLIENT_REMOVE) {
+            log_log("removing client %d\n", client->sock);
+            /* last chance for replies queued before the client was marked */
+            _cisrv_client_flush(client);
+            _cisrv_client_detach(client);
+            _cisrv_shutdown_sock(client->sock);
+            _cisrv_registry_retire_client(client);
+            changed = TRUE;
         }
-        tmp = next;
+        else
+            ++i;
+    }
+    if (changed) {
+        _cisrv_registry_commit();
+        _cisrv_registry_reclaim();
     }
     g_mutex_unlock(&_cisrv_server.clist_lock);
     /*  pthread_mutex_unlock(&_cisrv_server.clist_lock);*/
 }
 
-void _cisrv_add_client(int sock)
+/* Clients are only removed on the reactor thread, which owns their sources.
+ * Other threads mark them and let the reactor do the work. */
+void _cisrv_schedule_client_removal(void)
+{
+    if (_cisrv_server.state == CISrvStateRunning)
+        netutil_reactor_signal(_cisrv_server.reactor, CISRV_SIGNAL_REMOVE_CLIENTS);
+    else
+        _cisrv_remove_marked_clients();
+}
+
+/* The socket has to be non-blocking already. The client is not registered yet. */
+static
+CIClient *_cisrv_client_new(int sock)
 {
     CIClient *cl = g_malloc0(sizeof(CIClient));
     log_log("cisrv_add_client: %d %s\n", sock, netutil_get_remote_address(sock));
+    cl->refcount = 1;
     cl->sock = sock;
+    g_mutex_init(&cl->lock);
+    cl->outq = g_queue_new();
+    cl->bulkq = g_queue_new();
+    cl->dbq = g_queue_new();
+    cl->rx_size = CISRV_RX_BUFFER_SIZE;
+    cl->rx_buf = g_malloc(cl->rx_size);
+    cl->event_mask = CISRV_EVENTS_ALL;
+    cl->msn_mask = CISRV_MSNS_ALL;
     /* assume that client version is at least 2.0.0 until we receive a version message */
     cl->version = CI_MAKE_VERSION(2,0,0);
-    /*  pthread_mutex_lock(&_cisrv_server.clist_lock);*/
-    g_mutex_lock(&_cisrv_server.clist_lock);
-    _cisrv_server.clientlist = g_list_append(_cisrv_server.clientlist, (gpointer)cl);
-    g_mutex_unlock(&_cisrv_server.clist_lock);
-    /*  pthread_mutex_unlock(&_cisrv_server.clist_lock);*/
+    cl->source = netutil_reactor_add(_cisrv_server.reactor, sock, EPOLLIN,
+            (NetutilReactorHandler)_cisrv_handle_client_input, cl);
+    if (cl->source == NULL) {
+        close(sock);
+        _cisrv_client_free(cl);
+        return NULL;
+    }
+    return cl;
 }
 
 void _cisrv_remove_client(int sock)
 {
-    GList *tmp;
+    CIClient *client;
+    guint i;
     log_log("cisrv_remove_client\n");
     g_mutex_lock(&_cisrv_server.clist_lock);
     /*  pthread_mutex_lock(&_cisrv_server.clist_lock);*/
-    for (tmp = _cisrv_server.clientlist; tmp != NULL; tmp = g_list_next(tmp)) {
-        if (((CIClient *)tmp->data)->sock == sock) {
+    for (i = 0; i < _cisrv_server.members->len; ++i) {
+        client = (CIClient *)g_ptr_array_index(_cisrv_server.members, i);
+        if (client->sock == sock) {
+            _cisrv_client_detach(client);
             close(sock);
-            g_free((CIClient *)tmp->data);
-            _cisrv_server.clientlist = g_list_remove(_cisrv_server.clientlist, tmp->data);
+            _cisrv_registry_retire_client(client);
+            _cisrv_registry_commit();
+            _cisrv_registry_reclaim();
             break;
         }
     }
@@ -673,6 +1874,31 @@ void _cisrv_remove_client(int sock)
 
 gint cisrv_cleanup(void)
 {
+    if (_cisrv_server.db_pool) {
+        g_thread_pool_free(_cisrv_server.db_pool, FALSE, TRUE);
+        _cisrv_server.db_pool = NULL;
+    }
+    netutil_reactor_free(_cisrv_server.reactor);
+    _cisrv_server.reactor = NULL;
+    g_mutex_lock(&_cisrv_server.clist_lock);
+    _cisrv_registry_reclaim();
+    g_mutex_unlock(&_cisrv_server.clist_lock);
+    g_free(_cisrv_server.clients);
+    _cisrv_server.clients = NULL;
+    if (_cisrv_server.members) {
+        g_ptr_array_free(_cisrv_server.members, TRUE);
+        _cisrv_server.members = NULL;
+    }
     g_mutex_clear(&_cisrv_server.clist_lock);
+    g_mutex_lock(&_cisrv_server.replay_lock);
+    _cisrv_replay_clear();
+    g_mutex_unlock(&_cisrv_server.replay_lock);
+    g_mutex_clear(&_cisrv_server.replay_lock);
+    if (_cisrv_server.msn_bits) {
+        g_hash_table_destroy(_cisrv_server.msn_bits);
+        _cisrv_server.msn_bits = NULL;
+    }
+    g_mutex_clear(&_cisrv_server.filter_lock);
+    netutil_close_fd(&_cisrv_server.spare_fd);
     return 0;
 }
@@ -12,10 +12,35 @@ typedef enum {
     CIServerMsgCall
 } CIServerMsg;
 
+/* What happens to a client whose queue is above the high watermark */
+typedef enum {
+    CIServerSlowDropUpdates = 0,    /* discard Update messages */
+    CIServerSlowLatest,             /* keep only the newest Update or Complete per msgid */
+    CIServerSlowDisconnect          /* disconnect if it does not catch up within the grace period */
+} CIServerSlowPolicy;
+
+typedef struct _CIServerStats {
+    guint clients;
+    guint congested;
+    guint64 evicted;                /* messages discarded for slow clients */
+    guint64 disconnected;           /* slow clients disconnected */
+    guint64 replayed;               /* events sent to reconnecting clients from memory */
+} CIServerStats;
+
 gint cisrv_init(void);
 gint cisrv_run(gushort port);
 gint cisrv_broadcast_message(CIServerMsg msgtype, CIDataSet *data, gchar *msgid);
 gint cisrv_disconnect(void);
 gint cisrv_cleanup(void);
 
+void cisrv_set_client_limits(gsize high_watermark, gsize low_watermark, CIServerSlowPolicy policy, guint grace_period);
+CIServerSlowPolicy cisrv_slow_policy_from_string(const gchar *str);
+/* threads answering database requests of clients */
+void cisrv_set_db_workers(guint workers);
+/* listen backlog and maximum number of clients, 0 for the defaults */
+void cisrv_set_connection_limits(guint backlog, guint max_clients);
+/* broadcasts kept for reconnecting clients, 0 for the default */
+void cisrv_set_replay_size(guint events);
+void cisrv_get_stats(CIServerStats *stats);
+
 #endif
@@ -16,60 +16,105 @@
 #include "ci_areacodes.h"
 #include "logging.h"
 
-long int _ciac_indizes[100];
-char *_ciac_filename = NULL;
+static CIAreaCodeTree *_ciac_root = NULL;
 
 /** @brief Init the system.
  */
 void ci_init_area_codes(void)
 {
-    memset(_ciac_indizes, 0, sizeof(long int)*100);
-    _ciac_filename = NULL;
+    _ciac_root = NULL;
+}
+
+static void _ciac_free_tree(CIAreaCodeTree *node)
+{
+    int i;
+
+    if (node == NULL) {
+        return;
+    }
+    for (i = 0; i < 10; i++) {
+        _ciac_free_tree(node->child[i]);
+    }
+    g_free(node->data);
+    g_free(node);
+}
+
+/** @brief Insert an area code into the tree
+ *  @param[in] root The root of the tree
+ *  @param[in] line A line of the area code file, the code followed by the area
+ */
+static void _ciac_insert(CIAreaCodeTree *root, const char *line)
+{
+    CIAreaCodeTree *node = root;
+    int i, digit;
+    size_t len;
+
+    for (i = 0; g_ascii_isdigit(line[i]); i++) {
+        digit = g_ascii_digit_value(line[i]);
+        if (node->child[digit] == NULL) {
+            node->child[digit] = g_malloc0(sizeof(CIAreaCodeTree));
+        }
+        node = node->child[digit];
+    }
+    /* codes are at least three digits; keep the first entry for a code */
+    if (i < 3 || i >= (int)sizeof(node->data->acCode) || node->data != NULL) {
+        return;
+    }
+
+    node->data = g_malloc0(sizeof(CIAreaCode));
+    memcpy(node->data->acCode, line, i);
+    while (g_ascii_isspace(line[i])) {
+        i++;
+    }
+    g_strlcpy(node->data->acArea, &line[i], sizeof(node->data->acArea));
+    len = strlen(node->data->acArea);
+    if (len > 0 && node->data->acArea[len - 1] == '\n') {
+        node->data->acArea[len - 1] = '\0';
+    }
 }
 
 /** @brief Read area codes from file
  *
- *  Create an index of the file
+ *  The whole file is loaded into the tree, lookups do not touch the file.
+ *  The codes can only be loaded once, lookups never wait for a tree that
+ *  could be freed under them.
  *  @param[in] filename The given filename from which the codes should be read.
  *  @return    0 on success, 1 otherwise
- *  @todo make indizes for multiple areacode files
  */
 int ci_read_area_codes_from_file(char *filename)
 {
     FILE *f;
-    long int pos;
     char buffer[256];
-    int index;
+    CIAreaCodeTree *root;
 
-    if (!filename) {
+    if (!filename || g_atomic_pointer_get(&_ciac_root) != NULL) {
         return 1;
     }
-    _ciac_filename = g_strdup(filename);
 
-    if ((f = fopen(_ciac_filename, "r")) == NULL) {
+    if ((f = fopen(filename, "r")) == NULL) {
         return 1;
     }
 
-    while (!feof(f)) {
-        pos = ftell(f);
-        if (fgets(buffer, 256, f) && strlen(buffer) >= 3 && g_ascii_isdigit(buffer[0]) &&
-                g_ascii_isdigit(buffer[1]) && g_ascii_isdigit(buffer[2])) {
-            index = 10*g_ascii_digit_value(buffer[1])+g_ascii_digit_value(buffer[2]);
-            if (_ciac_indizes[index] == 0) {
-                _ciac_indizes[index] = pos;
-            }
-        }
+    root = g_malloc0(sizeof(CIAreaCodeTree));
+    while (fgets(buffer, 256, f)) {
+        _ciac_insert(root, buffer);
     }
     fclose(f);
 
+    /* lookups may already be running, publish the tree when it is complete */
+    g_atomic_pointer_set(&_ciac_root, root);
+
     return 0;
 }
 
 /** @brief Free all ressources used by the area codes
+ *
+ *  No lookup may be running anymore.
  */
 void ci_free_area_codes(void)
 {
-    g_free(_ciac_filename);
+    _ciac_free_tree(g_atomic_pointer_get(&_ciac_root));
+    g_atomic_pointer_set(&_ciac_root, NULL);
 }
 
 /** @brief Get an area code for a given number.
@@ -81,12 +126,10 @@ void ci_free_area_codes(void)
  */
 int ci_get_area_code(char *numComplete, char *numAreaCode, char *numNumber, char *strArea)
 {
-    int index;
-    int i, j;
-    char buffer[256];
-    FILE *f;
+    CIAreaCodeTree *node = g_atomic_pointer_get(&_ciac_root);
+    int i;
 
-    if (!_ciac_filename || !numComplete || !numAreaCode || !numNumber || !strArea) {
+    if (!node || !numComplete || !numAreaCode || !numNumber || !strArea) {
         return 1;
     }
     strcpy(numAreaCode, _("<unknown>"));
@@ -95,72 +138,19 @@ int ci_get_area_code(char *numComplete, char *numAreaCode, char *numNumber, char
     }
     strcpy(strArea, _("<unknown>"));
 
-    if (!g_ascii_isdigit(numComplete[0])) {
-        return 1;
-    }
-    numAreaCode[0] = numComplete[0];
-    index = 0;
-    if (g_ascii_isdigit(numComplete[1])) {
-        index = g_ascii_digit_value(numComplete[1]);
-    }
-    if (g_ascii_isdigit(numComplete[2])) {
-        index = 10*index+g_ascii_digit_value(numComplete[2]);
-    }
-
-    if (index > 0 && _ciac_indizes[index] == 0) {
-        strcpy(numAreaCode, _("<unknown>"));
-        return 1;
-    }
-
-    if ((f = fopen(_ciac_filename, "r")) == NULL) {
-        return 1;
-    }
-
-    fseek(f, _ciac_indizes[index], SEEK_SET);
-
-    while (!feof(f)) {
-        if (fgets(buffer, 256, f)) {
-            i = 0;
-            while (g_ascii_isdigit(buffer[i]) &&
-                    g_ascii_digit_value(buffer[i]) == g_ascii_digit_value(numComplete[i])) {
-                i++;
-            }
-            if (i > 2 && !g_ascii_isdigit(buffer[i])) {
-                /* matched all digits */
-                for (j = 0; j < i; j++) {
-                    numAreaCode[j] = numComplete[j];
-                }
-                numAreaCode[i] = '\0';
-                j = 0;
-                while (numComplete[j+i] != '\0') {
-                    numNumber[j] = numComplete[j+i];
-                    j++;
-                }
-                numNumber[j] = '\0';
-
-                while (g_ascii_isspace(buffer[i])) {
-                    i++;
-                }
-
-                j = 0;
-                while (buffer[i] != '\n' && buffer[i] != '\0') {
-                    strArea[j] = buffer[i];
-                    i++;
-                    j++;
-                }
-                strArea[j] = '\0';
-                fclose(f);
-                return 0;
-            }
-            else if (g_ascii_digit_value(buffer[i]) > g_ascii_digit_value(numComplete[i])) {
-                /* not found */
-                strcpy(numAreaCode, _("<unknown>"));
-                fclose(f);
-                return 1;
-            }
+    /* the shortest code that is a prefix of the number */
+    for (i = 0; g_ascii_isdigit(numComplete[i]); i++) {
+        node = node->child[g_ascii_digit_value(numComplete[i])];
+        if (node == NULL) {
+            return 1;
+        }
+        if (node->data != NULL) {
+            strcpy(numAreaCode, node->data->acCode);
+            memmove(numNumber, &numComplete[i + 1], strlen(&numComplete[i + 1]) + 1);
+            strcpy(strArea, node->data->acArea);
+            return 0;
         }
     }
 
-    fclose(f);
     return 1;
 }
@@ -5,8 +5,45 @@
 #include <memory.h>
 #include "logging.h"
 
+#define FRITZ_DEFAULT_PORT      1012
+
 static Fritz2CIConfig _config;
 
+/* [Fritz] either describes a single box with Host and Port or lists the
+ * names of several boxes in Boxes, each configured in its own [Fritz <name>]
+ * group. */
+static void _config_load_boxes(GKeyFile *kf)
+{
+    gchar **names;
+    gchar *group;
+    gsize count = 0, i;
+    gint port;
+
+    names = g_key_file_get_string_list(kf, "Fritz", "Boxes", &count, NULL);
+    if (names == NULL || count == 0) {
+        g_strfreev(names);
+        _config.fritz_boxes = g_malloc0(sizeof(Fritz2CIBox));
+        _config.fritz_box_count = 1;
+        _config.fritz_boxes[0].name = g_strdup("fritz");
+        _config.fritz_boxes[0].host = g_key_file_get_string(kf, "Fritz", "Host", NULL);
+        port = g_key_file_get_integer(kf, "Fritz", "Port", NULL);
+        _config.fritz_boxes[0].port = port > 0 ? (gushort)port : FRITZ_DEFAULT_PORT;
+        return;
+    }
+
+    _config.fritz_boxes = g_malloc0(sizeof(Fritz2CIBox) * count);
+    _config.fritz_box_count = count;
+    for (i = 0; i < count; ++i) {
+        group = g_strdup_printf("Fritz %s", names[i]);
+        _config.fritz_boxes[i].name = g_strdup(names[i]);
+        _config.fritz_boxes[i].host = g_key_file_get_string(kf, group, "Host", NULL);
+        port = g_key_file_get_integer(kf, group, "Port", NULL);
+        _config.fritz_boxes[i].port = port > 0 ? (gushort)port : FRITZ_DEFAULT_PORT;
+        g_free(group);
+    }
+    g_strfreev(names);
+}
+
 gint config_load(gchar *conffile)
 {
     GKeyFile *kf = g_key_file_new();
@@ -16,31 +53,73 @@ gint config_load(gchar *conffile)
     }
     if (!g_key_file_load_from_file(kf, conffile, G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL)) {
         log_log("could not read config file, setting defaults\n");
-        _config.fritz_host = g_strdup("127.0.0.1");
-        _config.fritz_port = 1012;
+        _config.fritz_boxes = g_malloc0(sizeof(Fritz2CIBox));
+        _config.fritz_box_count = 1;
+        _config.fritz_boxes[0].name = g_strdup("fritz");
+        _config.fritz_boxes[0].host = g_strdup("127.0.0.1");
+        _config.fritz_boxes[0].port = FRITZ_DEFAULT_PORT;
         _config.ci2_port = 63690;
+        _config.ci2_high_watermark = 0;
+        _config.ci2_low_watermark = 0;
+        _config.ci2_slow_client_policy = NULL;
+        _config.ci2_grace_period = 0;
+        _config.ci2_db_workers = 0;
+        _config.ci2_backlog = 0;
+        _config.ci2_max_clients = 0;
+        _config.ci2_replay_events = 0;
         _config.db_location = g_strdup("ci.db");
+        _config.db_spool_location = g_strdup("ci.db.spool");
         _config.areacodes_location = g_strdup("/usr/share/fritz2ci/vorwahl.dat");
         _config.cache_location = g_strdup("cache.db");
         _config.lookup_sources_location = g_strdup("/usr/share/fritz2ci/revlookup.xml");;
         _config.msn_lookup_location = g_strdup("/usr/share/fritz2ci/msn.dat");
         _config.data_backup_location = g_strdup("cidata.dat");
+        _config.journal_commit_interval = 0;
+        _config.journal_sync = NULL;
+        _config.journal_segment_size = 0;
         _config.lookup_source_id = 1;
+        _config.lookup_deadline = 0;
+        _config.lookup_timeout = 0;
+        _config.call_queue_size = 0;
+        _config.enrich_workers = 0;
+        _config.lookup_workers = 0;
+        _config.fanout_workers = 0;
+        _config.stage_queue_size = 0;
         _config.log_file = NULL;
         _config.pid_file = NULL;
     }
     else {
         /*    log_log("Reading config file %s\n", conffile);*/
-        _config.fritz_host = g_key_file_get_string(kf, "Fritz", "Host", NULL);
-        _config.fritz_port = (gushort)g_key_file_get_integer(kf, "Fritz", "Port", NULL);
+        _config_load_boxes(kf);
         _config.ci2_port = (gushort)g_key_file_get_integer(kf, "CIServer", "Port", NULL);
+        _config.ci2_high_watermark = g_key_file_get_integer(kf, "CIServer", "HighWatermark", NULL);
+        _config.ci2_low_watermark = g_key_file_get_integer(kf, "CIServer", "LowWatermark", NULL);
+        _config.ci2_slow_client_policy = g_key_file_get_string(kf, "CIServer", "SlowClientPolicy", NULL);
+        _config.ci2_grace_period = g_key_file_get_integer(kf, "CIServer", "GracePeriod", NULL);
+        _config.ci2_db_workers = g_key_file_get_integer(kf, "CIServer", "DbWorkers", NULL);
+        _config.ci2_backlog = g_key_file_get_integer(kf, "CIServer", "Backlog", NULL);
+        _config.ci2_max_clients = g_key_file_get_integer(kf, "CIServer", "MaxClients", NULL);
+        _config.ci2_replay_events = g_key_file_get_integer(kf, "CIServer", "ReplayEvents", NULL);
         _config.db_location = g_key_file_get_string(kf, "Database", "Location", NULL);
+        _config.db_spool_location = g_key_file_get_string(kf, "Database", "Spoolfile", NULL);
+        if (_config.db_spool_location == NULL && _config.db_location != NULL)
+            _config.db_spool_location = g_strdup_printf("%s.spool", _config.db_location);
         _config.cache_location = g_key_file_get_string(kf, "Cache", "Location", NULL);
         _config.lookup_sources_location = g_key_file_get_string(kf, "Lookup", "Location", NULL);
         _config.areacodes_location = g_key_file_get_string(kf, "Areacodes", "Location", NULL);
         _config.msn_lookup_location = g_key_file_get_string(kf, "Lookup", "MSNFile", NULL);
         _config.data_backup_location = g_key_file_get_string(kf, "Database", "Backupfile", NULL);
+        _config.journal_commit_interval = g_key_file_get_integer(kf, "Journal", "CommitInterval", NULL);
+        _config.journal_sync = g_key_file_get_string(kf, "Journal", "Sync", NULL);
+        _config.journal_segment_size = g_key_file_get_uint64(kf, "Journal", "SegmentSize", NULL);
         _config.lookup_source_id = g_key_file_get_integer(kf, "Lookup", "Source", NULL);
+        _config.lookup_deadline = g_key_file_get_integer(kf, "Lookup", "Deadline", NULL);
+        _config.lookup_timeout = g_key_file_get_integer(kf, "Lookup", "Timeout", NULL);
+        _config.call_queue_size = g_key_file_get_integer(kf, "Processing", "QueueSize", NULL);
+        _config.enrich_workers = g_key_file_get_integer(kf, "Processing", "EnrichWorkers", NULL);
+        _config.lookup_workers = g_key_file_get_integer(kf, "Processing", "LookupWorkers", NULL);
+        _config.fanout_workers = g_key_file_get_integer(kf, "Processing", "FanoutWorkers", NULL);
+        _config.stage_queue_size = g_key_file_get_integer(kf, "Processing", "StageQueueSize", NULL);
         _config.log_file = g_key_file_get_string(kf, "Daemon", "Logfile", NULL);
         _config.pid_file = g_key_file_get_string(kf, "Daemon", "Pidfile", NULL);
         g_key_file_free(kf);
@@ -51,16 +130,28 @@ gint config_load(gchar *conffile)
 
 void config_free(void)
 {
-    g_free(_config.fritz_host);
+    gsize i;
+    for (i = 0; i < _config.fritz_box_count; ++i) {
+        g_free(_config.fritz_boxes[i].name);
+        g_free(_config.fritz_boxes[i].host);
+    }
+    g_free(_config.fritz_boxes);
+    _config.fritz_boxes = NULL;
+    _config.fritz_box_count = 0;
     g_free(_config.db_location);
+    g_free(_config.db_spool_location);
     g_free(_config.cache_location);
     g_free(_config.lookup_sources_location);
     g_free(_config.areacodes_location);
     g_free(_config.configfile);
     g_free(_config.msn_lookup_location);
     g_free(_config.data_backup_location);
+    g_free(_config.journal_sync);
+    g_free(_config.ci2_slow_client_policy);
     g_free(_config.log_file);
     g_free(_config.pid_file);
+    g_strfreev(_config.replay_journals);
+    _config.replay_journals = NULL;
 }
 
 const Fritz2CIConfig *config_get_config(void)
@@ -71,6 +162,8 @@ const Fritz2CIConfig *config_get_config(void)
 static GOptionEntry _cmd_line_options[] = {
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &_config.verbose, "Be verbose", NULL },
     { "daemon", 'd', 0, G_OPTION_ARG_NONE, &_config.daemon, "Start as daemon", NULL },
+    { "replay-journal", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &_config.replay_journals,
+        "Load a journal file into the database and exit (repeat for several files, oldest first)", "FILE" },
     { NULL }
 };
 
@@ -3,11 +3,26 @@
 
 #include <glib.h>
 
+typedef struct _Fritz2CIBox {
+    gchar *name;
+    gchar *host;
+    gushort port;
+} Fritz2CIBox;
+
 typedef struct _Fritz2CIConfig {
-    gchar *fritz_host;
-    gushort fritz_port;
+    Fritz2CIBox *fritz_boxes;
+    gsize fritz_box_count;
     gushort ci2_port;
+    guint ci2_high_watermark;
+    guint ci2_low_watermark;
+    gchar *ci2_slow_client_policy;
+    guint ci2_grace_period;
+    guint ci2_db_workers;
+    guint ci2_backlog;
+    guint ci2_max_clients;
+    guint ci2_replay_events;
     gchar *db_location;
+    gchar *db_spool_location;
     gchar *cache_location;
     gchar *lookup_sources_location;
     gchar *areacodes_location;
@@ -17,9 +32,20 @@ typedef struct _Fritz2CIConfig {
     gchar *configfile;
     gchar *log_file;
     gchar *pid_file;
+    gchar **replay_journals;
     gchar *msn_lookup_location;
     gchar *data_backup_location;
+    guint journal_commit_interval;
+    gchar *journal_sync;
+    guint64 journal_segment_size;
     guint lookup_source_id;
+    guint lookup_deadline;
+    guint lookup_timeout;
+    guint call_queue_size;
+    guint enrich_workers;
+    guint lookup_workers;
+    guint fanout_workers;
+    guint stage_queue_size;
 } Fritz2CIConfig;
 
 gint parse_cmd_line(int *pargc, char *** pargv);
@@ -18,56 +18,313 @@
 #define DBHANDLER_STMT_GET_CALLER               1
 #define DBHANDLER_STMT_GET_CALLS                2
 #define DBHANDLER_STMT_GET_NUM_CALLS            3
-#define DBHANDLER_STMT_NUM_STMTS                4
-
+#define DBHANDLER_STMT_GET_CALLS_AFTER          4
+#define DBHANDLER_STMT_GET_CALL_COUNTS          5
+#define DBHANDLER_STMT_NUM_STMTS                6
+
+#define DBHANDLER_BULK_TRANSACTION_ROWS         50000
+/* a write waits this long (usec) for others to share its transaction */
+#define DBHANDLER_COMMIT_INTERVAL               (20 * 1000)
+#define DBHANDLER_BUSY_TIMEOUT                  5000        /* msec */
+/* vm instructions between calls of the progress handler during migrations */
+#define DBHANDLER_PROGRESS_OPS                  100000
+#define DBHANDLER_PROGRESS_INTERVAL             (2 * G_TIME_SPAN_SECOND)
+
+typedef enum {
+    DbWriteCalls,
+    DbWriteAddCaller,
+    DbWriteRemoveCaller
+} CIDbWriteType;
+
+/* A write handed to the writer thread, the caller waits until it is committed. */
+typedef struct _CIDbWrite {
+    CIDbWriteType type;
+    CIDataSet *data;
+    guint count;
+    gint user;
+    gchar *number;
+    gchar *name;
+    gint rc;
+    gboolean done;
+} CIDbWrite;
+
+typedef struct _CIDbWriter {
+    GMutex lock;
+    GCond wakeup;               /* writer: writes are waiting */
+    GCond committed;            /* callers: a transaction is done */
+    GQueue *queue;
+    gint64 commit_at;           /* when the oldest queued write is due */
+    gboolean stop;
+    GThread *thread;
+} CIDbWriter;
+
+/* Schema changes, applied in order to databases with a lower user_version.
+ * Never change a released step, add a new one. */
+typedef struct _CIDbMigration {
+    gint version;
+    const char *description;
+    const char *sql;
+} CIDbMigration;
+
+static const CIDbMigration _dbhandler_migrations[] = {
+    { 1, "base tables",
+        "create table if not exists cidata(id integer primary key, number varchar(31),"
+        " name varchar(255), timestamp integer, msn varchar(15), msn_alias varchar(20),"
+        " service varchar(20), fix varchar(20));"
+        "create table if not exists cicaller(clientid integer, number varchar(31), name varchar(255));" },
+    { 2, "caller lookup index",
+        "create index if not exists cicaller_client_number on cicaller(clientid, number);" },
+    { 3, "call time index",
+        "create index if not exists cidata_timestamp on cidata(timestamp);" },
+    /* call lists join on the caller, so a number may have one name per user only */
+    { 4, "unique callers",
+        "delete from cicaller where rowid not in (select max(rowid) from cicaller group by clientid, number);"
+        "drop index if exists cicaller_client_number;"
+        "create unique index if not exists cicaller_client_number_unique on cicaller(clientid, number);" },
+    /* calls in total, per msn and per day, kept up to date by triggers */
+    { 5, "call counts",
+        "create table if not exists cicounts(kind varchar(8), key varchar(31), count integer not null,"
+        " primary key(kind, key));"
+        "insert or replace into cicounts select 'all', '', count(*) from cidata;"
+        "insert or replace into cicounts select 'msn', coalesce(msn, ''), count(*) from cidata"
+        " group by coalesce(msn, '');"
+        "insert or replace into cicounts select 'day', date(timestamp, 'unixepoch', 'localtime'), count(*)"
+        " from cidata group by date(timestamp, 'unixepoch', 'localtime');"
+        "create trigger if not exists cidata_count_insert after insert on cidata begin"
+        " insert or ignore into cicounts values ('all', '', 0), ('msn', coalesce(new.msn, ''), 0),"
+        "  ('day', date(new.timestamp, 'unixepoch', 'localtime'), 0);"
+        " update cicounts set count=count+1 where kind='all' and key='';"
+        " update cicounts set count=count+1 where kind='msn' and key=coalesce(new.msn, '');"
+        " update cicounts set count=count+1 where kind='day' and key=date(new.timestamp, 'unixepoch', 'localtime');"
+        " end;"
+        "create trigger if not exists cidata_count_delete after delete on cidata begin"
+        " update cicounts set count=count-1 where kind='all' and key='';"
+        " update cicounts set count=count-1 where kind='msn' and key=coalesce(old.msn, '');"
+        " update cicounts set count=count-1 where kind='day' and key=date(old.timestamp, 'unixepoch', 'localtime');"
+        " end;" },
+};
+
+/* Indexes on cidata that a bulk load drops. A load that did not finish leaves
+ * them missing, so they are created again on open. */
+static const char *_dbhandler_cidata_indexes[] = {
+    "create index if not exists cidata_timestamp on cidata(timestamp);",
+};
+
+typedef struct _CIDbMigrationProgress {
+    const CIDbMigration *migration;
+    gint64 start;
+    gint64 report_at;
+} CIDbMigrationProgress;
+
+/* Read connection of one thread. */
+typedef struct _CIDbReader {
+    sqlite3 *db;
+    sqlite3_stmt *stmts[DBHANDLER_STMT_NUM_STMTS];
+} CIDbReader;
+
+/* the write connection, used by the writer thread and by bulk loads only */
 sqlite3 *dbhandler_db = NULL;
 sqlite3_stmt *dbhandler_stmts[DBHANDLER_STMT_NUM_STMTS];
 
+static const char *_dbhandler_sql[DBHANDLER_STMT_NUM_STMTS] = {
+    "insert into cidata (number, name, timestamp, msn, msn_alias, service, fix) values (?,?,?,?,?,?,?);",
+    "select number, name from cicaller where number=? and clientid=?;",
+    /* the name a user gave the caller replaces the stored one */
+    "select d.number,coalesce(c.name,d.name),d.timestamp,d.msn,d.msn_alias,d.service,d.fix,d.id from cidata d"
+        " left join cicaller c on c.clientid=? and c.number=d.number order by d.timestamp desc limit ?,?;",
+    "select count from cicounts where kind='all' and key='';",
+    /* the timestamp index also orders by rowid, so this seeks instead of skipping rows */
+    "select d.number,coalesce(c.name,d.name),d.timestamp,d.msn,d.msn_alias,d.service,d.fix,d.id from cidata d"
+        " left join cicaller c on c.clientid=? and c.number=d.number"
+        " where (d.timestamp, d.id) < (?, ?) order by d.timestamp desc, d.id desc limit ?;",
+    "select key, count from cicounts where kind=? and count > 0 order by key;"
+};
+
+static CIDbWriter _dbhandler_writer;
+
+static gchar *_dbhandler_path = NULL;
+static GSList *_dbhandler_readers = NULL;
+static GMutex _dbhandler_readers_lock;
+static void _dbhandler_reader_free(gpointer data);
+static GPrivate _dbhandler_reader_key = G_PRIVATE_INIT(_dbhandler_reader_free);
+
+/* calls in the database, so that clients asking for it do not cost a query */
+static guint64 _dbhandler_num_calls = 0;
+static GMutex _dbhandler_counts_lock;
+
+static gulong _dbhandler_bulk_rows = 0;
+static GSList *_dbhandler_bulk_indexes = NULL;   /* sql to recreate the indexes dropped for a bulk load */
+
 gulong parse_datetime(gchar *date, gchar *time);
 gboolean is_valid_number(gchar *string);
+static gint _dbhandler_get_caller(CIDbReader *reader, gint user, gchar *number, gchar *name);
+static gpointer _dbhandler_writer_proc(gpointer data);
+
+static
+gint _dbhandler_prepare(sqlite3 *db, sqlite3_stmt **stmts)
+{
+    int i;
+
+    for (i = 0; i < DBHANDLER_STMT_NUM_STMTS; ++i) {
+        if (sqlite3_prepare_v2(db, _dbhandler_sql[i], -1, &stmts[i], NULL) != SQLITE_OK) {
+            log_log("dbhandler: could not prepare statement %d: %s\n", i, sqlite3_errmsg(db));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static
+void _dbhandler_finalize(sqlite3_stmt **stmts)
+{
+    int i;
+
+    for (i = 0; i < DBHANDLER_STMT_NUM_STMTS; ++i) {
+        if (stmts[i] != NULL) {
+            sqlite3_finalize(stmts[i]);
+            stmts[i] = NULL;
+        }
+    }
+}
+
+static
+int _dbhandler_migration_progress(void *data)
+{
+    CIDbMigrationProgress *progress = (CIDbMigrationProgress*)data;
+    gint64 now = g_get_monotonic_time();
+
+    if (now >= progress->report_at) {
+        log_log("dbhandler: migration %d (%s) running for %d s\n", progress->migration->version,
+                progress->migration->description, (gint)((now - progress->start) / G_TIME_SPAN_SECOND));
+        progress->report_at = now + DBHANDLER_PROGRESS_INTERVAL;
+    }
+    return 0;
+}
+
+static
+gint _dbhandler_get_user_version(void)
+{
+    sqlite3_stmt *stmt;
+    gint version = -1;
+
+    if (sqlite3_prepare_v2(dbhandler_db, "pragma user_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/* Bring the schema to the latest version, each step in its own transaction. */
+static
+gint _dbhandler_migrate(void)
+{
+    const gint count = G_N_ELEMENTS(_dbhandler_migrations);
+    CIDbMigrationProgress progress;
+    gchar *sql;
+    gint version, i, rc = 0;
+
+    if ((version = _dbhandler_get_user_version()) < 0) {
+        log_log("dbhandler: could not read schema version: %s\n", sqlite3_errmsg(dbhandler_db));
+        return 1;
+    }
+    if (version > _dbhandler_migrations[count - 1].version) {
+        log_log("dbhandler: schema version %d is newer than this program knows (%d)\n",
+                version, _dbhandler_migrations[count - 1].version);
+        return 0;
+    }
+
+    sqlite3_progress_handler(dbhandler_db, DBHANDLER_PROGRESS_OPS, _dbhandler_migration_progress, &progress);
+    for (i = 0; i < count && rc == 0; ++i) {
+        if (_dbhandler_migrations[i].version <= version)
+            continue;
+
+        log_log("dbhandler: migrating schema to version %d (%s)\n", _dbhandler_migrations[i].version,
+                _dbhandler_migrations[i].description);
+        progress.migration = &_dbhandler_migrations[i];
+        progress.start = g_get_monotonic_time();
+        progress.report_at = progress.start + DBHANDLER_PROGRESS_INTERVAL;
+
+        sql = sqlite3_mprintf("begin transaction; %s pragma user_version=%d; commit transaction;",
+                _dbhandler_migrations[i].sql, _dbhandler_migrations[i].version);
+        if (sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+            log_log("dbhandler: migration %d failed: %s\n", _dbhandler_migrations[i].version,
+                    sqlite3_errmsg(dbhandler_db));
+            sqlite3_exec(dbhandler_db, "rollback transaction;", NULL, NULL, NULL);
+            rc = 1;
+        }
+        else {
+            log_log("dbhandler: migration %d done in %.1f s\n", _dbhandler_migrations[i].version,
+                    (gdouble)(g_get_monotonic_time() - progress.start) / G_TIME_SPAN_SECOND);
+        }
+        sqlite3_free(sql);
+    }
+    sqlite3_progress_handler(dbhandler_db, 0, NULL, NULL);
+
+    return rc;
+}
+
+static
+gint _dbhandler_check_indexes(void)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(_dbhandler_cidata_indexes); ++i) {
+        if (sqlite3_exec(dbhandler_db, _dbhandler_cidata_indexes[i], NULL, NULL, NULL) != SQLITE_OK) {
+            log_log("dbhandler: could not create index: %s\n", sqlite3_errmsg(dbhandler_db));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Take the number of calls from the counts table. */
+static
+void _dbhandler_load_num_calls(void)
+{
+    sqlite3_stmt *stmt = dbhandler_stmts[DBHANDLER_STMT_GET_NUM_CALLS];
+    guint64 count = 0;
+
+    if (stmt == NULL)
+        return;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        count = (guint64)sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+
+    g_mutex_lock(&_dbhandler_counts_lock);
+    _dbhandler_num_calls = count;
+    g_mutex_unlock(&_dbhandler_counts_lock);
+}
 
 gint dbhandler_init(gchar *db)
 {
     int rc;
-    char *sql;
 
     log_log("dbhandler_init: open\n");
     rc = sqlite3_open(db, &dbhandler_db);
-    if (rc != 0) 
+    if (rc != 0)
         goto out;
+    sqlite3_busy_timeout(dbhandler_db, DBHANDLER_BUSY_TIMEOUT);
 
-    sql = "create table if not exists cidata(id integer primary key, number varchar(31),\
-           name varchar(255), timestamp integer, msn varchar(15), msn_alias varchar(20),\
-           service varchar(20), fix varchar(20))";
-    log_log("dbhandler_init: init cidata\n");
-    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK)
-        goto out;
+    /* readers work on a snapshot and never wait for the writer */
+    if (sqlite3_exec(dbhandler_db, "pragma journal_mode=WAL;", NULL, NULL, NULL) != SQLITE_OK)
+        log_log("dbhandler_init: could not switch to WAL: %s\n", sqlite3_errmsg(dbhandler_db));
 
-    sql = "create table if not exists cicaller(clientid integer, number varchar(31), name varchar(255))";
-    log_log("dbhandler_init: init cicaller\n");
-    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK)
+    if (_dbhandler_migrate() != 0 || _dbhandler_check_indexes() != 0)
         goto out;
 
-#define PREPARE_STMT(stmt, id) do {\
-    sql = (stmt);\
-    rc = sqlite3_prepare_v2(dbhandler_db, sql, strlen(sql), &dbhandler_stmts[(id)], NULL);\
-    log_log("dbhandler_init: init %s\n", #id);\
-    if (rc != SQLITE_OK)\
-        goto out;\
-} while (0)
+    if (_dbhandler_prepare(dbhandler_db, dbhandler_stmts) != 0)
+        goto out;
+    _dbhandler_load_num_calls();
 
-    PREPARE_STMT("insert into cidata (number, name, timestamp, msn, msn_alias, service, fix) values (?,?,?,?,?,?,?);",
-            DBHANDLER_STMT_INSERT_CALL);
-    PREPARE_STMT("select number, name from cicaller where number=? and clientid=?;",
-            DBHANDLER_STMT_GET_CALLER);
-    PREPARE_STMT("select number,name,timestamp,msn,msn_alias,service,fix,id from cidata order by timestamp desc limit ?,?;",
-            DBHANDLER_STMT_GET_CALLS);
-    PREPARE_STMT("select count(*) from cidata;",
-            DBHANDLER_STMT_GET_NUM_CALLS);
+    _dbhandler_path = g_strdup(db);
 
-#undef PREPARE_STMT
+    g_mutex_init(&_dbhandler_writer.lock);
+    g_cond_init(&_dbhandler_writer.wakeup);
+    g_cond_init(&_dbhandler_writer.committed);
+    _dbhandler_writer.queue = g_queue_new();
+    _dbhandler_writer.stop = FALSE;
+    _dbhandler_writer.thread = g_thread_new("DbWriter", _dbhandler_writer_proc, NULL);
 
     log_log("dbhandler: initialized\n");
     return 0;
@@ -78,130 +335,514 @@ out:
     return 1;
 }
 
+static
+void _dbhandler_reader_close(CIDbReader *reader)
+{
+    _dbhandler_finalize(reader->stmts);
+    if (reader->db) {
+        sqlite3_close(reader->db);
+        reader->db = NULL;
+    }
+}
+
+/* Runs when the thread of the reader exits. */
+static
+void _dbhandler_reader_free(gpointer data)
+{
+    CIDbReader *reader = (CIDbReader*)data;
+
+    g_mutex_lock(&_dbhandler_readers_lock);
+    _dbhandler_readers = g_slist_remove(_dbhandler_readers, reader);
+    g_mutex_unlock(&_dbhandler_readers_lock);
+    _dbhandler_reader_close(reader);
+    g_free(reader);
+}
+
+/* The read connection of the calling thread, opened on first use. */
+static
+CIDbReader *_dbhandler_reader(void)
+{
+    CIDbReader *reader = (CIDbReader*)g_private_get(&_dbhandler_reader_key);
+
+    if (reader == NULL) {
+        reader = g_malloc0(sizeof(CIDbReader));
+        g_private_set(&_dbhandler_reader_key, reader);
+    }
+    if (reader->db != NULL)
+        return reader;
+    if (_dbhandler_path == NULL)
+        return NULL;
+
+    if (sqlite3_open_v2(_dbhandler_path, &reader->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+            _dbhandler_prepare(reader->db, reader->stmts) != 0) {
+        log_log("dbhandler: could not open read connection: %s\n",
+                reader->db ? sqlite3_errmsg(reader->db) : "out of memory");
+        _dbhandler_reader_close(reader);
+        return NULL;
+    }
+    sqlite3_busy_timeout(reader->db, DBHANDLER_BUSY_TIMEOUT);
+
+    g_mutex_lock(&_dbhandler_readers_lock);
+    if (g_slist_find(_dbhandler_readers, reader) == NULL)
+        _dbhandler_readers = g_slist_prepend(_dbhandler_readers, reader);
+    g_mutex_unlock(&_dbhandler_readers_lock);
+    return reader;
+}
+
+/* Pending writes are committed first. No reads may be running. */
 void dbhandler_cleanup(void)
 {
-    int i;
-    for (i = 0; i < DBHANDLER_STMT_NUM_STMTS; ++i) {
-        if (dbhandler_stmts[i] != NULL) {
-            sqlite3_finalize(dbhandler_stmts[i]);
-            dbhandler_stmts[i] = NULL;
-        }
+    GSList *tmp;
+
+    if (_dbhandler_writer.thread) {
+        g_mutex_lock(&_dbhandler_writer.lock);
+        _dbhandler_writer.stop = TRUE;
+        g_cond_signal(&_dbhandler_writer.wakeup);
+        g_mutex_unlock(&_dbhandler_writer.lock);
+
+        g_thread_join(_dbhandler_writer.thread);
+        _dbhandler_writer.thread = NULL;
+        g_queue_free(_dbhandler_writer.queue);
+        _dbhandler_writer.queue = NULL;
+        g_cond_clear(&_dbhandler_writer.committed);
+        g_cond_clear(&_dbhandler_writer.wakeup);
+        g_mutex_clear(&_dbhandler_writer.lock);
     }
+
+    /* the readers stay with their threads, only the connections go */
+    g_mutex_lock(&_dbhandler_readers_lock);
+    for (tmp = _dbhandler_readers; tmp != NULL; tmp = g_slist_next(tmp))
+        _dbhandler_reader_close((CIDbReader*)tmp->data);
+    g_slist_free(_dbhandler_readers);
+    _dbhandler_readers = NULL;
+    g_mutex_unlock(&_dbhandler_readers_lock);
+    g_free(_dbhandler_path);
+    _dbhandler_path = NULL;
+
+    _dbhandler_finalize(dbhandler_stmts);
     if (dbhandler_db) {
         sqlite3_close(dbhandler_db);
         dbhandler_db = NULL;
     }
 }
 
-gint dbhandler_add_data(CIDataSet *data)
+static
+gint _dbhandler_insert_call(CIDataSet *data)
 {
-    if (data == NULL)
-        return 1;
-
+    sqlite3_stmt *stmt = dbhandler_stmts[DBHANDLER_STMT_INSERT_CALL];
     int rc;
 
+    if (stmt == NULL)
+        return 1;
+
 #define BIND_TEXT(pos, field) do {\
-    rc = sqlite3_bind_text(dbhandler_stmts[DBHANDLER_STMT_INSERT_CALL], (pos),\
-            (field), strlen((field)), SQLITE_TRANSIENT);\
+    rc = sqlite3_bind_text(stmt, (pos), (field), strlen((field)), SQLITE_TRANSIENT);\
     if (rc != SQLITE_OK)\
-        return 1;\
+        goto out;\
     } while (0)
 
     BIND_TEXT(1, data->cidsNumberComplete);
     BIND_TEXT(2, data->cidsName);
-    rc = sqlite3_bind_int(dbhandler_stmts[DBHANDLER_STMT_INSERT_CALL], 3,
-            parse_datetime(data->cidsDate, data->cidsTime));
+    rc = sqlite3_bind_int(stmt, 3, parse_datetime(data->cidsDate, data->cidsTime));
     if (rc != SQLITE_OK)
-        return 1;
+        goto out;
     BIND_TEXT(4, data->cidsMSN);
     BIND_TEXT(5, data->cidsAlias);
     BIND_TEXT(6, data->cidsService);
     BIND_TEXT(7, data->cidsFix);
 #undef BIND_TEXT
 
-    rc = sqlite3_step(dbhandler_stmts[DBHANDLER_STMT_INSERT_CALL]);
+    rc = sqlite3_step(stmt);
     if (rc != SQLITE_OK && rc != SQLITE_DONE) {
         log_log("dbhandler: insertcall failed (step: %d)\n", rc);
-        return 1;
+        goto out;
     }
 
-    sqlite3_reset(dbhandler_stmts[DBHANDLER_STMT_INSERT_CALL]);
+    sqlite3_reset(stmt);
     return 0;
+
+out:
+    sqlite3_reset(stmt);
+    return 1;
 }
 
-gulong dbhandler_get_num_calls(void)
+static
+gint _dbhandler_add_caller(gint user, gchar *number, gchar *name)
 {
+    gchar *sql;
     int rc;
-    rc = sqlite3_step(dbhandler_stmts[DBHANDLER_STMT_GET_NUM_CALLS]);
-    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
-        log_log("dbhandler_get_num_calls: rc = %d\n", rc);
-        sqlite3_reset(dbhandler_stmts[DBHANDLER_STMT_GET_NUM_CALLS]);
+
+    sql = sqlite3_mprintf("update cicaller set name=%Q where clientid=%d and number=%Q", name, user, number);
+    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+
+    if (rc != SQLITE_OK)
+        return 1;
+    if (sqlite3_changes(dbhandler_db) > 0)
         return 0;
+
+    sql = sqlite3_mprintf("insert into cicaller (clientid,number,name) values (%d,%Q,%Q)", user, number, name);
+    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+
+    return (rc == SQLITE_OK && sqlite3_changes(dbhandler_db) > 0) ? 0 : 1;
+}
+
+static
+gint _dbhandler_remove_caller(gint user, gchar *number, gchar *name)
+{
+    gchar *sql;
+    int rc;
+
+    sql = sqlite3_mprintf("delete from cicaller where clientid=%d and number=%Q and name=%Q", user, number, name);
+    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+
+    return rc != SQLITE_OK;
+}
+
+static
+gint _dbhandler_apply_write(CIDbWrite *req)
+{
+    guint i;
+
+    switch (req->type) {
+        case DbWriteCalls:
+            for (i = 0; i < req->count; ++i) {
+                if (_dbhandler_insert_call(&req->data[i]) != 0)
+                    return 1;
+            }
+            return 0;
+        case DbWriteAddCaller:
+            return _dbhandler_add_caller(req->user, req->number, req->name);
+        case DbWriteRemoveCaller:
+            return _dbhandler_remove_caller(req->user, req->number, req->name);
+    }
+    return 1;
+}
+
+/* One transaction for the whole batch. Every write gets a savepoint, so a
+ * failing one is undone alone; if the commit fails, all of them fail. */
+static
+void _dbhandler_commit_batch(GQueue *batch)
+{
+    CIDbWrite *req;
+    GList *tmp;
+    gboolean ok;
+    guint64 inserted = 0;
+
+    ok = sqlite3_exec(dbhandler_db, "begin transaction;", NULL, NULL, NULL) == SQLITE_OK;
+    if (!ok)
+        log_log("dbhandler: could not begin transaction: %s\n", sqlite3_errmsg(dbhandler_db));
+
+    for (tmp = batch->head; tmp != NULL; tmp = g_list_next(tmp)) {
+        req = (CIDbWrite*)tmp->data;
+        if (!ok) {
+            req->rc = 1;
+            continue;
+        }
+        sqlite3_exec(dbhandler_db, "savepoint dbwrite;", NULL, NULL, NULL);
+        if ((req->rc = _dbhandler_apply_write(req)) != 0)
+            sqlite3_exec(dbhandler_db, "rollback to dbwrite;", NULL, NULL, NULL);
+        else if (req->type == DbWriteCalls)
+            inserted += req->count;
+        sqlite3_exec(dbhandler_db, "release dbwrite;", NULL, NULL, NULL);
+    }
+
+    if (ok && sqlite3_exec(dbhandler_db, "commit transaction;", NULL, NULL, NULL) != SQLITE_OK) {
+        log_log("dbhandler: could not commit transaction: %s\n", sqlite3_errmsg(dbhandler_db));
+        sqlite3_exec(dbhandler_db, "rollback transaction;", NULL, NULL, NULL);
+        for (tmp = batch->head; tmp != NULL; tmp = g_list_next(tmp))
+            ((CIDbWrite*)tmp->data)->rc = 1;
+        return;
+    }
+
+    if (inserted) {
+        g_mutex_lock(&_dbhandler_counts_lock);
+        _dbhandler_num_calls += inserted;
+        g_mutex_unlock(&_dbhandler_counts_lock);
+    }
+}
+
+static
+gpointer _dbhandler_writer_proc(gpointer data)
+{
+    GQueue *batch;
+    GList *tmp;
+
+    g_mutex_lock(&_dbhandler_writer.lock);
+    while (!_dbhandler_writer.stop || !g_queue_is_empty(_dbhandler_writer.queue)) {
+        if (g_queue_is_empty(_dbhandler_writer.queue)) {
+            g_cond_wait(&_dbhandler_writer.wakeup, &_dbhandler_writer.lock);
+            continue;
+        }
+        if (!_dbhandler_writer.stop && g_get_monotonic_time() < _dbhandler_writer.commit_at) {
+            g_cond_wait_until(&_dbhandler_writer.wakeup, &_dbhandler_writer.lock, _dbhandler_writer.commit_at);
+            continue;
+        }
+
+        /* take the queue so callers can go on queueing while we write */
+        batch = _dbhandler_writer.queue;
+        _dbhandler_writer.queue = g_queue_new();
+        g_mutex_unlock(&_dbhandler_writer.lock);
+
+        _dbhandler_commit_batch(batch);
+
+        g_mutex_lock(&_dbhandler_writer.lock);
+        for (tmp = batch->head; tmp != NULL; tmp = g_list_next(tmp))
+            ((CIDbWrite*)tmp->data)->done = TRUE;
+        g_queue_free(batch);
+        g_cond_broadcast(&_dbhandler_writer.committed);
+    }
+    g_mutex_unlock(&_dbhandler_writer.lock);
+
+    return NULL;
+}
+
+/* Queue the write for the next transaction and wait until it is committed. */
+static
+gint _dbhandler_write(CIDbWrite *req)
+{
+    if (_dbhandler_writer.thread == NULL)
+        return 1;
+
+    req->rc = 1;
+    req->done = FALSE;
+
+    g_mutex_lock(&_dbhandler_writer.lock);
+    if (_dbhandler_writer.stop) {
+        g_mutex_unlock(&_dbhandler_writer.lock);
+        return 1;
+    }
+    if (g_queue_is_empty(_dbhandler_writer.queue)) {
+        _dbhandler_writer.commit_at = g_get_monotonic_time() + DBHANDLER_COMMIT_INTERVAL;
+        g_cond_signal(&_dbhandler_writer.wakeup);
+    }
+    g_queue_push_tail(_dbhandler_writer.queue, req);
+    while (!req->done)
+        g_cond_wait(&_dbhandler_writer.committed, &_dbhandler_writer.lock);
+    g_mutex_unlock(&_dbhandler_writer.lock);
+
+    return req->rc;
+}
+
+gint dbhandler_add_data(CIDataSet *data)
+{
+    return dbhandler_add_data_batch(data, 1);
+}
+
+/* Insert all sets in one transaction. Either all or none of them are stored. */
+gint dbhandler_add_data_batch(CIDataSet *data, guint count)
+{
+    CIDbWrite req;
+
+    if (data == NULL)
+        return 1;
+
+    memset(&req, 0, sizeof(CIDbWrite));
+    req.type = DbWriteCalls;
+    req.data = data;
+    req.count = count;
+    return _dbhandler_write(&req);
+}
+
+/* Bulk loading: secondary indexes on cidata are dropped and rebuilt once at the
+ * end, rows are committed in large transactions and without syncing. Nothing
+ * else may use the database meanwhile. */
+gint dbhandler_bulk_begin(void)
+{
+    sqlite3_stmt *stmt;
+    const char *sql;
+    gchar *drop;
+    GSList *names = NULL, *tmp;
+
+    if (dbhandler_db == NULL)
+        return 1;
+
+    sql = "select name, sql from sqlite_master where type='index' and tbl_name='cidata' and sql is not null;";
+    if (sqlite3_prepare_v2(dbhandler_db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return 1;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        names = g_slist_prepend(names, g_strdup((const gchar *)sqlite3_column_text(stmt, 0)));
+        _dbhandler_bulk_indexes = g_slist_prepend(_dbhandler_bulk_indexes,
+                g_strdup((const gchar *)sqlite3_column_text(stmt, 1)));
     }
+    sqlite3_finalize(stmt);
 
-    gulong count = (gulong)sqlite3_column_int(dbhandler_stmts[DBHANDLER_STMT_GET_NUM_CALLS], 0);
-    sqlite3_reset(dbhandler_stmts[DBHANDLER_STMT_GET_NUM_CALLS]);
+    sqlite3_exec(dbhandler_db, "pragma synchronous=OFF;", NULL, NULL, NULL);
+    _dbhandler_bulk_rows = 0;
+    if (sqlite3_exec(dbhandler_db, "begin transaction;", NULL, NULL, NULL) != SQLITE_OK) {
+        g_slist_free_full(names, g_free);
+        return 1;
+    }
+
+    /* in the first transaction of the load; if it is interrupted later,
+     * dbhandler_init creates them again */
+    for (tmp = names; tmp != NULL; tmp = g_slist_next(tmp)) {
+        log_log("dbhandler: dropping index %s for bulk load\n", (gchar *)tmp->data);
+        drop = sqlite3_mprintf("drop index %Q;", (gchar *)tmp->data);
+        sqlite3_exec(dbhandler_db, drop, NULL, NULL, NULL);
+        sqlite3_free(drop);
+    }
+    g_slist_free_full(names, g_free);
+
+    return 0;
+}
+
+gint dbhandler_bulk_add(CIDataSet *data)
+{
+    if (data == NULL || _dbhandler_insert_call(data) != 0)
+        return 1;
+
+    if (++_dbhandler_bulk_rows % DBHANDLER_BULK_TRANSACTION_ROWS == 0) {
+        if (sqlite3_exec(dbhandler_db, "commit transaction; begin transaction;", NULL, NULL, NULL) != SQLITE_OK) {
+            log_log("dbhandler: bulk commit failed: %s\n", sqlite3_errmsg(dbhandler_db));
+            return 2;
+        }
+    }
+    return 0;
+}
+
+gint dbhandler_bulk_end(void)
+{
+    gint ret = 0;
+    GSList *tmp;
+
+    if (dbhandler_db == NULL)
+        return 1;
+
+    if (sqlite3_exec(dbhandler_db, "commit transaction;", NULL, NULL, NULL) != SQLITE_OK) {
+        log_log("dbhandler: bulk commit failed: %s\n", sqlite3_errmsg(dbhandler_db));
+        ret = 1;
+    }
+
+    for (tmp = _dbhandler_bulk_indexes; tmp != NULL; tmp = g_slist_next(tmp)) {
+        log_log("dbhandler: rebuilding %s\n", (gchar *)tmp->data);
+        if (sqlite3_exec(dbhandler_db, (gchar *)tmp->data, NULL, NULL, NULL) != SQLITE_OK) {
+            log_log("dbhandler: index rebuild failed: %s\n", sqlite3_errmsg(dbhandler_db));
+            ret = 1;
+        }
+    }
+    g_slist_free_full(_dbhandler_bulk_indexes, g_free);
+    _dbhandler_bulk_indexes = NULL;
+
+    sqlite3_exec(dbhandler_db, "pragma synchronous=FULL;", NULL, NULL, NULL);
+    _dbhandler_load_num_calls();
+    return ret;
+}
+
+
+gulong dbhandler_get_num_calls(void)
+{
+    gulong count;
+
+    g_mutex_lock(&_dbhandler_counts_lock);
+    count = (gulong)_dbhandler_num_calls;
+    g_mutex_unlock(&_dbhandler_counts_lock);
 
-    log_log("dbhandler_get_num_calls: count: %lu\n", count);
     return count;
 }
 
-/* return list of CIDbCall */
-GList *dbhandler_get_calls(gint user, gint offset, gint count)
+/* Number of calls per msn or per day (YYYY-MM-DD, local time), as list of
+ * CIDbCount. kind is "msn" or "day". */
+GList *dbhandler_get_call_counts(const gchar *kind)
 {
-    GList *list = NULL, *tmp;
-    CIDbCall *call;
+    CIDbReader *reader = _dbhandler_reader();
+    sqlite3_stmt *stmt;
+    GList *list = NULL;
+    CIDbCount *count;
+    char *buf;
     int rc;
+
+    if (reader == NULL || kind == NULL ||
+            (strcmp(kind, DBHANDLER_COUNT_MSN) != 0 && strcmp(kind, DBHANDLER_COUNT_DAY) != 0))
+        return NULL;
+    stmt = reader->stmts[DBHANDLER_STMT_GET_CALL_COUNTS];
+
+    sqlite3_bind_text(stmt, 1, kind, -1, SQLITE_TRANSIENT);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        count = g_malloc0(sizeof(CIDbCount));
+        buf = (char*)sqlite3_column_text(stmt, 0);
+        if (buf)
+            g_strlcpy(count->key, buf, sizeof(count->key));
+        count->count = (gulong)sqlite3_column_int64(stmt, 1);
+        list = g_list_prepend(list, (gpointer)count);
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        g_list_free_full(list, g_free);
+        return NULL;
+    }
+    return g_list_reverse(list);
+}
+
+static
+CIDbCall *_dbhandler_read_call(sqlite3_stmt *stmt, gulong *timestamp)
+{
+    CIDbCall *call = g_malloc0(sizeof(CIDbCall));
     char *buf;
-    gulong timestamp;
+    time_t t;
+    struct tm tm;
 
-    sqlite3_bind_int(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 1, offset);
-    sqlite3_bind_int(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 2, count);
+    buf = (char*)sqlite3_column_text(stmt, 0);
+    if (buf)
+        g_strlcpy(call->data.cidsNumberComplete, buf, 32);
 
-    while ((rc = sqlite3_step(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS])) == SQLITE_ROW) {
-        call = g_malloc0(sizeof(CIDbCall));
+    buf = (char*)sqlite3_column_text(stmt, 1);
+    if (buf)
+        g_strlcpy(call->data.cidsName, buf, 256);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 0);
-        if (buf)
-            g_strlcpy(call->data.cidsNumberComplete, buf, 32);
+    *timestamp = sqlite3_column_int(stmt, 2);
+    /* called by several database workers at once */
+    t = (time_t)*timestamp;
+    localtime_r(&t, &tm);
+    strftime(call->data.cidsDate, 16, "%Y-%m-%d", &tm);
+    strftime(call->data.cidsTime, 16, "%H:%M:%S", &tm);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 1);
-        if (buf)
-            g_strlcpy(call->data.cidsName, buf, 256);
+    buf = (char*)sqlite3_column_text(stmt, 3);
+    if (buf)
+        g_strlcpy(call->data.cidsMSN, buf, 16);
 
-        timestamp = sqlite3_column_int(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 2);
-        strftime(call->data.cidsDate, 16, "%Y-%m-%d", localtime((time_t*)&timestamp));
-        strftime(call->data.cidsTime, 16, "%H:%M:%S", localtime((time_t*)&timestamp));
+    buf = (char*)sqlite3_column_text(stmt, 4);
+    if (buf)
+        g_strlcpy(call->data.cidsAlias, buf, 256);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 3);
-        if (buf)
-            g_strlcpy(call->data.cidsMSN, buf, 16);
+    buf = (char*)sqlite3_column_text(stmt, 5);
+    if (buf)
+        g_strlcpy(call->data.cidsService, buf, 256);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 4);
-        if (buf)
-            g_strlcpy(call->data.cidsAlias, buf, 256);
+    buf = (char*)sqlite3_column_text(stmt, 6);
+    if (buf)
+        g_strlcpy(call->data.cidsFix, buf, 256);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 5);
-        if (buf)
-            g_strlcpy(call->data.cidsService, buf, 256);
+    call->id = sqlite3_column_int(stmt, 7);
 
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 6);
-        if (buf)
-            g_strlcpy(call->data.cidsFix, buf, 256);
+    return call;
+}
 
-        call->id = sqlite3_column_int(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS], 7);
+/* Step through the bound statement and fill in the areas. The key of the
+ * last row goes to timestamp and id. */
+static
+GList *_dbhandler_read_calls(sqlite3_stmt *stmt, gulong *timestamp, gint *id)
+{
+    GList *list = NULL, *tmp;
+    CIDbCall *call;
+    int rc;
 
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        call = _dbhandler_read_call(stmt, timestamp);
+        *id = call->id;
         list = g_list_prepend(list, (gpointer)call);
     }
 
-    sqlite3_reset(dbhandler_stmts[DBHANDLER_STMT_GET_CALLS]);
+    sqlite3_reset(stmt);
 
     if (rc != SQLITE_DONE) {
         g_list_free_full(list, g_free);
         return NULL;
     }
 
-    /* get callers */
     for (tmp = list; tmp != NULL; tmp = g_list_next(tmp)) {
         call = (CIDbCall*)tmp->data;
         if (is_valid_number(call->data.cidsNumberComplete)) {
@@ -209,42 +850,102 @@ GList *dbhandler_get_calls(gint user, gint offset, gint count)
                     call->data.cidsAreaCode,
                     call->data.cidsNumber,
                     call->data.cidsArea);
-            dbhandler_get_caller(user, call->data.cidsNumberComplete,
-                    call->data.cidsName);
         }
     }
 
     return list;
 }
 
-gint dbhandler_get_caller(gint user, gchar *number, gchar *name)
+/* return list of CIDbCall */
+GList *dbhandler_get_calls(gint user, gint offset, gint count)
 {
+    CIDbReader *reader = _dbhandler_reader();
+    sqlite3_stmt *stmt;
+    gulong timestamp;
+    gint id;
+
+    if (reader == NULL)
+        return NULL;
+    stmt = reader->stmts[DBHANDLER_STMT_GET_CALLS];
+
+    sqlite3_bind_int(stmt, 1, user);
+    sqlite3_bind_int(stmt, 2, offset);
+    sqlite3_bind_int(stmt, 3, count);
+
+    return _dbhandler_read_calls(stmt, &timestamp, &id);
+}
+
+/* Like dbhandler_get_calls, but continues after the call the cursor points
+ * to instead of skipping offset rows. The cursor is one returned in next, or
+ * NULL for the newest calls; next is NULL after the last page. */
+GList *dbhandler_get_calls_after(gint user, const gchar *cursor, gint count, gchar **next)
+{
+    CIDbReader *reader = _dbhandler_reader();
+    sqlite3_stmt *stmt;
+    GList *list;
+    sqlite3_int64 after = G_MAXINT64;
+    gulong timestamp;
+    gint id = G_MAXINT;
+
+    if (next)
+        *next = NULL;
+    if (reader == NULL || count <= 0)
+        return NULL;
+    if (cursor != NULL && cursor[0] != '\0') {
+        if (sscanf(cursor, "%lu.%d", &timestamp, &id) != 2)
+            return NULL;
+        after = (sqlite3_int64)timestamp;
+    }
+    stmt = reader->stmts[DBHANDLER_STMT_GET_CALLS_AFTER];
+
+    sqlite3_bind_int(stmt, 1, user);
+    sqlite3_bind_int64(stmt, 2, after);
+    sqlite3_bind_int(stmt, 3, id);
+    sqlite3_bind_int(stmt, 4, count);
+
+    list = _dbhandler_read_calls(stmt, &timestamp, &id);
+    if (next && g_list_length(list) == (guint)count)
+        *next = g_strdup_printf("%lu.%d", timestamp, id);
+    return list;
+}
+
+static
+gint _dbhandler_get_caller(CIDbReader *reader, gint user, gchar *number, gchar *name)
+{
+    sqlite3_stmt *stmt = reader->stmts[DBHANDLER_STMT_GET_CALLER];
     char *buf;
     int rc;
 
     if (!is_valid_number(number))
         return 1;
 
-    sqlite3_bind_int(dbhandler_stmts[DBHANDLER_STMT_GET_CALLER], 2, user);
-    sqlite3_bind_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLER], 1, number,
-            strlen(number), SQLITE_TRANSIENT);
-    
-    rc = sqlite3_step(dbhandler_stmts[DBHANDLER_STMT_GET_CALLER]);
+    sqlite3_bind_int(stmt, 2, user);
+    sqlite3_bind_text(stmt, 1, number, strlen(number), SQLITE_TRANSIENT);
+
+    rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW) {
-        buf = (char*)sqlite3_column_text(dbhandler_stmts[DBHANDLER_STMT_GET_CALLER], 1);
+        buf = (char*)sqlite3_column_text(stmt, 1);
         if (buf && name)
             g_strlcpy(name, buf, 256);
     }
 
-    sqlite3_reset(dbhandler_stmts[DBHANDLER_STMT_GET_CALLER]);
+    sqlite3_reset(stmt);
 
     return (rc != SQLITE_ROW) ? 1 : 0;
 }
 
+gint dbhandler_get_caller(gint user, gchar *number, gchar *name)
+{
+    CIDbReader *reader = _dbhandler_reader();
+
+    if (reader == NULL)
+        return 1;
+    return _dbhandler_get_caller(reader, user, number, name);
+}
+
 gint dbhandler_add_caller(gint user, gchar *number, gchar *name)
 {
-    gchar *sql;
-    int rc;
+    CIDbWrite req;
 
     if (number == NULL || name == NULL)
         return 1;
@@ -252,60 +953,49 @@ gint dbhandler_add_caller(gint user, gchar *number, gchar *name)
     if (!is_valid_number(number))
         return 1;
 
-    sql = sqlite3_mprintf("update cicaller set name=%Q where clientid=%d and number=%Q", name, user, number);
-    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
-    sqlite3_free(sql);
-
-    if (rc != SQLITE_OK)
-        return 1;
-    
-    if (sqlite3_changes(dbhandler_db) == 0) {
-        sql = sqlite3_mprintf("insert into cicaller (clientid,number,name) values (%d,%Q,%Q)", user, number, name);
-        rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
-        sqlite3_free(sql);
-
-        if (rc == SQLITE_OK && sqlite3_changes(dbhandler_db) > 0)
-            return 0;
-    }
-    else
-        return 0;
-
-    return 1;
+    memset(&req, 0, sizeof(CIDbWrite));
+    req.type = DbWriteAddCaller;
+    req.user = user;
+    req.number = number;
+    req.name = name;
+    return _dbhandler_write(&req);
 }
 
 gint dbhandler_remove_caller(gint user, gchar *number, gchar *name)
 {
-    gchar *sql;
-    int rc;
-    if (!is_valid_number(number))
-        return 1;
-
-    sql = sqlite3_mprintf("delete from cicaller where clientid=%d and number=%Q and name=%Q", user, number, name);
-    rc = sqlite3_exec(dbhandler_db, sql, NULL, NULL, NULL);
-    sqlite3_free(sql);
+    CIDbWrite req;
 
-    if (rc != SQLITE_OK)
+    if (!is_valid_number(number))
         return 1;
 
-    return 0;
+    memset(&req, 0, sizeof(CIDbWrite));
+    req.type = DbWriteRemoveCaller;
+    req.user = user;
+    req.number = number;
+    req.name = name;
+    return _dbhandler_write(&req);
 }
 
 /* return list of CIDbCaller */
 GList *dbhandler_get_callers(gint user, gchar *filter)
 {
+    CIDbReader *reader = _dbhandler_reader();
     gchar *sql;
     GList *callers = NULL;
     sqlite3_stmt *stmt = NULL;
     CIDbCaller *caller = NULL;
     int rc;
 
+    if (reader == NULL)
+        return NULL;
+
     if (filter != NULL && filter[0] != 0)
         sql = sqlite3_mprintf("select number, name from cicaller where clientid=%d and (name like '%%%q%%' or number like '%%%q%%')",
                 user, filter, filter);
     else
         sql = sqlite3_mprintf("select number, name from cicaller where clientid=%d", user);
 
-    rc = sqlite3_prepare_v2(dbhandler_db, sql, strlen(sql), &stmt, NULL);
+    rc = sqlite3_prepare_v2(reader->db, sql, strlen(sql), &stmt, NULL);
     sqlite3_free(sql);
 
     if (rc != SQLITE_OK)
@@ -313,10 +1003,10 @@ GList *dbhandler_get_callers(gint user, gchar *filter)
 
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
         caller = g_malloc0(sizeof(CIDbCaller));
-        
+
         caller->number = g_strdup((char*)sqlite3_column_text(stmt, 0));
         caller->name   = g_strdup((char*)sqlite3_column_text(stmt, 1));
-        
+
         callers = g_list_prepend(callers, caller);
     }
 
@@ -14,11 +14,26 @@ typedef struct {
     gchar *name;
 } CIDbCaller;
 
+#define DBHANDLER_COUNT_MSN     "msn"
+#define DBHANDLER_COUNT_DAY     "day"
+
+typedef struct {
+    gchar key[32];          /* msn or date */
+    gulong count;
+} CIDbCount;
+
 gint dbhandler_init(gchar *db);
 
 gint dbhandler_add_data(CIDataSet *data);
+gint dbhandler_add_data_batch(CIDataSet *data, guint count);
+gint dbhandler_bulk_begin(void);
+gint dbhandler_bulk_add(CIDataSet *data);
+gint dbhandler_bulk_end(void);
 gulong dbhandler_get_num_calls(void);
+GList *dbhandler_get_call_counts(const gchar *kind);
 GList *dbhandler_get_calls(gint user, gint offset, gint count);
+/* keyset paging, next receives the cursor of the following page */
+GList *dbhandler_get_calls_after(gint user, const gchar *cursor, gint count, gchar **next);
 gint dbhandler_get_caller(gint user, gchar *number, gchar *name);
 gint dbhandler_add_caller(gint user, gchar *number, gchar *name);
 gint dbhandler_remove_caller(gint user, gchar *number, gchar *name);
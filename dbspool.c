@@ -0,0 +1,348 @@
+#include "dbspool.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dbhandler.h"
+#include "logging.h"
+
+#define DBSPOOL_MAGIC           "CISPOOL1"
+#define DBSPOOL_BATCH_SIZE      512
+#define DBSPOOL_RETRY_MIN       G_TIME_SPAN_SECOND
+#define DBSPOOL_RETRY_MAX       (60 * G_TIME_SPAN_SECOND)
+/* failed batches before the first record is tried alone */
+#define DBSPOOL_MAX_FAILURES    5
+
+/* The file starts with this header, followed by fixed size CIDataSet records.
+ * Records before the consumed offset have been inserted already. */
+typedef struct _CIDbSpoolHeader {
+    gchar magic[8];
+    guint32 recsize;
+    guint32 reserved;
+    guint64 consumed;
+} CIDbSpoolHeader;
+
+typedef struct _CIDbSpool {
+    int fd;
+    gchar *reject_path;     /* records the database does not take */
+    guint64 consumed;
+    guint64 end;
+    GMutex lock;
+    GCond cond;
+    GThread *thread;
+    gboolean stop;
+    CIDbSpoolStats stats;
+} CIDbSpool;
+
+static CIDbSpool _dbspool = { .fd = -1 };
+
+static
+gint _dbspool_write_header(void)
+{
+    CIDbSpoolHeader header;
+
+    memset(&header, 0, sizeof(CIDbSpoolHeader));
+    memcpy(header.magic, DBSPOOL_MAGIC, sizeof(header.magic));
+    header.recsize = sizeof(CIDataSet);
+    header.consumed = _dbspool.consumed;
+
+    if (pwrite(_dbspool.fd, &header, sizeof(CIDbSpoolHeader), 0) != sizeof(CIDbSpoolHeader) ||
+            fdatasync(_dbspool.fd) != 0) {
+        log_log("dbspool: could not write header: %d (%s)\n", errno, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+gint dbspool_init(const gchar *path)
+{
+    CIDbSpoolHeader header;
+    struct stat st;
+    guint64 end;
+
+    if (path == NULL || _dbspool.fd != -1)
+        return 1;
+
+    if ((_dbspool.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        log_log("dbspool: could not open %s: %d (%s)\n", path, errno, strerror(errno));
+        return 1;
+    }
+    if (fstat(_dbspool.fd, &st) != 0)
+        goto out;
+
+    if ((guint64)st.st_size < sizeof(CIDbSpoolHeader)) {
+        _dbspool.consumed = _dbspool.end = sizeof(CIDbSpoolHeader);
+        if (ftruncate(_dbspool.fd, 0) != 0 || _dbspool_write_header() != 0)
+            goto out;
+    }
+    else {
+        if (pread(_dbspool.fd, &header, sizeof(CIDbSpoolHeader), 0) != sizeof(CIDbSpoolHeader))
+            goto out;
+        if (memcmp(header.magic, DBSPOOL_MAGIC, sizeof(header.magic)) != 0 ||
+                header.recsize != sizeof(CIDataSet)) {
+            log_log("dbspool: %s is not a spool of this version, not touching it\n", path);
+            goto out;
+        }
+        /* drop a record torn by a crash while appending */
+        end = sizeof(CIDbSpoolHeader) +
+            ((guint64)st.st_size - sizeof(CIDbSpoolHeader)) / sizeof(CIDataSet) * sizeof(CIDataSet);
+        if (end != (guint64)st.st_size && ftruncate(_dbspool.fd, (off_t)end) != 0)
+            goto out;
+        _dbspool.end = end;
+        _dbspool.consumed = header.consumed;
+        if (_dbspool.consumed < sizeof(CIDbSpoolHeader) || _dbspool.consumed > end)
+            _dbspool.consumed = sizeof(CIDbSpoolHeader);
+    }
+
+    _dbspool.stats.pending = (guint)((_dbspool.end - _dbspool.consumed) / sizeof(CIDataSet));
+    if (_dbspool.stats.pending)
+        log_log("dbspool: %u calls waiting from last run\n", _dbspool.stats.pending);
+
+    _dbspool.reject_path = g_strdup_printf("%s.rejected", path);
+    g_mutex_init(&_dbspool.lock);
+    g_cond_init(&_dbspool.cond);
+    return 0;
+
+out:
+    close(_dbspool.fd);
+    _dbspool.fd = -1;
+    return 1;
+}
+
+static
+gint _dbspool_append(CIDataSet *set)
+{
+    if (pwrite(_dbspool.fd, set, sizeof(CIDataSet), (off_t)_dbspool.end) != sizeof(CIDataSet) ||
+            fdatasync(_dbspool.fd) != 0) {
+        log_log("dbspool: append failed: %d (%s)\n", errno, strerror(errno));
+        /* cut off whatever part of the record made it to the file */
+        if (ftruncate(_dbspool.fd, (off_t)_dbspool.end) != 0)
+            log_log("dbspool: could not truncate spool\n");
+        return 1;
+    }
+    _dbspool.end += sizeof(CIDataSet);
+    ++_dbspool.stats.pending;
+    ++_dbspool.stats.spooled;
+    return 0;
+}
+
+/* Write the set to the database, or to the spool if that fails or older sets are still waiting. */
+gint dbspool_store(CIDataSet *set)
+{
+    gint rc = 0;
+
+    if (set == NULL)
+        return 1;
+
+    if (_dbspool.fd == -1) {
+        if (dbhandler_add_data(set) != 0) {
+            log_log("dbspool: add data failed and no spool available, call is lost\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    g_mutex_lock(&_dbspool.lock);
+    if (_dbspool.stats.pending == 0 && dbhandler_add_data(set) == 0) {
+        g_mutex_unlock(&_dbspool.lock);
+        return 0;
+    }
+    if (_dbspool_append(set) == 0) {
+        g_cond_signal(&_dbspool.cond);
+    }
+    else {
+        log_log("dbspool: could not spool call, call is lost\n");
+        rc = 1;
+    }
+    g_mutex_unlock(&_dbspool.lock);
+
+    return rc;
+}
+
+static
+guint _dbspool_read_batch(CIDataSet *batch, guint max)
+{
+    guint count = MIN(max, _dbspool.stats.pending);
+    ssize_t bytes;
+
+    bytes = pread(_dbspool.fd, batch, count * sizeof(CIDataSet), (off_t)_dbspool.consumed);
+    if (bytes < 0) {
+        log_log("dbspool: read failed: %d (%s)\n", errno, strerror(errno));
+        return 0;
+    }
+    return (guint)(bytes / sizeof(CIDataSet));
+}
+
+/* The records are in the database now; a failure to record that only risks duplicates. */
+static
+void _dbspool_consume(guint count)
+{
+    _dbspool.consumed += (guint64)count * sizeof(CIDataSet);
+    _dbspool.stats.pending -= count;
+
+    if (_dbspool.stats.pending == 0) {
+        _dbspool.consumed = _dbspool.end = sizeof(CIDbSpoolHeader);
+        if (ftruncate(_dbspool.fd, (off_t)_dbspool.end) != 0)
+            log_log("dbspool: could not truncate spool\n");
+    }
+    _dbspool_write_header();
+}
+
+/* Move a record the database refuses out of the way. The file has the spool
+ * format, so it can take the place of the spool once the cause is fixed. */
+static
+void _dbspool_reject(CIDataSet *set)
+{
+    CIDbSpoolHeader header;
+    struct stat st;
+    int fd;
+
+    log_log("dbspool: database refuses call from %s at %s %s, moving it to %s\n",
+            set->cidsNumberComplete, set->cidsDate, set->cidsTime, _dbspool.reject_path);
+    if ((fd = open(_dbspool.reject_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        goto out;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        memset(&header, 0, sizeof(CIDbSpoolHeader));
+        memcpy(header.magic, DBSPOOL_MAGIC, sizeof(header.magic));
+        header.recsize = sizeof(CIDataSet);
+        header.consumed = sizeof(CIDbSpoolHeader);
+        if (write(fd, &header, sizeof(CIDbSpoolHeader)) != sizeof(CIDbSpoolHeader))
+            goto out;
+    }
+    if (write(fd, set, sizeof(CIDataSet)) != sizeof(CIDataSet) || fdatasync(fd) != 0)
+        goto out;
+    close(fd);
+    return;
+
+out:
+    log_log("dbspool: could not write %s: %d (%s), call is lost\n", _dbspool.reject_path, errno, strerror(errno));
+    if (fd != -1)
+        close(fd);
+}
+
+/* The database is written without the lock held, calls stored meanwhile
+ * go to the spool behind the batch. */
+static
+gpointer _dbspool_flusher_proc(gpointer data)
+{
+    CIDataSet *batch = g_malloc(sizeof(CIDataSet) * DBSPOOL_BATCH_SIZE);
+    gint64 delay = DBSPOOL_RETRY_MIN;
+    gint64 retry_at = 0;
+    guint count, done, failures = 0;
+    gboolean single, rejected;
+
+    g_mutex_lock(&_dbspool.lock);
+    while (!_dbspool.stop) {
+        if (_dbspool.stats.pending == 0) {
+            g_cond_wait(&_dbspool.cond, &_dbspool.lock);
+            continue;
+        }
+        if (retry_at != 0 && g_get_monotonic_time() < retry_at) {
+            g_cond_wait_until(&_dbspool.cond, &_dbspool.lock, retry_at);
+            continue;
+        }
+
+        /* after repeated failures, find out if the first record is the problem */
+        single = failures >= DBSPOOL_MAX_FAILURES;
+        count = _dbspool_read_batch(batch, single ? 2 : DBSPOOL_BATCH_SIZE);
+        g_mutex_unlock(&_dbspool.lock);
+
+        done = 0;
+        rejected = FALSE;
+        if (count > 0 && dbhandler_add_data_batch(batch, single ? 1 : count) == 0)
+            done = single ? 1 : count;
+        else if (single && count == 2 && dbhandler_add_data_batch(&batch[1], 1) == 0) {
+            /* the database works, it just does not take the first one */
+            _dbspool_reject(&batch[0]);
+            rejected = TRUE;
+            done = 2;
+        }
+
+        g_mutex_lock(&_dbspool.lock);
+        if (done > 0) {
+            _dbspool_consume(done);
+            _dbspool.stats.flushed += done - (rejected ? 1 : 0);
+            if (rejected)
+                ++_dbspool.stats.rejected;
+            ++_dbspool.stats.batches;
+            if (_dbspool.stats.pending == 0)
+                log_log("dbspool: spool flushed\n");
+            delay = DBSPOOL_RETRY_MIN;
+            retry_at = 0;
+            failures = 0;
+        }
+        else {
+            ++failures;
+            ++_dbspool.stats.retries;
+            retry_at = g_get_monotonic_time() + delay;
+            log_log("dbspool: flush of %u calls failed, retry in %d s\n",
+                    _dbspool.stats.pending, (gint)(delay / G_TIME_SPAN_SECOND));
+            delay = MIN(delay * 2, DBSPOOL_RETRY_MAX);
+        }
+    }
+    g_mutex_unlock(&_dbspool.lock);
+
+    g_free(batch);
+    return NULL;
+}
+
+gint dbspool_startup(void)
+{
+    if (_dbspool.fd == -1 || _dbspool.thread != NULL)
+        return 1;
+
+    _dbspool.stop = FALSE;
+    _dbspool.thread = g_thread_new("DbSpool", _dbspool_flusher_proc, NULL);
+    return 0;
+}
+
+void dbspool_get_stats(CIDbSpoolStats *stats)
+{
+    if (stats == NULL)
+        return;
+    if (_dbspool.fd == -1) {
+        memset(stats, 0, sizeof(CIDbSpoolStats));
+        return;
+    }
+
+    g_mutex_lock(&_dbspool.lock);
+    memcpy(stats, &_dbspool.stats, sizeof(CIDbSpoolStats));
+    g_mutex_unlock(&_dbspool.lock);
+}
+
+/* Whatever is still spooled stays on disk for the next start. */
+void dbspool_shutdown(void)
+{
+    if (_dbspool.thread == NULL)
+        return;
+
+    g_mutex_lock(&_dbspool.lock);
+    _dbspool.stop = TRUE;
+    g_cond_signal(&_dbspool.cond);
+    g_mutex_unlock(&_dbspool.lock);
+
+    g_thread_join(_dbspool.thread);
+    _dbspool.thread = NULL;
+}
+
+void dbspool_cleanup(void)
+{
+    dbspool_shutdown();
+
+    if (_dbspool.fd == -1)
+        return;
+
+    if (_dbspool.stats.pending)
+        log_log("dbspool: %u calls remain in the spool\n", _dbspool.stats.pending);
+
+    close(_dbspool.fd);
+    _dbspool.fd = -1;
+    g_free(_dbspool.reject_path);
+    _dbspool.reject_path = NULL;
+    g_cond_clear(&_dbspool.cond);
+    g_mutex_clear(&_dbspool.lock);
+}
@@ -0,0 +1,28 @@
+#ifndef __DBSPOOL_H__
+#define __DBSPOOL_H__
+
+#include <glib.h>
+#include "CIData.h"
+
+/* Calls that could not be written to the database are appended to an on-disk
+ * spool and inserted later by a background flusher. While the spool is not
+ * empty, new calls are spooled as well to keep them in order. A record the
+ * database keeps refusing while later ones go in is moved to <spool>.rejected. */
+
+typedef struct _CIDbSpoolStats {
+    guint pending;          /* records waiting in the spool */
+    guint64 spooled;        /* records ever appended */
+    guint64 flushed;        /* records inserted by the flusher */
+    guint64 batches;        /* successful flush transactions */
+    guint64 retries;        /* failed flush attempts */
+    guint64 rejected;       /* records the database refused, moved to <spool>.rejected */
+} CIDbSpoolStats;
+
+gint dbspool_init(const gchar *path);
+gint dbspool_startup(void);
+gint dbspool_store(CIDataSet *set);
+void dbspool_get_stats(CIDbSpoolStats *stats);
+void dbspool_shutdown(void);
+void dbspool_cleanup(void);
+
+#endif
@@ -8,118 +8,304 @@
 #include <unistd.h>
 #include "netutils.h"
 #include "fritz.h"
+#include "fritz_parser.h"
 #include "logging.h"
 #include <errno.h>
 #include <time.h>
+#include <sys/uio.h>
 
-#define FRITZ_BUFFER_SIZE      1024
+/* must be a power of two */
+#define FRITZ_LINEBUF_SIZE     4096
+#define FRITZ_LINEBUF_MASK     (FRITZ_LINEBUF_SIZE - 1)
 
 enum CIFritzServerState {
     CIFritzServerStateUninitialized = 0,
     CIFritzServerStateInitialized   = 1,
     CIFritzServerStateConnected     = 2,
-    CIFritzServerStateListening     = 4
+    CIFritzServerStateListening     = 4,
+    CIFritzServerStateConnecting    = 8
 };
 
-typedef struct _CIFritzServer {
-    void (*fritz_listen_cb)(CIFritzCallMsg *);
+#define FRITZ_RECONNECT_INTERVAL       10
+
+/* ring buffer reassembling the newline terminated records of the call monitor */
+typedef struct _CIFritzLineBuffer {
+    gchar data[FRITZ_LINEBUF_SIZE];
+    gsize head;
+    gsize fill;
+} CIFritzLineBuffer;
+
+/* one monitored box with its own connection */
+typedef struct _CIFritzBox {
+    gchar *name;
     gchar *host;
+    in_addr_t addr;             /* INADDR_NONE until the host is resolved */
     gushort port;
     gushort state;
     int sock;
-    int netlink;
     int assoc_ifindex;
-    int fdpipe[2];
+    NetutilReactorSource *source;
+    NetutilReactorSource *reconnect_timer;
+    gboolean reconnect_armed;
+    /* lookup of a host that did not resolve when the box was added */
+    GThread *resolver;
+    gint resolving;
+    in_addr_t resolved;
+    CIFritzLineBuffer linebuf;
+    CIFritzParseCache parse_cache;
+    CIFritzReaderStats stats;
+} CIFritzBox;
+
+typedef struct _CIFritzServer {
+    void (*fritz_listen_cb)(CIFritzCallMsg *);
+    gushort state;
+    int netlink;
+    NetutilReactor *reactor;
+    NetutilReactorSource *netlink_source;
     GThread *thread;
+    GList *boxes;
 } CIFritzServer;
 
-GMainContext *_main_context = NULL;
-
-static gint _fritz_parse_notification(const gchar *notify, CIFritzCallMsg *cmsg);
 static void *_fritz_listen_thread_proc(void *pdata);
 
+static gint _fritz_read_records(CIFritzBox *box);
+static void _fritz_dispatch_record(CIFritzBox *box, gchar *record, gsize len);
+static void _fritz_log_reader_stats(CIFritzBox *box);
+
 /* callbacks for netlink messages */
 static void _fritz_handle_net_up(int ifindex, char *ifname, CIFritzServer *srv);
 static void _fritz_handle_net_down(int ifindex, char *ifname, CIFritzServer *srv);
 
-static gint _fritz_connect(gboolean *connected);
-static void _fritz_try_connect(void);
-static gboolean _fritz_try_reconnect(CIFritzServer *srv);
+/* reactor callbacks */
+static void _fritz_handle_box_input(int fd, guint32 events, CIFritzBox *box);
+static void _fritz_handle_netlink_input(int fd, guint32 events, CIFritzServer *srv);
+
+static gint _fritz_connect(CIFritzBox *box, gboolean *connected);
+static void _fritz_finish_connect(CIFritzBox *box);
+static void _fritz_disconnect(CIFritzBox *box);
+static void _fritz_try_connect(CIFritzBox *box);
+static void _fritz_try_reconnect(CIFritzBox *box);
 
 CIFritzServer _cifritz_server;
 
-gint fritz_init(gchar *host, gushort port)
+static NetutilCallbacks _fritz_netlink_callbacks = {
+    .net_up   = (NetutilCallback)_fritz_handle_net_up,
+    .net_down = (NetutilCallback)_fritz_handle_net_down
+};
+
+gint fritz_init(void)
 {
     memset(&_cifritz_server, 0, sizeof(CIFritzServer));
-    _main_context = g_main_context_default();
 
-    if (!host) {
-        return 1;
+    if ((_cifritz_server.reactor = netutil_reactor_new()) == NULL) {
+        return 3;
     }
 
-    _cifritz_server.host = g_strdup(host);
-    _cifritz_server.port = port;
-
     /* init netlink socket */
     if ((_cifritz_server.netlink = netutil_init_netlink()) == -1) {
         log_log("Error connecting netlink socket.\n");
         return 2;
     }
+    _cifritz_server.netlink_source = netutil_reactor_add(_cifritz_server.reactor, _cifritz_server.netlink,
+            EPOLLIN, (NetutilReactorHandler)_fritz_handle_netlink_input, &_cifritz_server);
 
-    if (pipe(_cifritz_server.fdpipe) != 0) {
-        return 3;
+    _cifritz_server.state |= CIFritzServerStateInitialized;
+    return 0;
+}
+
+gint fritz_add_box(const gchar *name, const gchar *host, gushort port)
+{
+    CIFritzBox *box;
+
+    if (!host || !(_cifritz_server.state & CIFritzServerStateInitialized)) {
+        return 1;
+    }
+    if (_cifritz_server.state & CIFritzServerStateListening) {
+        return 2;
     }
 
-    _cifritz_server.state |= CIFritzServerStateInitialized;
+    box = g_malloc0(sizeof(CIFritzBox));
+    box->name = g_strdup(name ? name : host);
+    box->host = g_strdup(host);
+    box->port = port;
+    box->sock = -1;
+    /* here, not on the reactor thread: name lookups block */
+    if ((box->addr = netutil_get_ip_address(host)) == INADDR_NONE)
+        log_log("fritz: could not resolve %s, trying again when connecting\n", host);
+    box->reconnect_timer = netutil_reactor_add_timer(_cifritz_server.reactor,
+            (NetutilReactorTimerHandler)_fritz_try_reconnect, box);
+
+    _cifritz_server.boxes = g_list_append(_cifritz_server.boxes, box);
+    log_log("fritz: added box %s (%s:%u)\n", box->name, box->host, box->port);
+
     return 0;
 }
 
 static
-gint _fritz_connect(gboolean *connected)
+void _fritz_set_connected(CIFritzBox *box)
 {
     char ifname[IF_NAMESIZE];
 
+    ifname[0] = '\0';
+    if (netutil_get_interface_from_sock(box->sock, &box->assoc_ifindex, ifname) != 0) {
+        log_log("fritz[%s]: could not determine associated interface\n", box->name);
+    }
+    log_log("fritz[%s]: connected via %s (%d)\n", box->name, ifname, box->assoc_ifindex);
+    box->linebuf.head = 0;
+    box->linebuf.fill = 0;
+    box->state &= ~CIFritzServerStateConnecting;
+    box->state |= CIFritzServerStateConnected;
+}
+
+static
+gpointer _fritz_resolve_proc(CIFritzBox *box)
+{
+    in_addr_t addr = netutil_get_ip_address(box->host);
+
+    if (addr == INADDR_NONE)
+        log_log("fritz[%s]: could not resolve %s\n", box->name, box->host);
+    box->resolved = addr;
+    g_atomic_int_set(&box->resolving, FALSE);
+    return NULL;
+}
+
+/* TRUE if the address of the box is known. Otherwise a thread of its own
+ * looks it up, and a later connect attempt picks up the result. */
+static
+gboolean _fritz_resolve(CIFritzBox *box)
+{
+    if (box->addr != INADDR_NONE)
+        return TRUE;
+    if (g_atomic_int_get(&box->resolving))
+        return FALSE;
+    if (box->resolver != NULL) {
+        g_thread_join(box->resolver);
+        box->resolver = NULL;
+        box->addr = box->resolved;
+        if (box->addr != INADDR_NONE)
+            return TRUE;
+    }
+    g_atomic_int_set(&box->resolving, TRUE);
+    box->resolver = g_thread_new("FritzResolve", (GThreadFunc)_fritz_resolve_proc, box);
+    return FALSE;
+}
+
+/* The connect does not block the reactor: if it does not complete at once,
+ * the box waits for the socket to become writable in
+ * CIFritzServerStateConnecting and *connected stays FALSE. */
+static
+gint _fritz_connect(CIFritzBox *box, gboolean *connected)
+{
+    struct sockaddr_in srv;
+    int rc;
+
     if (connected) *connected = FALSE;
     if (!(_cifritz_server.state & CIFritzServerStateInitialized)) {
         return 4;
     }
-    if (_cifritz_server.state & CIFritzServerStateConnected) {
+    if (box->state & CIFritzServerStateConnected) {
         if (connected) *connected = TRUE;
         return 0;
     }
+    if (box->state & CIFritzServerStateConnecting) {
+        return 0;
+    }
+    if (!_fritz_resolve(box)) {
+        return 0;
+    }
 
-    struct sockaddr_in srv;
-    _cifritz_server.sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (_cifritz_server.sock == -1) {
+    box->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (box->sock == -1) {
+        return 2;
+    }
+    if (netutil_set_nonblocking(box->sock) != 0) {
+        netutil_close_fd(&box->sock);
         return 2;
     }
 
-    srv.sin_addr.s_addr = netutil_get_ip_address(_cifritz_server.host);
-    srv.sin_port = htons((gushort)_cifritz_server.port);
+    srv.sin_addr.s_addr = box->addr;
+    srv.sin_port = htons((gushort)box->port);
     srv.sin_family = AF_INET;
 
-    if (connect(_cifritz_server.sock, (const struct sockaddr *)&srv, sizeof(srv)) == 0) {
-        if (netutil_get_interface_from_sock(_cifritz_server.sock, &_cifritz_server.assoc_ifindex, ifname) != 0) {
-            log_log("fritz: could not determine associated interface\n");
-        }
-        log_log("fritz: connected via %s (%d)\n", ifname, _cifritz_server.assoc_ifindex);
-        _cifritz_server.state |= CIFritzServerStateConnected;
+    while ((rc = connect(box->sock, (const struct sockaddr *)&srv, sizeof(srv))) == -1 && errno == EINTR) {}
+    if (rc == -1 && errno != EINPROGRESS) {
+        log_log("fritz[%s]: failed to connect: %d (%s)\n", box->name, errno, strerror(errno));
+        netutil_close_fd(&box->sock);
+        return 0;
+    }
+
+    box->source = netutil_reactor_add(_cifritz_server.reactor, box->sock, rc == 0 ? EPOLLIN : EPOLLOUT,
+            (NetutilReactorHandler)_fritz_handle_box_input, box);
+    if (box->source == NULL) {
+        log_log("fritz[%s]: could not watch the connection\n", box->name);
+        netutil_close_fd(&box->sock);
+        return 3;
+    }
+
+    if (rc == 0) {
+        _fritz_set_connected(box);
         if (connected) *connected = TRUE;
     }
     else {
-        log_log("fritz: failed to connect: %d (%s)\n", errno, strerror(errno));
-        netutil_close_fd(&_cifritz_server.sock);
+        box->state |= CIFritzServerStateConnecting;
     }
     return 0;
 }
 
+/* The socket of a connecting box became writable. */
+static
+void _fritz_finish_connect(CIFritzBox *box)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(box->sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        err = errno;
+    if (err == 0 && netutil_reactor_modify(_cifritz_server.reactor, box->source, EPOLLIN) != 0)
+        err = errno;
+    if (err != 0) {
+        log_log("fritz[%s]: failed to connect: %d (%s)\n", box->name, err, strerror(err));
+        _fritz_disconnect(box);
+        _fritz_try_connect(box);
+        return;
+    }
+
+    _fritz_set_connected(box);
+    netutil_reactor_timer_arm(box->reconnect_timer, 0, FALSE);
+    box->reconnect_armed = FALSE;
+}
+
+static
+void _fritz_disconnect(CIFritzBox *box)
+{
+    if (box->source) {
+        netutil_reactor_remove(_cifritz_server.reactor, box->source);
+        box->source = NULL;
+    }
+    netutil_close_fd(&box->sock);
+    box->state &= ~(CIFritzServerStateConnected | CIFritzServerStateConnecting);
+    box->linebuf.head = 0;
+    box->linebuf.fill = 0;
+}
+
 gint fritz_startup(void (*fritz_listen_cb)(CIFritzCallMsg *))
 {
+    GList *tmp;
+
+    if (_cifritz_server.boxes == NULL) {
+        log_log("fritz: no box configured\n");
+        return 1;
+    }
+
     _cifritz_server.fritz_listen_cb = fritz_listen_cb;
 
-    _fritz_try_connect();
+    for (tmp = _cifritz_server.boxes; tmp != NULL; tmp = g_list_next(tmp)) {
+        _fritz_try_connect((CIFritzBox *)tmp->data);
+    }
 
+    _cifritz_server.state |= CIFritzServerStateListening;
     if ((_cifritz_server.thread = g_thread_new("Fritz", (GThreadFunc)_fritz_listen_thread_proc, NULL)) == NULL) {
+        _cifritz_server.state &= ~CIFritzServerStateListening;
         return 4;
     }
 
@@ -128,224 +314,297 @@ gint fritz_startup(void (*fritz_listen_cb)(CIFritzCallMsg *))
 
 gint fritz_shutdown(void)
 {
-    size_t bytes;
+    GList *tmp;
+    CIFritzBox *box;
+
     log_log("fritz: shutdown\n");
     if (_cifritz_server.state & CIFritzServerStateListening) {
-        log_log("write to pipe\n");
-        bytes = write(_cifritz_server.fdpipe[1], "disconnect", 10);
-        if (bytes != 10)
-            log_log("Error writing to pipe.\n");
+        netutil_reactor_stop(_cifritz_server.reactor);
         log_log("join: %p\n", _cifritz_server.thread);
         g_thread_join(_cifritz_server.thread);
         _cifritz_server.thread = NULL;
         log_log("joined\n");
         _cifritz_server.state &= ~CIFritzServerStateListening;
     }
-    if (_cifritz_server.state & CIFritzServerStateConnected) {
-        netutil_close_fd(&_cifritz_server.sock);
-        _cifritz_server.state &= ~CIFritzServerStateConnected;
+    for (tmp = _cifritz_server.boxes; tmp != NULL; tmp = g_list_next(tmp)) {
+        box = (CIFritzBox *)tmp->data;
+        if (box->state & (CIFritzServerStateConnected | CIFritzServerStateConnecting)) {
+            _fritz_disconnect(box);
+        }
+        _fritz_log_reader_stats(box);
     }
     return 0;
 }
 
+static
+void _fritz_free_box(CIFritzBox *box)
+{
+    _fritz_disconnect(box);
+    netutil_reactor_remove(_cifritz_server.reactor, box->reconnect_timer);
+    if (box->resolver)
+        g_thread_join(box->resolver);
+    g_free(box->name);
+    g_free(box->host);
+    g_free(box);
+}
+
 gint fritz_cleanup(void)
 {
-    if (_cifritz_server.state >= CIFritzServerStateConnected) {
+    if (_cifritz_server.state & CIFritzServerStateListening) {
         fritz_shutdown();
     }
-    netutil_close_fd(&_cifritz_server.fdpipe[0]);
-    netutil_close_fd(&_cifritz_server.fdpipe[1]);
+    g_list_free_full(_cifritz_server.boxes, (GDestroyNotify)_fritz_free_box);
+    _cifritz_server.boxes = NULL;
+    if (_cifritz_server.netlink_source) {
+        netutil_reactor_remove(_cifritz_server.reactor, _cifritz_server.netlink_source);
+        _cifritz_server.netlink_source = NULL;
+    }
     netutil_cleanup(_cifritz_server.netlink);
-    g_free(_cifritz_server.host);
-    _cifritz_server.host = NULL;
+    _cifritz_server.netlink = -1;
+    netutil_reactor_free(_cifritz_server.reactor);
+    _cifritz_server.reactor = NULL;
     return 0;
 }
 
+gint fritz_get_reader_stats(const gchar *name, CIFritzReaderStats *stats)
+{
+    GList *tmp;
+
+    if (!stats)
+        return 1;
+    for (tmp = _cifritz_server.boxes; tmp != NULL; tmp = g_list_next(tmp)) {
+        if (g_strcmp0(((CIFritzBox *)tmp->data)->name, name) == 0) {
+            memcpy(stats, &((CIFritzBox *)tmp->data)->stats, sizeof(CIFritzReaderStats));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* reconnect timer, runs on the reactor thread; it also ends connects that
+ * are still pending after an interval */
 static
-gboolean _fritz_try_reconnect(CIFritzServer *srv)
+void _fritz_try_reconnect(CIFritzBox *box)
 {
     gboolean connected;
-    _fritz_connect(&connected);
 
-    if (srv && connected) {
-        write(srv->fdpipe[1], "add sock", 8);
+    if (box->state & CIFritzServerStateConnecting) {
+        log_log("fritz[%s]: connect timed out\n", box->name);
+        _fritz_disconnect(box);
     }
+    _fritz_connect(box, &connected);
 
-    return !connected;
+    if (connected) {
+        netutil_reactor_timer_arm(box->reconnect_timer, 0, FALSE);
+        box->reconnect_armed = FALSE;
+    }
 }
 
 static
-void _fritz_try_connect(void)
+void _fritz_try_connect(CIFritzBox *box)
 {
-    if (_cifritz_server.state & CIFritzServerStateConnected)
-        return;
     gboolean connected;
-    _fritz_connect(&connected);
+
+    if (box->state & CIFritzServerStateConnected)
+        return;
+    if (box->reconnect_armed)
+        return;
+    _fritz_connect(box, &connected);
 
     if (!connected) {
-        g_timeout_add_seconds(10, (GSourceFunc)_fritz_try_reconnect, (gpointer)&_cifritz_server);
+        netutil_reactor_timer_arm(box->reconnect_timer, FRITZ_RECONNECT_INTERVAL * 1000, TRUE);
+        box->reconnect_armed = TRUE;
     }
 }
 
 static
 void _fritz_handle_net_up(int ifindex, char *ifname, CIFritzServer *srv)
 {
+    GList *tmp;
+
     log_log("fritz: handle net up\n");
-    _fritz_try_connect();
+    for (tmp = srv->boxes; tmp != NULL; tmp = g_list_next(tmp)) {
+        _fritz_try_connect((CIFritzBox *)tmp->data);
+    }
 }
 
 static
 void _fritz_handle_net_down(int ifindex, char *ifname, CIFritzServer *srv)
 {
+    GList *tmp;
+    CIFritzBox *box;
+
     log_log("fritz: handle net down: %s (%d)\n", ifname, ifindex);
-    if (ifindex == _cifritz_server.assoc_ifindex) {
-        netutil_close_fd(&srv->sock);
-        srv->state &= ~CIFritzServerStateConnected;
+    for (tmp = srv->boxes; tmp != NULL; tmp = g_list_next(tmp)) {
+        box = (CIFritzBox *)tmp->data;
+        if (!(box->state & CIFritzServerStateConnected))
+            continue;
+        if (ifindex == box->assoc_ifindex) {
+            log_log("fritz[%s]: interface went down, disconnecting\n", box->name);
+            _fritz_disconnect(box);
+            _fritz_try_connect(box);
+        }
+        else {
+            log_log("fritz[%s]: still connected via %d, ignoring\n", box->name, box->assoc_ifindex);
+        }
     }
-    else {
-        log_log("fritz: still connected via %d, ignoring\n", _cifritz_server.assoc_ifindex);
+}
+
+static
+void _fritz_handle_box_input(int fd, guint32 events, CIFritzBox *box)
+{
+    if (box->state & CIFritzServerStateConnecting) {
+        _fritz_finish_connect(box);
+        return;
     }
+    if (_fritz_read_records(box) != 0) {
+        log_log("fritz[%s]: lost connection, trying to reconnect\n", box->name);
+        _fritz_disconnect(box);
+        _fritz_try_connect(box);
+    }
+}
+
+static
+void _fritz_handle_netlink_input(int fd, guint32 events, CIFritzServer *srv)
+{
+    netutil_handle_netlink_message(fd, &_fritz_netlink_callbacks, (void *)srv);
 }
 
 static
 void *_fritz_listen_thread_proc(void *pdata)
 {
-    log_log("fritz: start listening: %sconnected\n", _cifritz_server.state & CIFritzServerStateConnected ? "" : "not ");
+    log_log("fritz: start listening to %u boxes\n", g_list_length(_cifritz_server.boxes));
 
-    _cifritz_server.state |= CIFritzServerStateListening;
-    gchar buffer[FRITZ_BUFFER_SIZE];
-    int bytes;
+    if (netutil_reactor_run(_cifritz_server.reactor) != 0) {
+        log_log("fritz: reactor failed, terminating thread\n");
+    }
+    else {
+        log_log("received terminating signal\n");
+    }
 
-    fd_set rfds;
-    int max;
+    return NULL;
+}
 
-    CIFritzCallMsg cmsg;
+/* Read everything available into the ring buffer and dispatch every complete
+ * record. An incomplete line at the end is kept for the next read.
+ * Returns non-zero if the connection was closed or failed.
+ */
+static
+gint _fritz_read_records(CIFritzBox *box)
+{
+    CIFritzLineBuffer *lb = &box->linebuf;
+    struct iovec iov[2];
+    int niov;
+    gsize tail, free_space, scanned, start, len;
+    ssize_t bytes;
+    guint64 records = 0;
+    gchar line[FRITZ_LINEBUF_SIZE];
+
+    if (lb->fill == FRITZ_LINEBUF_SIZE) {
+        /* no line terminator in a full buffer, this cannot be a valid record */
+        log_log("fritz[%s]: record exceeds %d bytes, discarding\n", box->name, FRITZ_LINEBUF_SIZE);
+        ++box->stats.overflows;
+        lb->head = 0;
+        lb->fill = 0;
+    }
+
+    tail = (lb->head + lb->fill) & FRITZ_LINEBUF_MASK;
+    free_space = FRITZ_LINEBUF_SIZE - lb->fill;
 
-    NetutilCallbacks nu_cb = {
-        .net_up   = (NetutilCallback)_fritz_handle_net_up,
-        .net_down = (NetutilCallback)_fritz_handle_net_down
-    };
+    iov[0].iov_base = &lb->data[tail];
+    if (tail + free_space <= FRITZ_LINEBUF_SIZE) {
+        iov[0].iov_len = free_space;
+        niov = 1;
+    }
+    else {
+        iov[0].iov_len = FRITZ_LINEBUF_SIZE - tail;
+        iov[1].iov_base = lb->data;
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        niov = 2;
+    }
+
+    if ((bytes = readv(box->sock, iov, niov)) < 1) {
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN))
+            return 0;
+        return 1;
+    }
 
-    while (1) {
-        max = netutil_init_fd_set(&rfds, 3,
-                                  _cifritz_server.sock,
-                                  _cifritz_server.fdpipe[0],
-                                  _cifritz_server.netlink);
+    ++box->stats.reads;
+    box->stats.bytes += bytes;
 
-        if (select(max, &rfds, NULL, NULL, NULL) < 0) {
-            log_log("select returned negative value, terminating thread\n");
-            return NULL;
-        }
+    /* only the newly received bytes can contain a new terminator */
+    scanned = lb->fill;
+    lb->fill += bytes;
 
-        if (FD_ISSET(_cifritz_server.sock, &rfds)) {
-            if ((bytes = recv(_cifritz_server.sock, buffer, FRITZ_BUFFER_SIZE-1, 0)) >= 1) {
-                buffer[bytes] = '\0';
-                log_log("received message\n");
-                if (_fritz_parse_notification(buffer, &cmsg) == 0) {
-                    log_log("parsed message (cb: %p)\n", _cifritz_server.fritz_listen_cb);
-                    if (_cifritz_server.fritz_listen_cb) {
-                        (*_cifritz_server.fritz_listen_cb)(&cmsg);
-                    }
-                }
-            }
-            else {
-                log_log("fritz: lost connection, trying to reconnect\n");
-                _cifritz_server.state &= ~CIFritzServerStateConnected;
-                netutil_close_fd(&_cifritz_server.sock);
-            }
+    while (scanned < lb->fill) {
+        if (lb->data[(lb->head + scanned) & FRITZ_LINEBUF_MASK] != '\n') {
+            ++scanned;
+            continue;
         }
 
-        if (FD_ISSET(_cifritz_server.fdpipe[0], &rfds)) {
-            bytes = read(_cifritz_server.fdpipe[0], buffer, FRITZ_BUFFER_SIZE-1);
-            if (bytes) {
-                if (!strncmp(buffer, "disconnect", bytes > 10 ? 10 : bytes)) {
-                    log_log("received terminating signal\n");
-                    _cifritz_server.state &= ~CIFritzServerStateListening;
-                    return NULL;
-                }
-            }
-        }
+        start = lb->head;
+        len = scanned;
 
-        if (FD_ISSET(_cifritz_server.netlink, &rfds)) {
-            netutil_handle_netlink_message(_cifritz_server.netlink, &nu_cb, (void *)&_cifritz_server);
+        if (start + len < FRITZ_LINEBUF_SIZE) {
+            /* contiguous: terminate in place */
+            lb->data[start + len] = '\0';
+            _fritz_dispatch_record(box, &lb->data[start], len);
         }
+        else {
+            memcpy(line, &lb->data[start], FRITZ_LINEBUF_SIZE - start);
+            memcpy(&line[FRITZ_LINEBUF_SIZE - start], lb->data, len - (FRITZ_LINEBUF_SIZE - start));
+            line[len] = '\0';
+            _fritz_dispatch_record(box, line, len);
+        }
+        ++records;
+
+        lb->head = (lb->head + len + 1) & FRITZ_LINEBUF_MASK;
+        lb->fill -= len + 1;
+        scanned = 0;
     }
-    _cifritz_server.state &= ~CIFritzServerStateListening;
-    log_log("No file descriptor set -- returning\n");
-    return NULL;
+
+    if (lb->fill == 0)
+        lb->head = 0;
+    else {
+        ++box->stats.carry_overs;
+        if (lb->fill > box->stats.max_carry_bytes)
+            box->stats.max_carry_bytes = lb->fill;
+    }
+
+    box->stats.records += records;
+    if (records > box->stats.max_records_per_read)
+        box->stats.max_records_per_read = records;
+
+    return 0;
 }
 
-/* parse notifications:
- * date;CALL;connectionid;nst;msn;number;protocol;
- * date;RING;connectionid;number;msn;protocol;
- * date;CONNECT;connectionid;nst;number;
- * date;DISCONNECT;connectionid;duration;
- *
- * date: %d.%m.%y %H:%M:%S
- * duration: seconds
- */
 static
-gint _fritz_parse_notification(const gchar *notify, CIFritzCallMsg *cmsg)
+void _fritz_dispatch_record(CIFritzBox *box, gchar *record, gsize len)
 {
-    if (notify == NULL)
-        return 1;
-    if (cmsg == NULL)
-        return 2;
-    log_log("_fritz_parse_notification: %s\n", notify);
-
-    memset(cmsg, 0, sizeof(CIFritzCallMsg));
-
-    gchar **fields = g_strsplit(notify, ";", 0);
-
-    /* all messages must have at least 4 fields */
-    if (fields[0] == NULL || fields[1] == NULL ||
-            fields[2] == NULL || fields[3] == NULL)
-        goto out;
-
-    strptime(fields[0], "%d.%m.%y %H:%M:%S", &cmsg->datetime);
-
-    if (g_strcmp0(fields[1], "RING") == 0)
-        cmsg->msgtype = CALLMSGTYPE_RING;
-    else if (g_strcmp0(fields[1], "CALL") == 0)
-        cmsg->msgtype = CALLMSGTYPE_CALL;
-    else if (g_strcmp0(fields[1], "CONNECT") == 0)
-        cmsg->msgtype = CALLMSGTYPE_CONNECT;
-    else if (g_strcmp0(fields[1], "DISCONNECT") == 0)
-        cmsg->msgtype = CALLMSGTYPE_DISCONNECT;
-    else
-        goto out;
-
-    cmsg->connectionid = (gushort)atoi(fields[2]);
-
-    switch (cmsg->msgtype) {
-        case CALLMSGTYPE_RING:
-            if (fields[4] == NULL)
-                goto out;
-            g_strlcpy(cmsg->calling_number, fields[3], 32);
-            g_strlcpy(cmsg->called_number, fields[4], 32);
-            break;
-        case CALLMSGTYPE_CALL:
-            if (fields[4] == NULL || fields[5] == NULL)
-                goto out;
-            cmsg->nst = (gushort)atoi(fields[3]);
-            g_strlcpy(cmsg->calling_number, fields[4], 32);
-            g_strlcpy(cmsg->called_number, fields[5], 32);
-            break;
-        case CALLMSGTYPE_CONNECT:
-            if (fields[4] == NULL)
-                goto out;
-            cmsg->nst = (gushort)atoi(fields[3]);
-            g_strlcpy(cmsg->calling_number, fields[4], 32);
-            break;
-        case CALLMSGTYPE_DISCONNECT:
-            cmsg->duration = (gulong)strtoul(fields[3], NULL, 10);
-            break;
-    }
-
-    g_strfreev(fields);
-    return 0;
+    CIFritzCallMsg cmsg;
+
+    /* the call monitor terminates lines with \r\n */
+    if (len > 0 && record[len - 1] == '\r')
+        record[--len] = '\0';
+    if (len == 0)
+        return;
+
+    log_log("fritz[%s]: received message: %s\n", box->name, record);
+    if (fritz_parse_notification(record, len, &cmsg, &box->parse_cache) == 0) {
+        g_strlcpy(cmsg.box, box->name, sizeof(cmsg.box));
+        log_log("parsed message (cb: %p)\n", _cifritz_server.fritz_listen_cb);
+        if (_cifritz_server.fritz_listen_cb) {
+            (*_cifritz_server.fritz_listen_cb)(&cmsg);
+        }
+    }
+}
 
-out:
-    g_strfreev(fields);
-    return 3;
+static
+void _fritz_log_reader_stats(CIFritzBox *box)
+{
+    log_log("fritz[%s]: reader stats: %" G_GUINT64_FORMAT " reads, %" G_GUINT64_FORMAT " bytes, %"
+            G_GUINT64_FORMAT " records (max %" G_GUINT64_FORMAT " per read), %" G_GUINT64_FORMAT
+            " partial carry-overs (max %" G_GUINT64_FORMAT " bytes), %" G_GUINT64_FORMAT " overflows\n",
+            box->stats.reads, box->stats.bytes, box->stats.records, box->stats.max_records_per_read,
+            box->stats.carry_overs, box->stats.max_carry_bytes, box->stats.overflows);
 }
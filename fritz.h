@@ -17,11 +17,25 @@ typedef struct _CIFritzCallMsg {
     char number[32];
     gulong duration;
     struct tm datetime;
+    char box[32];               /* name of the box reporting the event */
 } CIFritzCallMsg;
 
-gint fritz_init(gchar *host, gushort port);
+/* counters of the line framed call monitor reader */
+typedef struct _CIFritzReaderStats {
+    guint64 reads;                /* successful reads from the socket */
+    guint64 bytes;                /* bytes received */
+    guint64 records;              /* complete records dispatched */
+    guint64 max_records_per_read; /* most records completed by a single read */
+    guint64 carry_overs;          /* reads ending with a partial line */
+    guint64 max_carry_bytes;      /* largest partial line carried to the next read */
+    guint64 overflows;            /* records discarded for exceeding the buffer */
+} CIFritzReaderStats;
+
+gint fritz_init(void);
+gint fritz_add_box(const gchar *name, const gchar *host, gushort port);
 gint fritz_startup(void (*fritz_listen_cb)(CIFritzCallMsg *));
 gint fritz_shutdown(void);
 gint fritz_cleanup(void);
+gint fritz_get_reader_stats(const gchar *box, CIFritzReaderStats *stats);
 
 #endif
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <time.h>
+#include "fritz_parser.h"
+
+/* DISCONNECT has the fewest fields, CALL the most we use */
+#define FRITZ_PARSE_MAX_FIELDS      7
+
+typedef struct {
+    const gchar *str;
+    gsize len;
+} CIFritzField;
+
+static gulong _fritz_parse_uint(const CIFritzField *field)
+{
+    gulong val = 0;
+    gsize i;
+
+    for (i = 0; i < field->len && g_ascii_isdigit(field->str[i]); ++i)
+        val = 10 * val + (field->str[i] - '0');
+
+    return val;
+}
+
+static void _fritz_copy_field(gchar *dst, gsize size, const CIFritzField *field)
+{
+    gsize len = field->len < size ? field->len : size - 1;
+
+    memcpy(dst, field->str, len);
+    dst[len] = '\0';
+}
+
+static inline gint _fritz_parse_2digits(const gchar *s)
+{
+    if (!g_ascii_isdigit(s[0]) || !g_ascii_isdigit(s[1]))
+        return -1;
+    return 10 * (s[0] - '0') + (s[1] - '0');
+}
+
+/* date: %d.%m.%y %H:%M:%S */
+static gint _fritz_parse_date(const CIFritzField *field, struct tm *tm)
+{
+    const gchar *s = field->str;
+    gint day, mon, year, hour, min, sec;
+    gchar buffer[32];
+
+    if (field->len == 17 && s[2] == '.' && s[5] == '.' && s[8] == ' ' && s[11] == ':' && s[14] == ':') {
+        day  = _fritz_parse_2digits(&s[0]);
+        mon  = _fritz_parse_2digits(&s[3]);
+        year = _fritz_parse_2digits(&s[6]);
+        hour = _fritz_parse_2digits(&s[9]);
+        min  = _fritz_parse_2digits(&s[12]);
+        sec  = _fritz_parse_2digits(&s[15]);
+
+        if (day >= 0 && mon >= 0 && year >= 0 && hour >= 0 && min >= 0 && sec >= 0) {
+            memset(tm, 0, sizeof(struct tm));
+            tm->tm_mday = day;
+            tm->tm_mon = mon - 1;
+            /* same pivot as strptime's %y */
+            tm->tm_year = year < 69 ? year + 100 : year;
+            tm->tm_hour = hour;
+            tm->tm_min = min;
+            tm->tm_sec = sec;
+            return 0;
+        }
+    }
+
+    /* unexpected layout, let strptime sort it out */
+    if (field->len >= sizeof(buffer))
+        return 1;
+    memcpy(buffer, s, field->len);
+    buffer[field->len] = '\0';
+    memset(tm, 0, sizeof(struct tm));
+    strptime(buffer, "%d.%m.%y %H:%M:%S", tm);
+    return 0;
+}
+
+static gint _fritz_classify(const CIFritzField *field, gushort *msgtype)
+{
+    const gchar *s = field->str;
+
+    switch (s[0]) {
+        case 'R':
+            if (field->len == 4 && memcmp(s, "RING", 4) == 0) {
+                *msgtype = CALLMSGTYPE_RING;
+                return 0;
+            }
+            break;
+        case 'C':
+            if (field->len == 4 && memcmp(s, "CALL", 4) == 0) {
+                *msgtype = CALLMSGTYPE_CALL;
+                return 0;
+            }
+            if (field->len == 7 && memcmp(s, "CONNECT", 7) == 0) {
+                *msgtype = CALLMSGTYPE_CONNECT;
+                return 0;
+            }
+            break;
+        case 'D':
+            if (field->len == 10 && memcmp(s, "DISCONNECT", 10) == 0) {
+                *msgtype = CALLMSGTYPE_DISCONNECT;
+                return 0;
+            }
+            break;
+    }
+    return 1;
+}
+
+void fritz_parse_cache_init(CIFritzParseCache *cache)
+{
+    if (cache)
+        memset(cache, 0, sizeof(CIFritzParseCache));
+}
+
+/* parse notifications:
+ * date;CALL;connectionid;nst;msn;number;protocol;
+ * date;RING;connectionid;number;msn;protocol;
+ * date;CONNECT;connectionid;nst;number;
+ * date;DISCONNECT;connectionid;duration;
+ *
+ * date: %d.%m.%y %H:%M:%S
+ * duration: seconds
+ *
+ * The record is tokenized in place without allocating. cache may be NULL.
+ */
+gint fritz_parse_notification(const gchar *notify, gsize len, CIFritzCallMsg *cmsg, CIFritzParseCache *cache)
+{
+    CIFritzField fields[FRITZ_PARSE_MAX_FIELDS];
+    guint nfields = 0;
+    gsize start = 0, i;
+
+    if (notify == NULL)
+        return 1;
+    if (cmsg == NULL)
+        return 2;
+
+    memset(cmsg, 0, sizeof(CIFritzCallMsg));
+
+    for (i = 0; i <= len && nfields < FRITZ_PARSE_MAX_FIELDS; ++i) {
+        if (i == len || notify[i] == ';') {
+            fields[nfields].str = &notify[start];
+            fields[nfields].len = i - start;
+            ++nfields;
+            start = i + 1;
+        }
+    }
+
+    /* all messages must have at least 4 fields */
+    if (nfields < 4 || fields[1].len == 0)
+        return 3;
+
+    if (_fritz_classify(&fields[1], &cmsg->msgtype) != 0)
+        return 3;
+
+    if (cache && cache->datelen == fields[0].len &&
+            memcmp(cache->date, fields[0].str, fields[0].len) == 0) {
+        memcpy(&cmsg->datetime, &cache->datetime, sizeof(struct tm));
+    }
+    else {
+        if (_fritz_parse_date(&fields[0], &cmsg->datetime) != 0)
+            return 3;
+        if (cache && fields[0].len < sizeof(cache->date)) {
+            memcpy(cache->date, fields[0].str, fields[0].len);
+            cache->datelen = fields[0].len;
+            memcpy(&cache->datetime, &cmsg->datetime, sizeof(struct tm));
+        }
+    }
+
+    cmsg->connectionid = (gushort)_fritz_parse_uint(&fields[2]);
+
+    switch (cmsg->msgtype) {
+        case CALLMSGTYPE_RING:
+            if (nfields < 5)
+                return 3;
+            _fritz_copy_field(cmsg->calling_number, 32, &fields[3]);
+            _fritz_copy_field(cmsg->called_number, 32, &fields[4]);
+            break;
+        case CALLMSGTYPE_CALL:
+            if (nfields < 6)
+                return 3;
+            cmsg->nst = (gushort)_fritz_parse_uint(&fields[3]);
+            _fritz_copy_field(cmsg->calling_number, 32, &fields[4]);
+            _fritz_copy_field(cmsg->called_number, 32, &fields[5]);
+            break;
+        case CALLMSGTYPE_CONNECT:
+            if (nfields < 5)
+                return 3;
+            cmsg->nst = (gushort)_fritz_parse_uint(&fields[3]);
+            _fritz_copy_field(cmsg->calling_number, 32, &fields[4]);
+            break;
+        case CALLMSGTYPE_DISCONNECT:
+            cmsg->duration = _fritz_parse_uint(&fields[3]);
+            break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef __FRITZ_PARSER_H__
+#define __FRITZ_PARSER_H__
+
+#include <glib.h>
+#include "fritz.h"
+
+/* date prefix of the last parsed record; consecutive events mostly share it */
+typedef struct _CIFritzParseCache {
+    gchar date[24];
+    gsize datelen;
+    struct tm datetime;
+} CIFritzParseCache;
+
+void fritz_parse_cache_init(CIFritzParseCache *cache);
+gint fritz_parse_notification(const gchar *notify, gsize len, CIFritzCallMsg *cmsg, CIFritzParseCache *cache);
+
+#endif
@@ -0,0 +1,481 @@
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "logging.h"
+
+#define JOURNAL_DEFAULT_INTERVAL        200                 /* msec */
+#define JOURNAL_FLUSH_THRESHOLD         (64 * 1024)         /* write early when this much is buffered */
+#define JOURNAL_TAIL_SCAN               4096
+#define JOURNAL_LINE_SIZE               2048
+/* records kept for another try while writes fail */
+#define JOURNAL_RETRY_LIMIT             (16 * JOURNAL_FLUSH_THRESHOLD)
+
+/* Outcome of one group commit, shared by the JournalSyncAlways appenders in it. */
+typedef struct _CIJournalCommit {
+    gint refcount;
+    gboolean done;
+    gint rc;
+} CIJournalCommit;
+
+typedef struct _CIJournal {
+    gchar *path;
+    int fd;
+    guint64 size;               /* size of the current segment */
+    guint64 segment_size;       /* rotate when exceeded, 0 to never rotate */
+    gint64 interval;            /* usec */
+    CIJournalSync sync;
+
+    GMutex lock;
+    GCond wakeup;               /* writer: records are waiting */
+    GCond committed;            /* appenders in JournalSyncAlways mode */
+    GString *buffer;
+    gint64 commit_at;           /* when the oldest buffered record is due */
+    gboolean urgent;
+    gboolean stop;
+    guint64 next_seq;
+    guint64 buffered_seq;       /* last sequence number in buffer */
+    guint64 durable_seq;        /* last sequence number handed to the kernel (and synced) */
+    CIJournalCommit *commit;    /* commit of the records in buffer, if anyone waits for it */
+    gboolean failing;           /* the last commit did not reach the disk */
+    GThread *thread;
+    CIJournalStats stats;
+} CIJournal;
+
+static CIJournal _journal = { .fd = -1 };
+
+static guint32 _journal_crc_table[256];
+
+static
+void _journal_crc_init(void)
+{
+    static gsize initialized = 0;
+    guint32 c;
+    guint i, k;
+
+    if (g_once_init_enter(&initialized)) {
+        for (i = 0; i < 256; ++i) {
+            c = i;
+            for (k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            _journal_crc_table[i] = c;
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+guint32 journal_crc32(const gchar *data, gsize len)
+{
+    guint32 crc = 0xffffffffu;
+    gsize i;
+
+    _journal_crc_init();
+    for (i = 0; i < len; ++i)
+        crc = _journal_crc_table[(crc ^ (guchar)data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+CIJournalSync journal_sync_from_string(const gchar *str)
+{
+    if (str == NULL)
+        return JournalSyncInterval;
+    if (g_ascii_strcasecmp(str, "none") == 0)
+        return JournalSyncNone;
+    if (g_ascii_strcasecmp(str, "always") == 0)
+        return JournalSyncAlways;
+    return JournalSyncInterval;
+}
+
+/* Highest sequence number in the tail of the current segment or in the name
+ * of a rotated one. */
+static
+guint64 _journal_find_last_seq(void)
+{
+    gchar buffer[JOURNAL_TAIL_SCAN + 1];
+    gchar *dir, *base, *line;
+    const gchar *name;
+    guint64 seq = 0, tmp;
+    gsize baselen;
+    ssize_t bytes;
+    off_t offset;
+    GDir *gdir;
+    int fd;
+
+    if ((fd = open(_journal.path, O_RDONLY | O_CLOEXEC)) != -1) {
+        offset = lseek(fd, 0, SEEK_END);
+        offset = offset > JOURNAL_TAIL_SCAN ? offset - JOURNAL_TAIL_SCAN : 0;
+        bytes = pread(fd, buffer, JOURNAL_TAIL_SCAN, offset);
+        close(fd);
+        if (bytes > 0) {
+            buffer[bytes] = '\0';
+            /* walk the lines backwards, skipping a partial first one */
+            while (bytes > 0) {
+                if (buffer[bytes - 1] == '\n')
+                    buffer[--bytes] = '\0';
+                line = strrchr(buffer, '\n');
+                if (line == NULL && offset > 0)
+                    break;
+                line = line ? line + 1 : buffer;
+                if (line[0] == '#') {
+                    seq = g_ascii_strtoull(line + 1, NULL, 10);
+                    break;
+                }
+                bytes = line - buffer;
+            }
+        }
+    }
+
+    dir = g_path_get_dirname(_journal.path);
+    base = g_path_get_basename(_journal.path);
+    baselen = strlen(base);
+    if ((gdir = g_dir_open(dir, 0, NULL)) != NULL) {
+        while ((name = g_dir_read_name(gdir)) != NULL) {
+            if (strncmp(name, base, baselen) != 0 || name[baselen] != '.' ||
+                    !g_ascii_isdigit(name[baselen + 1]))
+                continue;
+            tmp = g_ascii_strtoull(&name[baselen + 1], NULL, 10);
+            if (tmp > seq)
+                seq = tmp;
+        }
+        g_dir_close(gdir);
+    }
+    g_free(dir);
+    g_free(base);
+
+    return seq;
+}
+
+/* A crash in the middle of a write leaves a partial last line. Cut the
+ * segment back to the end of the last complete record, so that the next
+ * record does not run into it. Returns the new size. */
+static
+off_t _journal_repair_tail(int fd, off_t size)
+{
+    gchar buffer[JOURNAL_TAIL_SCAN];
+    off_t offset = size, end, cut = 0;
+    ssize_t bytes, i;
+
+    while (offset > 0) {
+        end = offset;
+        offset = end > JOURNAL_TAIL_SCAN ? end - JOURNAL_TAIL_SCAN : 0;
+        if ((bytes = pread(fd, buffer, end - offset, offset)) <= 0)
+            return size;
+        for (i = bytes; i > 0 && buffer[i - 1] != '\n'; --i) {}
+        if (i > 0) {
+            cut = offset + i;
+            break;
+        }
+    }
+    if (cut == size)
+        return size;
+
+    log_log("journal: cutting a partial record of %lu bytes from %s\n", (gulong)(size - cut), _journal.path);
+    if (ftruncate(fd, cut) != 0) {
+        log_log("journal: could not truncate %s: %d (%s)\n", _journal.path, errno, strerror(errno));
+        return size;
+    }
+    return cut;
+}
+
+static
+gint _journal_open_segment(void)
+{
+    struct stat st;
+
+    if ((_journal.fd = open(_journal.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+        log_log("journal: could not open %s: %d (%s)\n", _journal.path, errno, strerror(errno));
+        return 1;
+    }
+    _journal.size = fstat(_journal.fd, &st) == 0 ? (guint64)st.st_size : 0;
+    if (_journal.size > 0)
+        _journal.size = (guint64)_journal_repair_tail(_journal.fd, (off_t)_journal.size);
+    return 0;
+}
+
+/* The rotated segment is named after the last sequence number it contains. */
+static
+gint _journal_rotate(guint64 last_seq)
+{
+    gchar *name = g_strdup_printf("%s.%012" G_GUINT64_FORMAT, _journal.path, last_seq);
+
+    close(_journal.fd);
+    _journal.fd = -1;
+    if (rename(_journal.path, name) != 0)
+        log_log("journal: could not rotate to %s: %d (%s)\n", name, errno, strerror(errno));
+    else
+        log_log("journal: rotated to %s\n", name);
+    g_free(name);
+
+    return _journal_open_segment();
+}
+
+static
+void _journal_commit_unref(CIJournalCommit *commit)
+{
+    if (commit && --commit->refcount == 0)
+        g_free(commit);
+}
+
+/* Take back what a failed commit wrote, it is written again with the retry.
+ * If that fails too, the segment is reopened, which cuts the partial record. */
+static
+void _journal_undo_write(guint64 size)
+{
+    if (ftruncate(_journal.fd, (off_t)size) == 0) {
+        _journal.size = size;
+        return;
+    }
+    log_log("journal: could not truncate after failed write: %d (%s)\n", errno, strerror(errno));
+    close(_journal.fd);
+    _journal.fd = -1;
+}
+
+static
+gint _journal_write(GString *data)
+{
+    guint64 start = _journal.size;
+    gsize written = 0;
+    ssize_t rc;
+
+    if (_journal.fd == -1)
+        return 1;
+
+    while (written < data->len) {
+        rc = write(_journal.fd, data->str + written, data->len - written);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            log_log("journal: write failed: %d (%s)\n", errno, strerror(errno));
+            _journal_undo_write(start);
+            return 1;
+        }
+        written += (gsize)rc;
+    }
+    _journal.size += written;
+
+    if (_journal.sync != JournalSyncNone) {
+        if (fdatasync(_journal.fd) != 0) {
+            log_log("journal: fdatasync failed: %d (%s)\n", errno, strerror(errno));
+            _journal_undo_write(start);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static
+gpointer _journal_writer_proc(gpointer data)
+{
+    GString *pending = g_string_sized_new(JOURNAL_FLUSH_THRESHOLD);
+    GString *tmp;
+    CIJournalCommit *commit;
+    guint64 seq;
+    gint rc, rotated;
+
+    g_mutex_lock(&_journal.lock);
+    while (!_journal.stop || _journal.buffer->len > 0) {
+        if (_journal.buffer->len == 0) {
+            g_cond_wait(&_journal.wakeup, &_journal.lock);
+            continue;
+        }
+        /* after a failed commit, wait for the retry time in any case */
+        if (!_journal.stop && g_get_monotonic_time() < _journal.commit_at &&
+                (_journal.failing || (!_journal.urgent && _journal.buffer->len < JOURNAL_FLUSH_THRESHOLD))) {
+            g_cond_wait_until(&_journal.wakeup, &_journal.lock, _journal.commit_at);
+            continue;
+        }
+
+        /* swap buffers so appenders can go on while we write */
+        tmp = _journal.buffer;
+        _journal.buffer = pending;
+        pending = tmp;
+        seq = _journal.buffered_seq;
+        commit = _journal.commit;
+        _journal.commit = NULL;
+        _journal.urgent = FALSE;
+        g_mutex_unlock(&_journal.lock);
+
+        /* the segment may be gone after a failed open or rotation */
+        if (_journal.fd == -1)
+            _journal_open_segment();
+        rc = _journal_write(pending);
+        rotated = -1;
+        if (rc == 0 && _journal.segment_size && _journal.size >= _journal.segment_size)
+            rotated = _journal_rotate(seq);
+
+        g_mutex_lock(&_journal.lock);
+        ++_journal.stats.commits;
+        if (rotated != -1)
+            ++_journal.stats.rotations;
+        if (rc != 0 || rotated > 0)
+            ++_journal.stats.errors;
+        else if (_journal.sync != JournalSyncNone)
+            ++_journal.stats.syncs;
+        if (rc == 0)
+            _journal.durable_seq = seq;
+        else if (_journal.stop || pending->len + _journal.buffer->len > JOURNAL_RETRY_LIMIT) {
+            log_log("journal: dropping %" G_GSIZE_FORMAT " bytes of records that could not be written\n",
+                    pending->len);
+        }
+        else {
+            /* put the records back in front of the newer ones and try again later */
+            g_string_prepend_len(_journal.buffer, pending->str, pending->len);
+            _journal.commit_at = g_get_monotonic_time() + _journal.interval;
+        }
+        g_string_truncate(pending, 0);
+        _journal.failing = rc != 0;
+        if (commit) {
+            commit->done = TRUE;
+            commit->rc = rc;
+            _journal_commit_unref(commit);
+            g_cond_broadcast(&_journal.committed);
+        }
+    }
+    g_mutex_unlock(&_journal.lock);
+
+    g_string_free(pending, TRUE);
+    return NULL;
+}
+
+gint journal_init(const gchar *path, guint commit_interval, CIJournalSync sync, guint64 segment_size)
+{
+    if (path == NULL || _journal.path != NULL)
+        return 1;
+
+    _journal.path = g_strdup(path);
+    _journal.interval = (gint64)(commit_interval ? commit_interval : JOURNAL_DEFAULT_INTERVAL) * 1000;
+    _journal.sync = sync;
+    _journal.segment_size = segment_size;
+
+    if (_journal_open_segment() != 0) {
+        g_free(_journal.path);
+        _journal.path = NULL;
+        return 1;
+    }
+
+    _journal.stats.last_seq = _journal_find_last_seq();
+    _journal.next_seq = _journal.stats.last_seq + 1;
+    _journal.buffered_seq = _journal.durable_seq = _journal.stats.last_seq;
+    _journal.buffer = g_string_sized_new(JOURNAL_FLUSH_THRESHOLD);
+    _journal.stop = FALSE;
+    g_mutex_init(&_journal.lock);
+    g_cond_init(&_journal.wakeup);
+    g_cond_init(&_journal.committed);
+
+    _journal.thread = g_thread_new("Journal", _journal_writer_proc, NULL);
+    log_log("journal: continuing at sequence %" G_GUINT64_FORMAT "\n", _journal.next_seq);
+
+    return 0;
+}
+
+gint journal_append(CIDataSet *set)
+{
+    gchar line[JOURNAL_LINE_SIZE];
+    CIJournalCommit *commit;
+    guint64 seq;
+    gboolean first;
+    gint len, rc;
+
+    if (set == NULL || _journal.path == NULL)
+        return 1;
+
+    len = snprintf(line, JOURNAL_LINE_SIZE,
+            "%s" JOURNAL_SEPARATOR "\"%s\"" JOURNAL_SEPARATOR "\"%s\"" JOURNAL_SEPARATOR "\"%s\"" JOURNAL_SEPARATOR
+            "%s" JOURNAL_SEPARATOR "\"%s\"" JOURNAL_SEPARATOR "\"%s\"" JOURNAL_SEPARATOR "%s",
+            set->cidsNumberComplete, set->cidsName, set->cidsDate, set->cidsTime, set->cidsMSN,
+            set->cidsAlias, set->cidsService, set->cidsFix);
+    if (len < 0 || len >= JOURNAL_LINE_SIZE)
+        return 1;
+
+    g_mutex_lock(&_journal.lock);
+    if (_journal.stop) {
+        g_mutex_unlock(&_journal.lock);
+        return 1;
+    }
+    seq = _journal.next_seq++;
+    first = _journal.buffer->len == 0;
+    if (first)
+        _journal.commit_at = g_get_monotonic_time() + _journal.interval;
+    g_string_append_printf(_journal.buffer, "#%" G_GUINT64_FORMAT JOURNAL_SEPARATOR "%08x" JOURNAL_SEPARATOR,
+            seq, journal_crc32(line, (gsize)len));
+    g_string_append_len(_journal.buffer, line, len);
+    g_string_append_c(_journal.buffer, '\n');
+    _journal.buffered_seq = seq;
+    _journal.stats.last_seq = seq;
+    ++_journal.stats.records;
+
+    /* a record behind a failed commit is not known to be on disk */
+    rc = _journal.failing ? 1 : 0;
+
+    if (_journal.sync == JournalSyncAlways) {
+        /* every appender waiting here shares the next commit */
+        if (_journal.commit == NULL)
+            _journal.commit = g_malloc0(sizeof(CIJournalCommit));
+        commit = _journal.commit;
+        ++commit->refcount;
+        _journal.urgent = TRUE;
+        g_cond_signal(&_journal.wakeup);
+        while (!commit->done)
+            g_cond_wait(&_journal.committed, &_journal.lock);
+        rc = commit->rc;
+        _journal_commit_unref(commit);
+    }
+    else if (first || _journal.buffer->len >= JOURNAL_FLUSH_THRESHOLD) {
+        /* start the commit timer or write early */
+        g_cond_signal(&_journal.wakeup);
+    }
+    g_mutex_unlock(&_journal.lock);
+
+    return rc;
+}
+
+void journal_get_stats(CIJournalStats *stats)
+{
+    if (stats == NULL)
+        return;
+    if (_journal.path == NULL) {
+        memset(stats, 0, sizeof(CIJournalStats));
+        return;
+    }
+
+    g_mutex_lock(&_journal.lock);
+    memcpy(stats, &_journal.stats, sizeof(CIJournalStats));
+    g_mutex_unlock(&_journal.lock);
+}
+
+/* Writes whatever is still buffered before closing the journal. */
+void journal_cleanup(void)
+{
+    if (_journal.path == NULL)
+        return;
+
+    g_mutex_lock(&_journal.lock);
+    _journal.stop = TRUE;
+    g_cond_signal(&_journal.wakeup);
+    g_mutex_unlock(&_journal.lock);
+    g_thread_join(_journal.thread);
+    _journal.thread = NULL;
+
+    if (_journal.fd != -1) {
+        if (_journal.sync == JournalSyncNone && fdatasync(_journal.fd) != 0)
+            log_log("journal: fdatasync failed: %d (%s)\n", errno, strerror(errno));
+        close(_journal.fd);
+        _journal.fd = -1;
+    }
+    log_log("journal: %" G_GUINT64_FORMAT " records in %" G_GUINT64_FORMAT " commits\n",
+            _journal.stats.records, _journal.stats.commits);
+
+    g_string_free(_journal.buffer, TRUE);
+    _journal.buffer = NULL;
+    g_cond_clear(&_journal.committed);
+    g_cond_clear(&_journal.wakeup);
+    g_mutex_clear(&_journal.lock);
+    g_free(_journal.path);
+    _journal.path = NULL;
+}
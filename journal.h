@@ -0,0 +1,38 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <glib.h>
+#include "CIData.h"
+
+/* Each journal line is
+ *   #<seq>§<crc32>§<number>§"<name>"§"<date>"§"<time>"§<msn>§"<alias>"§"<service>"§<fix>
+ * where the crc32 (8 hex digits) covers everything after the second separator.
+ * Lines without the #<seq>§<crc32>§ prefix were written by older versions. */
+
+#define JOURNAL_SEPARATOR       "\xc2\xa7"  /* § in utf-8 */
+
+typedef enum {
+    JournalSyncNone = 0,        /* leave it to the kernel */
+    JournalSyncInterval,        /* fdatasync after every group commit */
+    JournalSyncAlways           /* journal_append returns after the record is on disk */
+} CIJournalSync;
+
+typedef struct _CIJournalStats {
+    guint64 records;
+    guint64 commits;            /* writes of a group of records */
+    guint64 syncs;
+    guint64 rotations;
+    guint64 errors;
+    guint64 last_seq;
+} CIJournalStats;
+
+gint journal_init(const gchar *path, guint commit_interval, CIJournalSync sync, guint64 segment_size);
+/* non-zero if the record (or, unless JournalSyncAlways, an earlier one) did not reach the disk */
+gint journal_append(CIDataSet *set);
+void journal_get_stats(CIJournalStats *stats);
+void journal_cleanup(void);
+
+CIJournalSync journal_sync_from_string(const gchar *str);
+guint32 journal_crc32(const gchar *data, gsize len);
+
+#endif
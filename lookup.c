@@ -24,6 +24,8 @@
 #include "logging.h"
 #include "config.h"
 
+#define LOOKUP_DEFAULT_TIMEOUT       10   /**< seconds until an online lookup is aborted */
+
 gint cidb_init(void);
 gint cidb_connect(gchar *dbpath);
 void cidb_cleanup(void);
@@ -43,6 +45,7 @@ gint cirlw_get_caller(gulong sourceid, CICaller *caller);
 
 /*global db-handle*/
 sqlite3 *_cidb_db = NULL;       /**< global handle to the database connection */
+GMutex _cidb_lock;              /**< serializes access to the cache from the lookup workers */
 /*prepared statements*/
 sqlite3_stmt *_cidb_find_number_cache_stmt = NULL;  /**< prepared statement to find a number in the cache */
 
@@ -79,6 +82,13 @@ gint cidb_connect(gchar *dbpath)
         return 1;
     }
 
+    sql = "create index if not exists callercache_number on callercache(number);";
+    rc = sqlite3_exec(_cidb_db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_close(_cidb_db);
+        return 1;
+    }
+
     sql = "select name, city, street, postalcode from callercache where number=? limit 1;";
     rc = sqlite3_prepare_v2(_cidb_db, sql, strlen(sql), &_cidb_find_number_cache_stmt, NULL);
     if (rc != SQLITE_OK) {
@@ -115,6 +125,7 @@ gint cidb_find_caller(CICaller *caller)
     if (!caller)
         return 1;
 
+    g_mutex_lock(&_cidb_lock);
     /*find in cache*/
     rc = sqlite3_bind_text(_cidb_find_number_cache_stmt, 1, caller->NumberComplete, strlen(caller->NumberComplete), SQLITE_TRANSIENT);
     if (rc == SQLITE_OK) {
@@ -142,6 +153,7 @@ gint cidb_find_caller(CICaller *caller)
         }
         sqlite3_reset(_cidb_find_number_cache_stmt);
     }
+    g_mutex_unlock(&_cidb_lock);
 
     if (found) {
         return 0;
@@ -168,7 +180,9 @@ gint cidb_insert_caller(CICaller *caller)
     sql = sqlite3_mprintf("insert into %s (number, name, city, street, postalcode, comment, category) values (%Q,%Q,%Q,%Q,%Q,%Q,%d)",
                           "callercache",
                           caller->NumberComplete, caller->Name, caller->City, caller->Street, caller->PostalCode, NULL, 0);
+    g_mutex_lock(&_cidb_lock);
     rc = sqlite3_exec(_cidb_db, sql, NULL, NULL, NULL);
+    g_mutex_unlock(&_cidb_lock);
     sqlite3_free(sql);
     if (rc != SQLITE_OK) {
         return 1;
@@ -228,16 +242,15 @@ typedef struct _CIRLSource {
 } CIRLSource;
 
 GSList *_cirl_sources = NULL;   /**< list of online sources */
-CURL *_cirl_curl = NULL;        /**< handle for curl */
 
 /** @brief initialize the internet reverse lookup system
+ *
+ *  Every lookup uses its own curl handle so that several lookups may run in parallel.
  *  @return 0 on success, 1 if an error occured
  */
 gint cirlw_init(void)
 {
-    curl_global_init(CURL_GLOBAL_ALL);
-    _cirl_curl = curl_easy_init();
-    if (!_cirl_curl) {
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
         return 1;
     }
 
@@ -248,10 +261,6 @@ gint cirlw_init(void)
  */
 void cirlw_cleanup(void)
 {
-    if (_cirl_curl) {
-        curl_easy_cleanup(_cirl_curl);
-        _cirl_curl = NULL;
-    }
     curl_global_cleanup();
 
     /* clear list */
@@ -441,9 +450,7 @@ typedef struct _DynMem {
 
 size_t _cirlw_read_data(void *ptr, size_t size, size_t nmemb, void *stream);
 gchar *_cirlw_prepare_url(gchar *url, CICaller *caller);
-gint _cirlw_match_patterns(CIRLSource *source, CICaller *caller, gulong *found);
-
-DynMem _cirlw_memory; /**< @internal handle to the memory */
+gint _cirlw_match_patterns(CIRLSource *source, DynMem *memory, CICaller *caller, gulong *found);
 
 /** @internal
  *  @brief callback function to read data from the web to a buffer
@@ -579,11 +586,12 @@ void _cirlw_remove_escapes(gchar *str)
 /** @internal
  *  @brief match the patterns in given source and fill in the caller data
  *  @param[in] source the source where the data should be searched
+ *  @param[in] memory the page received from the source
  *  @param[out] caller structure containing all data
  *  @param[out] found bitfield describing the fields filled in
  *  @return 0 on success
  */
-gint _cirlw_match_patterns(CIRLSource *source, CICaller *caller, gulong *found)
+gint _cirlw_match_patterns(CIRLSource *source, DynMem *memory, CICaller *caller, gulong *found)
 {
     guint npat = g_slist_length(source->patterns);
     gint err = 0;
@@ -615,7 +623,7 @@ gint _cirlw_match_patterns(CIRLSource *source, CICaller *caller, gulong *found)
     }
     reg[npat] = g_regex_new("[C|c][H|h][A|a][R|r][S|s][E|e][T|t]\\s*=\\s*([A-Za-z0-9-]+)", G_REGEX_RAW, 0, NULL);
     if (source->split_lines) {
-        lines = g_strsplit(_cirlw_memory.mem, "\n", 0);
+        lines = memory->mem ? g_strsplit(memory->mem, "\n", 0) : NULL;
         if (!lines) {
             err = 1;
         }
@@ -716,6 +724,7 @@ gint _cirlw_match_patterns(CIRLSource *source, CICaller *caller, gulong *found)
  */
 gint cirlw_get_caller(gulong sourceid, CICaller *caller)
 {
+    const Fritz2CIConfig *cfg = config_get_config();
     CIRLSource *source = _cirlw_find_source(sourceid);
     gint err = 0;
     if (!source)
@@ -725,29 +734,33 @@ gint cirlw_get_caller(gulong sourceid, CICaller *caller)
         return 1;
 
     CURLcode res;
+    CURL *curl;
+    DynMem memory;
 
-    if (!_cirl_curl) {
+    if ((curl = curl_easy_init()) == NULL) {
         g_free(url);
         return 1;
     }
 
     /* init mem */
-    memset(&_cirlw_memory, 0, sizeof(DynMem));
-
-    curl_easy_setopt(_cirl_curl, CURLOPT_URL, url);
-    curl_easy_setopt(_cirl_curl, CURLOPT_WRITEFUNCTION, _cirlw_read_data);
-    curl_easy_setopt(_cirl_curl, CURLOPT_WRITEDATA, &_cirlw_memory);
-    curl_easy_setopt(_cirl_curl, CURLOPT_USERAGENT, "Mozilla/5.0");
-    curl_easy_setopt(_cirl_curl, CURLOPT_CONV_FROM_NETWORK_FUNCTION, NULL);
-    curl_easy_setopt(_cirl_curl, CURLOPT_CONV_TO_NETWORK_FUNCTION, NULL);
+    memset(&memory, 0, sizeof(DynMem));
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _cirlw_read_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &memory);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0");
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)(cfg->lookup_timeout ? cfg->lookup_timeout : LOOKUP_DEFAULT_TIMEOUT));
+    curl_easy_setopt(curl, CURLOPT_CONV_FROM_NETWORK_FUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_CONV_TO_NETWORK_FUNCTION, NULL);
     /*  printf("CURL_ICONV_CODESET_OF_HOST: %s\nCURL_ICONV_CODESET_OF_NETWORK: %s\nCURL_ICONV_CODESET_FOR_UTF8: %s\n",
         CURL_ICONV_CODESET_OF_HOST, CURL_ICONV_CODESET_OF_NETWORK, CURL_ICONV_CODESET_FOR_UTF8);*/
-    res = curl_easy_perform(_cirl_curl);
-
+    res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
 
     if (res == CURLE_OK) {
         gulong found = 0;
-        err = _cirlw_match_patterns(source, caller, &found);
+        err = _cirlw_match_patterns(source, &memory, caller, &found);
         if (found == 0)
             err = 4;
     }
@@ -755,7 +768,7 @@ gint cirlw_get_caller(gulong sourceid, CICaller *caller)
         err = 1;
     }
 
-    g_free(_cirlw_memory.mem);
+    g_free(memory.mem);
     g_free(url);
     return err;
 }
@@ -799,9 +812,26 @@ gint lookup_get_caller_data(CIDataSet *cidata)
         log_log("found: %s\n", caller->Name);
         strcpy(cidata->cidsName, caller->Name);
     }
+    g_free(caller);
     return !(found);
 }
 
+/* Like lookup_get_caller_data, but never asks an online source. */
+gint lookup_get_cached_caller_data(CIDataSet *cidata)
+{
+    CICaller caller;
+
+    if (!cidata)
+        return 1;
+    memset(&caller, 0, sizeof(CICaller));
+    g_strlcpy(caller.NumberComplete, cidata->cidsNumberComplete, sizeof(caller.NumberComplete));
+    if (cidb_find_caller(&caller) != 0)
+        return 1;
+
+    g_strlcpy(cidata->cidsName, caller.Name, sizeof(cidata->cidsName));
+    return 0;
+}
+
 void lookup_cleanup(void)
 {
     cidb_cleanup();
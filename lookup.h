@@ -6,6 +6,7 @@
 
 gint lookup_init(gchar *lookup_sources, gchar *lookup_cache);
 gint lookup_get_caller_data(CIDataSet *cidata);
+gint lookup_get_cached_caller_data(CIDataSet *cidata);
 void lookup_cleanup(void);
 
 #endif
\ No newline at end of file
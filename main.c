@@ -1,5 +1,6 @@
 #include <glib.h>
 #include <glib-object.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -10,7 +11,12 @@
 #include "config.h"
 #include "ci-server.h"
 #include "fritz.h"
+#include "callqueue.h"
+#include "callproc.h"
 #include "dbhandler.h"
+#include "dbspool.h"
+#include "journal.h"
+#include "replay.h"
 #include "lookup.h"
 #include "ci_areacodes.h"
 #include "msn_lookup.h"
@@ -20,19 +26,20 @@
 
 void _shutdown(void);
 void _handle_signal(int signum);
+gboolean _log_stats(gpointer data);
 
-void handle_fritz_message(CIFritzCallMsg *cmsg);
-void backup_data_write(CIDataSet *set);
+void queue_fritz_message(CIFritzCallMsg *cmsg);
+gint replay_journals(const Fritz2CIConfig *cfg);
 
 GMainLoop *mainloop = NULL;
 /*GMainContext * context = NULL;*/
-GQueue *_db_data_todo = NULL;
-static GMutex _db_data_queue_lock;
 
 int main(int argc, char **argv)
 {
     pid_t daemon_pid;
     struct sigaction _sgn;
+    gsize i;
+    gint rc;
 
 #if !GLIB_CHECK_VERSION(2,36,0)
     g_type_init();
@@ -52,6 +59,12 @@ int main(int argc, char **argv)
     log_set_log_file(cfg->log_file);
     log_log("loaded configuration\n");
 
+    if (cfg->replay_journals) {
+        rc = replay_journals(cfg);
+        config_free();
+        return rc;
+    }
+
     if (cfg->daemon) {
         daemon_pid = start_daemon(argv[0], cfg->pid_file);
         if (daemon_pid == -1) {
@@ -65,21 +78,34 @@ int main(int argc, char **argv)
         }
     }
 
-    _db_data_todo = g_queue_new();
-
-    if (fritz_init((gchar *)cfg->fritz_host, cfg->fritz_port) != 0) {
+    if (fritz_init() != 0) {
         log_log("Could not initialize fritz\n");
         _shutdown();
         return 1;
     }
-    else {
-        log_log("initialized fritz\n");
+    for (i = 0; i < cfg->fritz_box_count; ++i) {
+        if (fritz_add_box(cfg->fritz_boxes[i].name, cfg->fritz_boxes[i].host, cfg->fritz_boxes[i].port) != 0) {
+            log_log("Could not add fritz box %s\n", cfg->fritz_boxes[i].name);
+            _shutdown();
+            return 1;
+        }
+    }
+    log_log("initialized fritz\n");
+    if (callq_init(cfg->call_queue_size, callproc_handle_message) != 0) {
+        log_log("Could not initialize call queue\n");
+        _shutdown();
+        return 1;
     }
     if (cisrv_init() != 0) {
         log_log("Could not initialize ci-server\n");
         _shutdown();
         return 1;
     }
+    cisrv_set_client_limits(cfg->ci2_high_watermark, cfg->ci2_low_watermark,
+            cisrv_slow_policy_from_string(cfg->ci2_slow_client_policy), cfg->ci2_grace_period);
+    cisrv_set_db_workers(cfg->ci2_db_workers);
+    cisrv_set_connection_limits(cfg->ci2_backlog, cfg->ci2_max_clients);
+    cisrv_set_replay_size(cfg->ci2_replay_events);
     log_log("initialized cisrv\n");
 
     if (dbhandler_init(cfg->db_location) != 0) {
@@ -88,6 +114,22 @@ int main(int argc, char **argv)
     else {
         log_log("initialized dbhandler\n");
     }
+    if (!cfg->data_backup_location) {
+        log_log("No backup file specified\n");
+    }
+    else if (journal_init(cfg->data_backup_location, cfg->journal_commit_interval,
+                journal_sync_from_string(cfg->journal_sync), cfg->journal_segment_size) != 0) {
+        log_log("Could not open journal\n");
+    }
+    else {
+        log_log("initialized journal\n");
+    }
+    if (dbspool_init(cfg->db_spool_location) != 0 || dbspool_startup() != 0) {
+        log_log("Could not open database spool, calls are lost while the database fails\n");
+    }
+    else {
+        log_log("initialized database spool\n");
+    }
     if (lookup_init(cfg->lookup_sources_location, cfg->cache_location) != 0) {
         log_log("Could not initialize lookup\n");
         _shutdown();
@@ -110,7 +152,19 @@ int main(int argc, char **argv)
     }
     log_log("started ci srv\n");
 
-    if (fritz_startup(handle_fritz_message) != 0) {
+    if (callproc_init() != 0) {
+        log_log("Could not initialize call processing\n");
+        _shutdown();
+        return 1;
+    }
+
+    if (callq_startup() != 0) {
+        log_log("Could not start call processing\n");
+        _shutdown();
+        return 1;
+    }
+
+    if (fritz_startup(queue_fritz_message) != 0) {
         log_log("failed to listen (fritz)\n");
         return 1;
     }
@@ -133,8 +187,11 @@ int main(int argc, char **argv)
     _sgn.sa_handler = _handle_signal;
     sigaction(SIGINT, &_sgn, NULL);
     sigaction(SIGTERM, &_sgn, NULL);
+    /* kill -USR1 logs the counters of the running daemon */
+    g_unix_signal_add(SIGUSR1, _log_stats, NULL);
 
     g_main_loop_run(mainloop);
+    _log_stats(NULL);
     log_log("terminating, call shutdown\n");
     _shutdown();
     return 0;
@@ -142,25 +199,23 @@ int main(int argc, char **argv)
 
 void _shutdown(void)
 {
-    ci_free_area_codes();
     fritz_shutdown();
+    callq_shutdown();
+    callproc_shutdown();
+    dbspool_shutdown();
     cisrv_disconnect();
 
     msnl_cleanup();
     fritz_cleanup();
+    callq_cleanup();
+    callproc_cleanup();
+    /* after everything that looks up areas has stopped */
+    ci_free_area_codes();
+    journal_cleanup();
+    dbspool_cleanup();
     dbhandler_cleanup();
     cisrv_cleanup();
     lookup_cleanup();
-    int cnt = 0;
-    CIDataSet *set;
-    while ((set = g_queue_pop_head(_db_data_todo)) != NULL) {
-        g_free((CIDataSet *)set);
-        ++cnt;
-    }
-    g_queue_free(_db_data_todo);
-    if (cnt) {
-        log_log("There were %d sets not written to database\n", cnt);
-    }
 
     config_free();
 
@@ -173,106 +228,97 @@ void _handle_signal(int signum)
     g_main_loop_quit(mainloop);
 }
 
-void generate_msg_id(gchar *id)
+/* Runs in the main loop on SIGUSR1 and once before shutting down. */
+gboolean _log_stats(gpointer data)
 {
-    if (id == NULL)
-        return;
-    struct timeval tv;
-    struct tm *tm;
-
-    gettimeofday(&tv, NULL);
-    tm = localtime(&tv.tv_sec);
+    CIDbSpoolStats spool;
+    CIJournalStats journal;
+    CIServerStats server;
+    CIPipelineStageStats stage;
+    CIFritzReaderStats reader;
+    const Fritz2CIConfig *cfg = config_get_config();
+    CICallProcStage i;
+    gsize box;
+
+    dbspool_get_stats(&spool);
+    log_log("stats: spool: %u pending, %" G_GUINT64_FORMAT " spooled, %" G_GUINT64_FORMAT " flushed in %"
+            G_GUINT64_FORMAT " batches, %" G_GUINT64_FORMAT " retries, %" G_GUINT64_FORMAT " rejected\n",
+            spool.pending, spool.spooled, spool.flushed, spool.batches, spool.retries, spool.rejected);
+    journal_get_stats(&journal);
+    log_log("stats: journal: %" G_GUINT64_FORMAT " records in %" G_GUINT64_FORMAT " commits, %" G_GUINT64_FORMAT
+            " syncs, %" G_GUINT64_FORMAT " rotations, %" G_GUINT64_FORMAT " errors, last sequence %"
+            G_GUINT64_FORMAT "\n", journal.records, journal.commits, journal.syncs, journal.rotations,
+            journal.errors, journal.last_seq);
+    for (box = 0; box < cfg->fritz_box_count; ++box) {
+        if (fritz_get_reader_stats(cfg->fritz_boxes[box].name, &reader) != 0)
+            continue;
+        log_log("stats: fritz[%s]: %" G_GUINT64_FORMAT " reads, %" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+                " records, %" G_GUINT64_FORMAT " carry-overs, %" G_GUINT64_FORMAT " overflows\n",
+                cfg->fritz_boxes[box].name, reader.reads, reader.bytes, reader.records, reader.carry_overs,
+                reader.overflows);
+    }
+    cisrv_get_stats(&server);
+    log_log("stats: ci server: %u clients, %u congested, %" G_GUINT64_FORMAT " evicted, %" G_GUINT64_FORMAT
+            " disconnected, %" G_GUINT64_FORMAT " replayed\n", server.clients, server.congested,
+            server.evicted, server.disconnected, server.replayed);
+    for (i = 0; i < CallProcStageCount; ++i) {
+        if (callproc_get_stage_stats(i, &stage) != 0)
+            continue;
+        log_log("stats: stage %s: %u queued of %u, %" G_GUINT64_FORMAT " processed, %" G_GUINT64_FORMAT
+                " stalls, wait max %" G_GUINT64_FORMAT " us, run max %" G_GUINT64_FORMAT " us\n",
+                callproc_get_stage_name(i), stage.queued, stage.max_queue, stage.processed, stage.stalls,
+                stage.wait_max, stage.run_max);
+    }
 
-    strftime(id, 16, "%y%m%d%H%M%S", tm);
-    snprintf(&id[12], 4, "%03d", (unsigned int)(((unsigned long)tv.tv_usec)/1000)%1000);
+    return TRUE;
 }
 
-void handle_fritz_message(CIFritzCallMsg *cmsg)
+/* --replay-journal: rebuild the call database from journal files */
+gint replay_journals(const Fritz2CIConfig *cfg)
 {
-    log_log("handle_fritz_message\n");
-    int rc;
-    int dbrc;
-    if (!cmsg) {
-        return;
+    CIReplayStats stats;
+    gint rc;
+
+    if (dbhandler_init(cfg->db_location) != 0) {
+        fprintf(stderr, "Could not open database %s\n", cfg->db_location);
+        return 1;
     }
-    if (cmsg->msgtype != CALLMSGTYPE_CALL && cmsg->msgtype != CALLMSGTYPE_RING) {
-        return;
+    ci_init_area_codes();
+    if (ci_read_area_codes_from_file(cfg->areacodes_location) != 0) {
+        log_log("Could not read area codes, replaying without\n");
     }
-
-    gchar msgid[16];
-
-    CIDataSet set;
-    CIDataSet *todo = NULL;
-    memset(&set, 0, sizeof(CIDataSet));
-
-    if (cmsg->msgtype == CALLMSGTYPE_RING) {
-        generate_msg_id(msgid);
-        log_log("generate msg id: %s\n", msgid);
-
-        strftime(set.cidsTime, 16, "%H:%M:%S", &cmsg->datetime);
-        strcpy(set.cidsNumberComplete, cmsg->calling_number);
-        strcpy(set.cidsMSN, cmsg->called_number);
-        strcpy(set.cidsService, "Telefonie");
-        strcpy(set.cidsFix, "Fix");
-        ci_get_area_code(set.cidsNumberComplete, set.cidsAreaCode, set.cidsNumber, set.cidsArea);
-        strcpy(set.cidsName, set.cidsArea);
-        msnl_lookup(set.cidsMSN, set.cidsAlias);
-        strftime(set.cidsDate, 16, "%d.%m.%Y", &cmsg->datetime);
-        backup_data_write(&set);
-        strftime(set.cidsDate, 16, "%Y-%m-%d", &cmsg->datetime);
-        cisrv_broadcast_message(CIServerMsgMessage, &set, msgid);
-
-        rc = lookup_get_caller_data(&set);
-        g_mutex_lock(&_db_data_queue_lock);
-        if (g_queue_is_empty(_db_data_todo)) {
-            if ((dbrc = dbhandler_add_data(&set)) != 0) { /* send or receive failed, init reconnect */
-                log_log("add data failed\n");
-                todo = g_malloc0(sizeof(CIDataSet));
-                memcpy(todo, &set, sizeof(CIDataSet));
-                g_queue_push_tail(_db_data_todo, (gpointer)todo);
-            }
-        }
-        else {
-            todo = g_malloc0(sizeof(CIDataSet));
-            memcpy(todo, &set, sizeof(CIDataSet));
-            g_queue_push_tail(_db_data_todo, (gpointer)todo);
-        }
-        g_mutex_unlock(&_db_data_queue_lock);
-
-        if (rc == 0) {
-            cisrv_broadcast_message(CIServerMsgUpdate, &set, msgid);
-        }
-        cisrv_broadcast_message(CIServerMsgComplete, &set, msgid);
+    if (msnl_read_file(cfg->msn_lookup_location) != 0) {
+        log_log("Could not open msn lookup file, replaying without\n");
+    }
+    if (lookup_init(cfg->lookup_sources_location, cfg->cache_location) != 0) {
+        log_log("Could not initialize lookup, replaying without caller cache\n");
     }
-    else if (cmsg->msgtype == CALLMSGTYPE_CALL) {
-        strftime(set.cidsTime, 16, "%H:%M:%S", &cmsg->datetime);
-        strftime(set.cidsDate, 16, "%Y-%m-%d", &cmsg->datetime);
-        strcpy(set.cidsNumberComplete, cmsg->called_number);
-        strcpy(set.cidsMSN, cmsg->calling_number);
-        msnl_lookup(set.cidsMSN, set.cidsAlias);
 
-        log_log("CALL: %s %s \"%s\" \"%s\" \"%s\"\n", set.cidsTime, set.cidsDate,
-                set.cidsNumberComplete, set.cidsMSN, set.cidsAlias);
+    rc = replay_journal_files(cfg->replay_journals, &stats);
+    printf("replayed %" G_GUINT64_FORMAT " rows from %" G_GUINT64_FORMAT " lines "
+           "(%" G_GUINT64_FORMAT " corrupt, %" G_GUINT64_FORMAT " malformed, %" G_GUINT64_FORMAT " failed) "
+           "in %.2f s, %.0f rows/s\n",
+           stats.rows, stats.lines, stats.corrupt, stats.malformed, stats.failed, stats.seconds,
+           stats.seconds > 0 ? stats.rows / stats.seconds : 0.0);
 
-        cisrv_broadcast_message(CIServerMsgCall, &set, NULL);
-    }
+    lookup_cleanup();
+    msnl_cleanup();
+    ci_free_area_codes();
+    dbhandler_cleanup();
+
+    return rc;
 }
 
-void backup_data_write(CIDataSet *set)
+/* Runs on the fritz listener thread; everything slow happens in the call processing stages. */
+void queue_fritz_message(CIFritzCallMsg *cmsg)
 {
-    FILE *f;
-    const Fritz2CIConfig *cfg = config_get_config();
-    if (!cfg->data_backup_location) {
-        log_log("No backup file specified\n");
+    if (!cmsg) {
         return;
     }
-    if ((f = fopen(cfg->data_backup_location, "a")) == NULL) {
-        log_log("Error opening backup file `%s'\n", cfg->data_backup_location);
+    if (cmsg->msgtype != CALLMSGTYPE_CALL && cmsg->msgtype != CALLMSGTYPE_RING) {
         return;
     }
-    fprintf(f, "%s§\"%s\"§\"%s\"§\"%s\"§%s§\"%s\"§\"%s\"§%s\n", set->cidsNumberComplete,
-            set->cidsName, set->cidsDate, set->cidsTime, set->cidsMSN, set->cidsAlias,
-            set->cidsService, set->cidsFix);
-    fclose(f);
-    log_log("written backup\n");
+    if (callq_push(cmsg) != 0) {
+        log_log("call queue full, dropping event from box %s\n", cmsg->box);
+    }
 }
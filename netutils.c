@@ -9,6 +9,34 @@
 #include "logging.h"
 #include <stdarg.h>
 #include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+#define NETUTIL_REACTOR_MAX_EVENTS       64
+
+struct _NetutilReactorSource {
+    int fd;
+    guint32 events;
+    gint removed;
+    gboolean is_timer;
+    NetutilReactorHandler handler;
+    NetutilReactorTimerHandler timer_handler;
+    gpointer data;
+};
+
+struct _NetutilReactor {
+    int epfd;
+    int eventfd;
+    guint pending_signals;
+    gboolean running;
+    NetutilReactorSignalHandler signal_handler;
+    gpointer signal_data;
+    GMutex garbage_lock;
+    GSList *garbage;
+};
 
 in_addr_t netutil_get_ip_address(const gchar *hostname)
 {
@@ -85,45 +113,47 @@ char *netutil_get_remote_address(int sock)
     return NULL;
 }
 
-int netutil_init_fd_set(fd_set *set, int nfd, ...)
+void netutil_close_fd(int *fd)
 {
-    va_list ap;
-    int i, s, max = -2;
-
-    if (!set)
-        return -1;
-    FD_ZERO(set);
-
-    va_start(ap, nfd);
-    for (i = 0; i < nfd; i++) {
-        s = va_arg(ap, int);
-        if (s >= 0) {
-            FD_SET(s, set);
-            if (max < s) max = s;
-        }
+    if (fd && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
     }
-    va_end(ap);
+}
 
-    return ++max;
+int netutil_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return -1;
+    return 0;
 }
 
-void netutil_close_fd(int *fd)
+/* Raise the soft limit on open files to the hard limit. Returns the new soft limit. */
+rlim_t netutil_raise_fd_limit(void)
 {
-    if (fd && *fd >= 0) {
-        close(*fd);
-        *fd = -1;
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 0;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            log_log("netutil: could not raise file limit: %d (%s)\n", errno, strerror(errno));
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
     }
+    return rl.rlim_cur;
 }
 
 int wait_for_bind(int sock, const struct sockaddr *addr, socklen_t addrlen, int ctrlfd)
 {
     int rc;
-    fd_set set;
+    struct pollfd pfd;
 
     int berr;
 
-    struct timeval timeout;
-
     if (sock < 0) return -1;
 
     while ((rc = bind(sock, addr, addrlen)) != 0) {
@@ -134,11 +164,10 @@ int wait_for_bind(int sock, const struct sockaddr *addr, socklen_t addrlen, int
             return -1;
         }
         if (ctrlfd >= 0) {
-            FD_ZERO(&set);
-            FD_SET(ctrlfd, &set);
-            timeout.tv_sec = 10;
-            timeout.tv_usec = 0;
-            rc = select(ctrlfd+1, &set, NULL, NULL, &timeout);
+            pfd.fd = ctrlfd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            rc = poll(&pfd, 1, 10000);
             if (rc > 0) {
                 log_log("wait_for_bind: control message received.\n");
                 return 1;
@@ -267,3 +296,258 @@ void netutil_cleanup(int nlsock)
     if (nlsock >= 0)
         close(nlsock);
 }
+
+NetutilReactor *netutil_reactor_new(void)
+{
+    struct epoll_event ev;
+    NetutilReactor *reactor = g_malloc0(sizeof(NetutilReactor));
+
+    g_mutex_init(&reactor->garbage_lock);
+    reactor->eventfd = -1;
+
+    if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        log_log("reactor: epoll_create1 failed: %d (%s)\n", errno, strerror(errno));
+        goto err;
+    }
+    if ((reactor->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        log_log("reactor: eventfd failed: %d (%s)\n", errno, strerror(errno));
+        goto err;
+    }
+
+    /* the control eventfd is the only registration without a source */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->eventfd, &ev) != 0)
+        goto err;
+
+    return reactor;
+
+err:
+    netutil_reactor_free(reactor);
+    return NULL;
+}
+
+static
+void _netutil_reactor_collect_garbage(NetutilReactor *reactor)
+{
+    GSList *garbage;
+
+    g_mutex_lock(&reactor->garbage_lock);
+    garbage = reactor->garbage;
+    reactor->garbage = NULL;
+    g_mutex_unlock(&reactor->garbage_lock);
+
+    g_slist_free_full(garbage, g_free);
+}
+
+void netutil_reactor_free(NetutilReactor *reactor)
+{
+    if (!reactor)
+        return;
+    netutil_close_fd(&reactor->eventfd);
+    netutil_close_fd(&reactor->epfd);
+    _netutil_reactor_collect_garbage(reactor);
+    g_mutex_clear(&reactor->garbage_lock);
+    g_free(reactor);
+}
+
+void netutil_reactor_set_signal_handler(NetutilReactor *reactor, NetutilReactorSignalHandler handler, gpointer data)
+{
+    reactor->signal_handler = handler;
+    reactor->signal_data = data;
+}
+
+/* readable whenever a signal is pending */
+int netutil_reactor_get_signal_fd(NetutilReactor *reactor)
+{
+    return reactor ? reactor->eventfd : -1;
+}
+
+NetutilReactorSource *netutil_reactor_add(NetutilReactor *reactor, int fd, guint32 events,
+                                          NetutilReactorHandler handler, gpointer data)
+{
+    struct epoll_event ev;
+    NetutilReactorSource *source;
+
+    if (!reactor || fd < 0)
+        return NULL;
+
+    source = g_malloc0(sizeof(NetutilReactorSource));
+    source->fd = fd;
+    source->events = events;
+    source->handler = handler;
+    source->data = data;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        log_log("reactor: add %d failed: %d (%s)\n", fd, errno, strerror(errno));
+        g_free(source);
+        return NULL;
+    }
+
+    return source;
+}
+
+gint netutil_reactor_modify(NetutilReactor *reactor, NetutilReactorSource *source, guint32 events)
+{
+    struct epoll_event ev;
+
+    if (!reactor || !source)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, source->fd, &ev) != 0)
+        return -1;
+    source->events = events;
+
+    return 0;
+}
+
+/* The source may still be part of the batch being dispatched, so it is only
+ * released once the batch is done. Timer descriptors are closed here, all
+ * other descriptors belong to the caller. */
+void netutil_reactor_remove(NetutilReactor *reactor, NetutilReactorSource *source)
+{
+    if (!reactor || !source)
+        return;
+
+    g_atomic_int_set(&source->removed, 1);
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    if (source->is_timer)
+        netutil_close_fd(&source->fd);
+
+    g_mutex_lock(&reactor->garbage_lock);
+    reactor->garbage = g_slist_prepend(reactor->garbage, source);
+    g_mutex_unlock(&reactor->garbage_lock);
+}
+
+static
+void _netutil_reactor_handle_timer(int fd, guint32 events, NetutilReactorSource *timer)
+{
+    guint64 expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    if (timer->timer_handler)
+        timer->timer_handler(timer->data);
+}
+
+/* the timer is created disarmed */
+NetutilReactorSource *netutil_reactor_add_timer(NetutilReactor *reactor, NetutilReactorTimerHandler handler,
+                                                gpointer data)
+{
+    NetutilReactorSource *timer;
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        log_log("reactor: timerfd_create failed: %d (%s)\n", errno, strerror(errno));
+        return NULL;
+    }
+
+    timer = netutil_reactor_add(reactor, fd, EPOLLIN, NULL, data);
+    if (!timer) {
+        close(fd);
+        return NULL;
+    }
+    timer->is_timer = TRUE;
+    timer->timer_handler = handler;
+
+    return timer;
+}
+
+/* msec == 0 disarms the timer */
+gint netutil_reactor_timer_arm(NetutilReactorSource *timer, guint msec, gboolean repeat)
+{
+    struct itimerspec its;
+
+    if (!timer || !timer->is_timer)
+        return -1;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msec / 1000;
+    its.it_value.tv_nsec = (msec % 1000) * 1000000L;
+    if (repeat)
+        its.it_interval = its.it_value;
+
+    return timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+void netutil_reactor_signal(NetutilReactor *reactor, guint signals)
+{
+    guint64 one = 1;
+
+    if (!reactor || !signals)
+        return;
+
+    g_atomic_int_or(&reactor->pending_signals, signals);
+    if (write(reactor->eventfd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        log_log("reactor: could not signal: %d (%s)\n", errno, strerror(errno));
+}
+
+void netutil_reactor_stop(NetutilReactor *reactor)
+{
+    netutil_reactor_signal(reactor, NETUTIL_REACTOR_SIGNAL_STOP);
+}
+
+static
+void _netutil_reactor_handle_signals(NetutilReactor *reactor)
+{
+    guint64 count;
+    guint signals;
+
+    if (read(reactor->eventfd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    signals = g_atomic_int_and(&reactor->pending_signals, 0);
+    if (signals & NETUTIL_REACTOR_SIGNAL_STOP)
+        reactor->running = FALSE;
+    signals &= ~NETUTIL_REACTOR_SIGNAL_STOP;
+    if (signals && reactor->signal_handler)
+        reactor->signal_handler(signals, reactor->signal_data);
+}
+
+/* Dispatch until netutil_reactor_stop() is called. */
+gint netutil_reactor_run(NetutilReactor *reactor)
+{
+    struct epoll_event events[NETUTIL_REACTOR_MAX_EVENTS];
+    NetutilReactorSource *source;
+    int n, i;
+
+    if (!reactor)
+        return -1;
+
+    reactor->running = TRUE;
+    while (reactor->running) {
+        n = epoll_wait(reactor->epfd, events, NETUTIL_REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_log("reactor: epoll_wait failed: %d (%s)\n", errno, strerror(errno));
+            reactor->running = FALSE;
+            return -1;
+        }
+
+        for (i = 0; i < n; ++i) {
+            source = (NetutilReactorSource *)events[i].data.ptr;
+            if (source == NULL) {
+                _netutil_reactor_handle_signals(reactor);
+                continue;
+            }
+            if (g_atomic_int_get(&source->removed))
+                continue;
+            if (source->is_timer)
+                _netutil_reactor_handle_timer(source->fd, events[i].events, source);
+            else if (source->handler)
+                source->handler(source->fd, events[i].events, source->data);
+        }
+
+        _netutil_reactor_collect_garbage(reactor);
+    }
+
+    return 0;
+}
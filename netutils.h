@@ -8,14 +8,17 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <glib.h>
 
 in_addr_t netutil_get_ip_address(const gchar *hostname);
 int netutil_get_interface_from_sock(int sock, int *ifindex, char *ifname);
 char *netutil_get_remote_address(int sock);
 
-int netutil_init_fd_set(fd_set *set, int nfd, ...);
 void netutil_close_fd(int *fd);
+int netutil_set_nonblocking(int fd);
+rlim_t netutil_raise_fd_limit(void);
 
 int wait_for_bind(int sock, const struct sockaddr *addr, socklen_t addrlen, int ctrlfd);
 
@@ -30,4 +33,41 @@ int netutil_init_netlink(void);
 void netutil_handle_netlink_message(int nlsock, NetutilCallbacks *cb, void *data);
 void netutil_cleanup(int nlsock);
 
+/* epoll based reactor
+ *
+ * Handlers are stored with their registration, so dispatching does not
+ * depend on the number of registered descriptors. Sources may be added and
+ * modified from any thread; removal has to happen on the thread running the
+ * reactor or while it is not running. Control signals are delivered through
+ * an eventfd, timers are backed by timerfds.
+ */
+#define NETUTIL_REACTOR_SIGNAL_STOP          (1 << 0)
+/* first bit available to users of the reactor */
+#define NETUTIL_REACTOR_SIGNAL_USER          (1 << 1)
+
+typedef struct _NetutilReactor NetutilReactor;
+typedef struct _NetutilReactorSource NetutilReactorSource;
+
+typedef void (*NetutilReactorHandler)(int fd, guint32 events, gpointer data);
+typedef void (*NetutilReactorTimerHandler)(gpointer data);
+typedef void (*NetutilReactorSignalHandler)(guint signals, gpointer data);
+
+NetutilReactor *netutil_reactor_new(void);
+void netutil_reactor_free(NetutilReactor *reactor);
+void netutil_reactor_set_signal_handler(NetutilReactor *reactor, NetutilReactorSignalHandler handler, gpointer data);
+int netutil_reactor_get_signal_fd(NetutilReactor *reactor);
+
+NetutilReactorSource *netutil_reactor_add(NetutilReactor *reactor, int fd, guint32 events,
+                                          NetutilReactorHandler handler, gpointer data);
+gint netutil_reactor_modify(NetutilReactor *reactor, NetutilReactorSource *source, guint32 events);
+void netutil_reactor_remove(NetutilReactor *reactor, NetutilReactorSource *source);
+
+NetutilReactorSource *netutil_reactor_add_timer(NetutilReactor *reactor, NetutilReactorTimerHandler handler,
+                                                gpointer data);
+gint netutil_reactor_timer_arm(NetutilReactorSource *timer, guint msec, gboolean repeat);
+
+void netutil_reactor_signal(NetutilReactor *reactor, guint signals);
+void netutil_reactor_stop(NetutilReactor *reactor);
+gint netutil_reactor_run(NetutilReactor *reactor);
+
 #endif
@@ -0,0 +1,177 @@
+#include "pipeline.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory.h>
+#include "logging.h"
+
+typedef struct _CIPipelineItem {
+    gpointer data;
+    gint64 queued_at;
+} CIPipelineItem;
+
+struct _CIPipelineStage {
+    gchar *name;
+    CIPipelineFunc func;
+    gpointer userdata;
+    GThreadPool *pool;
+    GMutex lock;
+    GCond space;
+    CIPipelineStageStats stats;
+};
+
+static
+void _pipeline_stage_worker(CIPipelineItem *item, CIPipelineStage *stage)
+{
+    gint64 start, end;
+    guint64 wait, run;
+
+    start = g_get_monotonic_time();
+    wait = (guint64)(start - item->queued_at);
+
+    g_mutex_lock(&stage->lock);
+    --stage->stats.queued;
+    g_cond_signal(&stage->space);
+    g_mutex_unlock(&stage->lock);
+
+    stage->func(item->data, stage->userdata);
+
+    end = g_get_monotonic_time();
+    run = (guint64)(end - start);
+
+    g_mutex_lock(&stage->lock);
+    ++stage->stats.processed;
+    stage->stats.wait_total += wait;
+    if (wait > stage->stats.wait_max)
+        stage->stats.wait_max = wait;
+    stage->stats.run_total += run;
+    if (run > stage->stats.run_max)
+        stage->stats.run_max = run;
+    g_mutex_unlock(&stage->lock);
+
+    g_free(item);
+}
+
+CIPipelineStage *pipeline_stage_new(const gchar *name, CIPipelineFunc func, gpointer userdata,
+                                    guint workers, guint max_queue)
+{
+    CIPipelineStage *stage;
+    GError *err = NULL;
+
+    if (func == NULL)
+        return NULL;
+
+    stage = g_malloc0(sizeof(CIPipelineStage));
+    stage->name = g_strdup(name ? name : "stage");
+    stage->func = func;
+    stage->userdata = userdata;
+    stage->stats.workers = workers > 0 ? workers : 1;
+    stage->stats.max_queue = max_queue > 0 ? max_queue : 1;
+    g_mutex_init(&stage->lock);
+    g_cond_init(&stage->space);
+
+    stage->pool = g_thread_pool_new((GFunc)_pipeline_stage_worker, stage,
+                                    (gint)stage->stats.workers, TRUE, &err);
+    if (stage->pool == NULL) {
+        log_log("pipeline: could not start stage %s: %s\n", stage->name, err ? err->message : "");
+        g_clear_error(&err);
+        g_cond_clear(&stage->space);
+        g_mutex_clear(&stage->lock);
+        g_free(stage->name);
+        g_free(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+static
+gint _pipeline_stage_push(CIPipelineStage *stage, gpointer item, gboolean wait)
+{
+    CIPipelineItem *pi;
+
+    if (stage == NULL)
+        return 1;
+
+    g_mutex_lock(&stage->lock);
+    if (stage->stats.queued >= stage->stats.max_queue) {
+        if (!wait) {
+            g_mutex_unlock(&stage->lock);
+            return 3;
+        }
+        ++stage->stats.stalls;
+        while (stage->stats.queued >= stage->stats.max_queue)
+            g_cond_wait(&stage->space, &stage->lock);
+    }
+    ++stage->stats.queued;
+    g_mutex_unlock(&stage->lock);
+
+    pi = g_malloc(sizeof(CIPipelineItem));
+    pi->data = item;
+    pi->queued_at = g_get_monotonic_time();
+
+    if (!g_thread_pool_push(stage->pool, pi, NULL)) {
+        g_mutex_lock(&stage->lock);
+        --stage->stats.queued;
+        g_cond_signal(&stage->space);
+        g_mutex_unlock(&stage->lock);
+        g_free(pi);
+        return 2;
+    }
+
+    return 0;
+}
+
+gint pipeline_stage_push(CIPipelineStage *stage, gpointer item)
+{
+    return _pipeline_stage_push(stage, item, TRUE);
+}
+
+gint pipeline_stage_try_push(CIPipelineStage *stage, gpointer item)
+{
+    return _pipeline_stage_push(stage, item, FALSE);
+}
+
+const gchar *pipeline_stage_get_name(CIPipelineStage *stage)
+{
+    return stage ? stage->name : NULL;
+}
+
+void pipeline_stage_get_stats(CIPipelineStage *stage, CIPipelineStageStats *stats)
+{
+    if (stage == NULL || stats == NULL)
+        return;
+
+    g_mutex_lock(&stage->lock);
+    memcpy(stats, &stage->stats, sizeof(CIPipelineStageStats));
+    g_mutex_unlock(&stage->lock);
+}
+
+void pipeline_stage_log_stats(CIPipelineStage *stage)
+{
+    CIPipelineStageStats stats;
+
+    if (stage == NULL)
+        return;
+
+    pipeline_stage_get_stats(stage, &stats);
+    log_log("pipeline %s: %" G_GUINT64_FORMAT " items, %" G_GUINT64_FORMAT " stalls, "
+            "wait avg/max %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " us, "
+            "run avg/max %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " us\n",
+            stage->name, stats.processed, stats.stalls,
+            stats.processed ? stats.wait_total / stats.processed : 0, stats.wait_max,
+            stats.processed ? stats.run_total / stats.processed : 0, stats.run_max);
+}
+
+/* Waits until every queued item has been processed. */
+void pipeline_stage_free(CIPipelineStage *stage)
+{
+    if (stage == NULL)
+        return;
+
+    g_thread_pool_free(stage->pool, FALSE, TRUE);
+    pipeline_stage_log_stats(stage);
+    g_cond_clear(&stage->space);
+    g_mutex_clear(&stage->lock);
+    g_free(stage->name);
+    g_free(stage);
+}
@@ -0,0 +1,36 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <glib.h>
+
+/* A pipeline stage is a pool of worker threads with a bounded queue in front.
+ * Pushing to a full stage blocks the caller until a worker picks up an item,
+ * so a slow stage backs up only the stages feeding it. */
+
+typedef struct _CIPipelineStage CIPipelineStage;
+
+typedef void (*CIPipelineFunc)(gpointer item, gpointer userdata);
+
+typedef struct _CIPipelineStageStats {
+    guint workers;
+    guint max_queue;
+    guint queued;           /* items waiting for a worker */
+    guint64 processed;
+    guint64 stalls;         /* pushes that had to wait for queue space */
+    guint64 wait_total;     /* usec spent in the queue, summed over all items */
+    guint64 wait_max;
+    guint64 run_total;      /* usec spent in the stage function */
+    guint64 run_max;
+} CIPipelineStageStats;
+
+CIPipelineStage *pipeline_stage_new(const gchar *name, CIPipelineFunc func, gpointer userdata,
+                                    guint workers, guint max_queue);
+gint pipeline_stage_push(CIPipelineStage *stage, gpointer item);
+/* returns 3 instead of waiting when the stage is full */
+gint pipeline_stage_try_push(CIPipelineStage *stage, gpointer item);
+const gchar *pipeline_stage_get_name(CIPipelineStage *stage);
+void pipeline_stage_get_stats(CIPipelineStage *stage, CIPipelineStageStats *stats);
+void pipeline_stage_log_stats(CIPipelineStage *stage);
+void pipeline_stage_free(CIPipelineStage *stage);
+
+#endif
@@ -0,0 +1,198 @@
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory.h>
+#include <errno.h>
+#include "CIData.h"
+#include "journal.h"
+#include "dbhandler.h"
+#include "lookup.h"
+#include "ci_areacodes.h"
+#include "msn_lookup.h"
+#include "logging.h"
+
+#define REPLAY_FIELD_COUNT          8
+#define REPLAY_READ_BUFFER          (1024 * 1024)
+
+/* strip surrounding quotes and copy */
+static
+void _replay_copy_field(gchar *dst, gsize size, gchar *src)
+{
+    gsize len = strlen(src);
+
+    if (len >= 2 && src[0] == '"' && src[len - 1] == '"') {
+        src[len - 1] = '\0';
+        ++src;
+    }
+    g_strlcpy(dst, src, size);
+}
+
+/* The journal stores dates as dd.mm.YYYY; the database expects YYYY-mm-dd. */
+static
+gint _replay_convert_date(gchar *dst, const gchar *src)
+{
+    gint day, month, year;
+
+    if (sscanf(src, "%2d.%2d.%4d", &day, &month, &year) != 3 &&
+            sscanf(src, "%4d-%2d-%2d", &year, &month, &day) != 3)
+        return 1;
+    if (day < 1 || day > 31 || month < 1 || month > 12 || year < 1970 || year > 9999)
+        return 1;
+    snprintf(dst, 16, "%04d-%02d-%02d", year, month, day);
+    return 0;
+}
+
+static
+gint _replay_check_time(const gchar *time)
+{
+    gint hour, min, sec;
+
+    if (sscanf(time, "%2d:%2d:%2d", &hour, &min, &sec) != 3)
+        return 1;
+    return (hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60);
+}
+
+/* 0: parsed, 1: malformed, 2: checksum mismatch */
+static
+gint _replay_parse_line(gchar *line, CIDataSet *set)
+{
+    gchar *fields[REPLAY_FIELD_COUNT];
+    gchar *payload = line, *p, *end;
+    const gsize seplen = strlen(JOURNAL_SEPARATOR);
+    guint32 crc;
+    gint i;
+
+    if (line[0] == '#') {
+        /* #<seq>§<crc32>§<payload> */
+        g_ascii_strtoull(line + 1, &end, 10);
+        if (end == line + 1 || strncmp(end, JOURNAL_SEPARATOR, seplen) != 0)
+            return 1;
+        p = end + seplen;
+        crc = (guint32)strtoul(p, &end, 16);
+        if (end == p || strncmp(end, JOURNAL_SEPARATOR, seplen) != 0)
+            return 1;
+        payload = end + seplen;
+        if (journal_crc32(payload, strlen(payload)) != crc)
+            return 2;
+    }
+
+    p = payload;
+    for (i = 0; i < REPLAY_FIELD_COUNT; ++i) {
+        fields[i] = p;
+        if (i == REPLAY_FIELD_COUNT - 1)
+            break;
+        if ((end = strstr(p, JOURNAL_SEPARATOR)) == NULL)
+            return 1;
+        *end = '\0';
+        p = end + seplen;
+    }
+
+    memset(set, 0, sizeof(CIDataSet));
+    _replay_copy_field(set->cidsNumberComplete, sizeof(set->cidsNumberComplete), fields[0]);
+    _replay_copy_field(set->cidsName, sizeof(set->cidsName), fields[1]);
+    _replay_copy_field(set->cidsDate, sizeof(set->cidsDate), fields[2]);
+    _replay_copy_field(set->cidsTime, sizeof(set->cidsTime), fields[3]);
+    _replay_copy_field(set->cidsMSN, sizeof(set->cidsMSN), fields[4]);
+    _replay_copy_field(set->cidsAlias, sizeof(set->cidsAlias), fields[5]);
+    _replay_copy_field(set->cidsService, sizeof(set->cidsService), fields[6]);
+    _replay_copy_field(set->cidsFix, sizeof(set->cidsFix), fields[7]);
+
+    if (_replay_convert_date(set->cidsDate, set->cidsDate) != 0 || _replay_check_time(set->cidsTime) != 0)
+        return 1;
+
+    return 0;
+}
+
+/* Journal lines are written before the online lookup, so the name is usually
+ * just the area. Fill in what the live pipeline would have known. */
+static
+void _replay_enrich(CIDataSet *set)
+{
+    if (set->cidsName[0] == '\0') {
+        ci_get_area_code(set->cidsNumberComplete, set->cidsAreaCode, set->cidsNumber, set->cidsArea);
+        g_strlcpy(set->cidsName, set->cidsArea, sizeof(set->cidsName));
+    }
+    if (set->cidsAlias[0] == '\0')
+        msnl_lookup(set->cidsMSN, set->cidsAlias);
+    lookup_get_cached_caller_data(set);
+}
+
+static
+gint _replay_file(const gchar *file, CIReplayStats *stats)
+{
+    FILE *f;
+    gchar *line = NULL;
+    gchar *iobuf;
+    size_t size = 0;
+    ssize_t len;
+    CIDataSet set;
+    gint rc = 0;
+
+    if ((f = fopen(file, "r")) == NULL) {
+        log_log("replay: could not open %s: %d (%s)\n", file, errno, strerror(errno));
+        return 1;
+    }
+    iobuf = g_malloc(REPLAY_READ_BUFFER);
+    setvbuf(f, iobuf, _IOFBF, REPLAY_READ_BUFFER);
+
+    while ((len = getline(&line, &size, f)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        ++stats->lines;
+
+        switch (_replay_parse_line(line, &set)) {
+            case 0:
+                _replay_enrich(&set);
+                if (dbhandler_bulk_add(&set) != 0) {
+                    ++stats->failed;
+                    rc = 2;
+                    break;
+                }
+                ++stats->rows;
+                break;
+            case 2:
+                ++stats->corrupt;
+                break;
+            default:
+                ++stats->malformed;
+                break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    g_free(iobuf);
+    return rc;
+}
+
+gint replay_journal_files(gchar **files, CIReplayStats *stats)
+{
+    gint64 start;
+    gint rc = 0, frc;
+    gint i;
+
+    if (files == NULL || stats == NULL)
+        return 1;
+    memset(stats, 0, sizeof(CIReplayStats));
+
+    if (dbhandler_bulk_begin() != 0) {
+        log_log("replay: could not start bulk load\n");
+        return 1;
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; files[i] != NULL; ++i) {
+        log_log("replay: reading %s\n", files[i]);
+        if ((frc = _replay_file(files[i], stats)) > rc)
+            rc = frc;
+    }
+
+    if (dbhandler_bulk_end() != 0)
+        rc = 2;
+    stats->seconds = (gdouble)(g_get_monotonic_time() - start) / G_TIME_SPAN_SECOND;
+
+    return rc;
+}
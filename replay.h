@@ -0,0 +1,19 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <glib.h>
+
+typedef struct _CIReplayStats {
+    guint64 lines;
+    guint64 rows;           /* rows inserted */
+    guint64 corrupt;        /* lines failing the checksum */
+    guint64 malformed;      /* lines that could not be parsed */
+    guint64 failed;         /* rows the database did not take */
+    gdouble seconds;
+} CIReplayStats;
+
+/* Load journal files (old and new record format) into the call database.
+ * Area code, msn and lookup cache must be initialized. */
+gint replay_journal_files(gchar **files, CIReplayStats *stats);
+
+#endif